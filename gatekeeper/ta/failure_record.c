@@ -17,70 +17,719 @@
 
 #include <string.h>
 #include <tee_internal_api.h>
+#include <tee_internal_api_extensions.h>
 #include "failure_record.h"
 
-#define MAX_FAILURE_RECORDS 32
+#define MAX_FAILURE_RECORDS CFG_GK_MAX_FAILURE_RECORDS
 
+/* Hash bucket count, power of two and at least twice MAX_FAILURE_RECORDS */
+#define FAILURE_RECORD_BUCKETS (MAX_FAILURE_RECORDS <= 16 ? 32U :	\
+				MAX_FAILURE_RECORDS <= 32 ? 64U :	\
+				MAX_FAILURE_RECORDS <= 64 ? 128U :	\
+				MAX_FAILURE_RECORDS <= 128 ? 256U :	\
+				MAX_FAILURE_RECORDS <= 256 ? 512U : 1024U)
+
+#define NO_SLOT UINT32_MAX
+
+#define FAILURE_JOURNAL_MAGIC 0x524B4647
+#define FAILURE_JOURNAL_VERSION 1
+
+#if MAX_FAILURE_RECORDS < 1 || MAX_FAILURE_RECORDS > 512
+#error "CFG_GK_MAX_FAILURE_RECORDS must be in range 1..512"
+#endif
+#if CFG_GK_FAILURE_JOURNAL_ENTRIES < MAX_FAILURE_RECORDS
+#error "CFG_GK_FAILURE_JOURNAL_ENTRIES must hold a full table"
+#endif
+
+/*
+ * The journal is a header followed by failure_record_t entries, a later
+ * entry for a secure user id replaces the earlier ones. Compaction rewrites
+ * it with the records of the table which still count failures.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} failure_journal_header_t;
+
+typedef struct {
+	failure_record_t record;
+	/* record as last written to the journal */
+	failure_record_t stored;
+	/* false if the journal may hold something else than stored */
+	bool known;
+	uint32_t hash_next;	/* next slot in the same bucket */
+	uint32_t lru_prev;	/* slot to be replaced just before this one */
+	uint32_t lru_next;	/* slot to be replaced just after this one */
+} failure_slot_t;
+
+/*
+ * Records are found through buckets hashed by secure user id. When the
+ * table is full the head of the LRU list is replaced: records without
+ * failures go to the head, the others to the tail as they are written,
+ * which keeps replacing the record with the oldest timestamp first.
+ */
 typedef struct {
 	uint32_t size;
-	failure_record_t records[MAX_FAILURE_RECORDS];
+	uint32_t buckets[FAILURE_RECORD_BUCKETS];
+	uint32_t lru_head;
+	uint32_t lru_tail;
+	failure_slot_t slots[MAX_FAILURE_RECORDS];
 } failure_record_table_t;
 
 static failure_record_table_t failureRecordTable;
 
+static const uint8_t failureJournalID[] = {0xB1, 0x6B, 0xFA, 0x11};
+static TEE_ObjectHandle failureJournal = TEE_HANDLE_NULL;
+static bool failureJournalLoaded;
+/*
+ * No record was dropped from the table since the journal was read or
+ * compacted, so users missing from the table have no failures stored
+ */
+static bool failureJournalComplete;
+/* Entries in the journal */
+static uint32_t failureJournalEntries;
+
 
 void InitFailureRecords(void)
 {
+	uint32_t i;
+
 	memset(&failureRecordTable, 0, sizeof(failureRecordTable));
+	for (i = 0; i < FAILURE_RECORD_BUCKETS; i++)
+		failureRecordTable.buckets[i] = NO_SLOT;
+	failureRecordTable.lru_head = NO_SLOT;
+	failureRecordTable.lru_tail = NO_SLOT;
+	CloseFailureRecords();
+	failureJournalLoaded = false;
+	failureJournalComplete = true;
+	failureJournalEntries = 0;
 }
 
 
-void GetFailureRecord(secure_id_t user_id, failure_record_t *record)
+void CloseFailureRecords(void)
 {
-	uint32_t i;
-	failure_record_t *records = failureRecordTable.records;
-	uint32_t tableSize = failureRecordTable.size;
+	if (failureJournal != TEE_HANDLE_NULL)
+		TEE_CloseObject(failureJournal);
+	failureJournal = TEE_HANDLE_NULL;
+}
+
+
+static bool SameFailureRecord(const failure_record_t *a,
+		const failure_record_t *b)
+{
+	return a->secure_user_id == b->secure_user_id &&
+		a->failure_counter == b->failure_counter &&
+		a->last_checked_timestamp == b->last_checked_timestamp;
+}
+
+
+static bool FailureRecordChanged(const failure_slot_t *slot)
+{
+	return !slot->known || !SameFailureRecord(&slot->record,
+			&slot->stored);
+}
+
+
+/* Copies field by field so no padding from the stack reaches storage */
+static void CopyFailureRecord(failure_record_t *dst,
+		const failure_record_t *src)
+{
+	dst->secure_user_id = src->secure_user_id;
+	dst->last_checked_timestamp = src->last_checked_timestamp;
+	dst->failure_counter = src->failure_counter;
+}
+
+
+static uint32_t *FailureRecordBucket(secure_id_t user_id)
+{
+	/* secure user ids are random, folding them is enough */
+	uint32_t hash = (uint32_t)(user_id ^ (user_id >> 32));
+
+	return &failureRecordTable.buckets[hash &
+		(FAILURE_RECORD_BUCKETS - 1)];
+}
+
+
+static uint32_t FindFailureRecord(secure_id_t user_id)
+{
+	uint32_t i = *FailureRecordBucket(user_id);
+
+	while (i != NO_SLOT &&
+			failureRecordTable.slots[i].record.secure_user_id !=
+			user_id)
+		i = failureRecordTable.slots[i].hash_next;
+	return i;
+}
+
+
+static void UnhashFailureRecord(uint32_t i)
+{
+	uint32_t *link = FailureRecordBucket(
+			failureRecordTable.slots[i].record.secure_user_id);
+
+	while (*link != i)
+		link = &failureRecordTable.slots[*link].hash_next;
+	*link = failureRecordTable.slots[i].hash_next;
+}
+
 
-	for (i = 0; i < tableSize; i++) {
-		if (records[i].secure_user_id == user_id) {
-			*record = records[i];
-			return;
+static void LruUnlink(uint32_t i)
+{
+	failure_slot_t *slot = &failureRecordTable.slots[i];
+
+	if (slot->lru_prev != NO_SLOT)
+		failureRecordTable.slots[slot->lru_prev].lru_next =
+			slot->lru_next;
+	else
+		failureRecordTable.lru_head = slot->lru_next;
+	if (slot->lru_next != NO_SLOT)
+		failureRecordTable.slots[slot->lru_next].lru_prev =
+			slot->lru_prev;
+	else
+		failureRecordTable.lru_tail = slot->lru_prev;
+	slot->lru_prev = NO_SLOT;
+	slot->lru_next = NO_SLOT;
+}
+
+
+static void LruInsert(uint32_t i, bool at_head)
+{
+	failure_slot_t *slot = &failureRecordTable.slots[i];
+
+	if (at_head) {
+		slot->lru_prev = NO_SLOT;
+		slot->lru_next = failureRecordTable.lru_head;
+		if (slot->lru_next != NO_SLOT)
+			failureRecordTable.slots[slot->lru_next].lru_prev = i;
+		else
+			failureRecordTable.lru_tail = i;
+		failureRecordTable.lru_head = i;
+	} else {
+		slot->lru_next = NO_SLOT;
+		slot->lru_prev = failureRecordTable.lru_tail;
+		if (slot->lru_prev != NO_SLOT)
+			failureRecordTable.slots[slot->lru_prev].lru_next = i;
+		else
+			failureRecordTable.lru_head = i;
+		failureRecordTable.lru_tail = i;
+	}
+}
+
+
+/*
+ * Stores @record in the table, replacing the oldest record if the table is
+ * full, and returns its index
+ */
+static uint32_t PutFailureRecord(const failure_record_t *record)
+{
+	uint32_t i = FindFailureRecord(record->secure_user_id);
+	uint32_t *bucket;
+	failure_slot_t *slot;
+
+	if (i != NO_SLOT) {
+		LruUnlink(i);
+	} else {
+		if (failureRecordTable.size < MAX_FAILURE_RECORDS) {
+			i = failureRecordTable.size++;
+		} else {
+			// replace the oldest element if all records are in
+			// use, the replaced one stays in the journal and is
+			// carried over by compaction. Records not stored yet
+			// are only replaced if there is nothing else.
+			i = failureRecordTable.lru_head;
+			while (i != NO_SLOT &&
+					FailureRecordChanged(
+					&failureRecordTable.slots[i]))
+				i = failureRecordTable.slots[i].lru_next;
+			if (i == NO_SLOT)
+				i = failureRecordTable.lru_head;
+			LruUnlink(i);
+			UnhashFailureRecord(i);
+			failureJournalComplete = false;
 		}
+		slot = &failureRecordTable.slots[i];
+		bucket = FailureRecordBucket(record->secure_user_id);
+		slot->hash_next = *bucket;
+		*bucket = i;
+		memset(&slot->stored, 0, sizeof(slot->stored));
+		slot->stored.secure_user_id = record->secure_user_id;
+		slot->known = failureJournalComplete;
+	}
+
+	failureRecordTable.slots[i].record = *record;
+	LruInsert(i, record->failure_counter == 0);
+	return i;
+}
+
+
+/*
+ * Reads all entries of the open @journal into @entries, which the caller
+ * frees. A partial entry left at the end by a torn append is not counted,
+ * @torn tells it was there.
+ */
+static TEE_Result ReadFailureJournal(TEE_ObjectHandle journal,
+		failure_record_t **entries, uint32_t *count, bool *torn)
+{
+	TEE_Result res;
+	TEE_ObjectInfo info;
+	failure_journal_header_t header;
+	uint32_t readSize = 0;
+	uint32_t size;
+
+	*entries = NULL;
+	*count = 0;
+	*torn = false;
+
+	res = TEE_GetObjectInfo1(journal, &info);
+	if (res != TEE_SUCCESS)
+		return res;
+	res = TEE_SeekObjectData(journal, 0, TEE_DATA_SEEK_SET);
+	if (res != TEE_SUCCESS)
+		return res;
+	res = TEE_ReadObjectData(journal, &header, sizeof(header), &readSize);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (readSize != sizeof(header) ||
+			header.magic != FAILURE_JOURNAL_MAGIC ||
+			header.version != FAILURE_JOURNAL_VERSION)
+		return TEE_ERROR_BAD_FORMAT;
+
+	size = info.dataSize - sizeof(header);
+	if (size / sizeof(**entries) > CFG_GK_FAILURE_JOURNAL_ENTRIES)
+		return TEE_ERROR_BAD_FORMAT;
+	*torn = size % sizeof(**entries) != 0;
+	size -= size % sizeof(**entries);
+	if (!size)
+		return TEE_SUCCESS;
+
+	*entries = TEE_Malloc(size, TEE_MALLOC_FILL_ZERO);
+	if (!*entries)
+		return TEE_ERROR_OUT_OF_MEMORY;
+	res = TEE_ReadObjectData(journal, *entries, size, &readSize);
+	if (res == TEE_SUCCESS && readSize != size)
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS) {
+		TEE_Free(*entries);
+		*entries = NULL;
+		return res;
 	}
 
+	*count = size / sizeof(**entries);
+	return TEE_SUCCESS;
+}
+
+
+/* true if a later journal entry replaces @entries[@i] */
+static bool FailureEntrySuperseded(const failure_record_t *entries,
+		uint32_t count, uint32_t i)
+{
+	uint32_t j;
+
+	for (j = i + 1; j < count; j++) {
+		if (entries[j].secure_user_id == entries[i].secure_user_id)
+			return true;
+	}
+	return false;
+}
+
+
+/*
+ * Reads the entries of the journal for records dropped from the table. The
+ * journal is opened for the read if it was closed after a failed write.
+ * There is nothing to read from a journal of an unknown format.
+ */
+static TEE_Result ReadStoredFailureRecords(failure_record_t **entries,
+		uint32_t *count)
+{
+	TEE_Result res;
+	TEE_ObjectHandle journal = failureJournal;
+	bool torn;
+
+	*entries = NULL;
+	*count = 0;
+
+	if (journal == TEE_HANDLE_NULL) {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+				failureJournalID, sizeof(failureJournalID),
+				TEE_DATA_FLAG_ACCESS_READ, &journal);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			return TEE_SUCCESS;
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	res = ReadFailureJournal(journal, entries, count, &torn);
+	if (journal != failureJournal)
+		TEE_CloseObject(journal);
+	if (res == TEE_ERROR_BAD_FORMAT)
+		return TEE_SUCCESS;
+	return res;
+}
+
+
+/*
+ * Looks up the stored record of @user_id, which is not in the table, in
+ * the journal. @record counts no failures if there is no entry for it.
+ */
+static TEE_Result FindStoredFailureRecord(secure_id_t user_id,
+		failure_record_t *record)
+{
+	TEE_Result res;
+	failure_record_t *entries;
+	uint32_t count;
+	uint32_t i;
+
+	memset(record, 0, sizeof(*record));
 	record->secure_user_id = user_id;
-	record->failure_counter = 0;
-	record->last_checked_timestamp = 0;
+
+	res = ReadStoredFailureRecords(&entries, &count);
+	if (res != TEE_SUCCESS)
+		return res;
+	for (i = count; i > 0; i--) {
+		if (entries[i - 1].secure_user_id == user_id) {
+			CopyFailureRecord(record, &entries[i - 1]);
+			break;
+		}
+	}
+	TEE_Free(entries);
+	return TEE_SUCCESS;
 }
 
 
-void WriteFailureRecord(const failure_record_t *record)
+/*
+ * Takes the stored @entry into the table. Failures counted in memory while
+ * the journal could not be read are kept if there are more of them.
+ */
+static void MergeFailureRecord(const failure_record_t *entry)
+{
+	uint32_t i = FindFailureRecord(entry->secure_user_id);
+	failure_slot_t *slot;
+
+	if (i == NO_SLOT || entry->failure_counter >
+			failureRecordTable.slots[i].record.failure_counter)
+		i = PutFailureRecord(entry);
+	slot = &failureRecordTable.slots[i];
+	CopyFailureRecord(&slot->stored, entry);
+	slot->known = true;
+}
+
+
+/*
+ * Reads the journal into the table the first time records are needed. If
+ * storage can't be read the table only lives in memory and reading is
+ * tried again later. Nothing is taken from a journal which is not read
+ * through.
+ */
+static void LoadFailureRecords(void)
 {
+	TEE_Result res;
+	failure_record_t *entries = NULL;
+	uint32_t count = 0;
+	bool torn = false;
 	uint32_t i;
-	failure_record_t *records = failureRecordTable.records;
 
-	int min_idx = 0;
-	uint64_t min_timestamp = ~0ULL;
+	if (failureJournalLoaded)
+		return;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, failureJournalID,
+			sizeof(failureJournalID),
+			TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_ACCESS_WRITE,
+			&failureJournal);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		DMSG("No failure journal yet");
+		goto loaded;
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open failure journal, error=%X", res);
+		failureJournal = TEE_HANDLE_NULL;
+		return;
+	}
+
+	res = ReadFailureJournal(failureJournal, &entries, &count, &torn);
+	if (res == TEE_ERROR_BAD_FORMAT) {
+		EMSG("Unknown failure journal format, starting over");
+		/* the next commit compacts it into a new journal */
+		CloseFailureRecords();
+		goto loaded;
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to read failure journal, error=%X", res);
+		CloseFailureRecords();
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!FailureEntrySuperseded(entries, count, i))
+			MergeFailureRecord(&entries[i]);
+	}
+	TEE_Free(entries);
+	failureJournalEntries = count;
 
+	if (torn) {
+		/* appending after it would misalign the rest */
+		EMSG("Failure journal has a partial entry");
+		CloseFailureRecords();
+	}
+
+loaded:
+	failureJournalLoaded = true;
+}
+
+
+/*
+ * Returns the index of the entry of @entries with the fewest failures
+ */
+static uint32_t FewestFailuresEntry(const failure_record_t *entries,
+		uint32_t count)
+{
+	uint32_t min = 0;
+	uint32_t i;
+
+	for (i = 1; i < count; i++) {
+		if (entries[i].failure_counter < entries[min].failure_counter)
+			min = i;
+	}
+	return min;
+}
+
+
+/*
+ * Replaces the journal with the records which count failures, in a single
+ * atomic write. Records dropped from the table are carried over from the
+ * old journal, if there are more of them than it can hold the ones with
+ * the fewest failures are left out.
+ */
+static TEE_Result CompactFailureJournal(void)
+{
+	TEE_Result res;
+	failure_journal_header_t *header;
+	failure_record_t *records;
+	failure_record_t *stored = NULL;
+	uint8_t *journal;
+	uint32_t storedCount = 0;
+	uint32_t carried = 0;
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (!failureJournalComplete) {
+		res = ReadStoredFailureRecords(&stored, &storedCount);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to read failure journal, error=%X", res);
+			return res;
+		}
+	}
+
+	journal = TEE_Malloc(sizeof(*header) +
+			CFG_GK_FAILURE_JOURNAL_ENTRIES * sizeof(*records),
+			TEE_MALLOC_FILL_ZERO);
+	if (!journal) {
+		EMSG("Failed to allocate failure journal");
+		TEE_Free(stored);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	header = (failure_journal_header_t *)journal;
+	records = (failure_record_t *)(header + 1);
+	header->magic = FAILURE_JOURNAL_MAGIC;
+	header->version = FAILURE_JOURNAL_VERSION;
 	for (i = 0; i < failureRecordTable.size; i++) {
-		if (records[i].secure_user_id == record->secure_user_id) {
-			break;
+		if (failureRecordTable.slots[i].record.failure_counter == 0)
+			continue;
+		CopyFailureRecord(&records[count++],
+				&failureRecordTable.slots[i].record);
+	}
+
+	for (i = 0; i < storedCount; i++) {
+		if (stored[i].failure_counter == 0 ||
+				FailureEntrySuperseded(stored, storedCount, i) ||
+				FindFailureRecord(stored[i].secure_user_id) !=
+				NO_SLOT)
+			continue;
+		stored[carried++] = stored[i];
+	}
+	if (carried > CFG_GK_FAILURE_JOURNAL_ENTRIES - count)
+		EMSG("Failure journal is full, dropping %u records",
+				carried - (CFG_GK_FAILURE_JOURNAL_ENTRIES - count));
+	while (carried > CFG_GK_FAILURE_JOURNAL_ENTRIES - count) {
+		carried--;
+		stored[FewestFailuresEntry(stored, carried + 1)] =
+			stored[carried];
+	}
+	for (i = 0; i < carried; i++)
+		CopyFailureRecord(&records[count++], &stored[i]);
+	TEE_Free(stored);
+
+	/* an open handle would make the overwrite fail */
+	CloseFailureRecords();
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, failureJournalID,
+			sizeof(failureJournalID),
+			TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_ACCESS_WRITE |
+			TEE_DATA_FLAG_OVERWRITE, TEE_HANDLE_NULL, journal,
+			sizeof(*header) + count * sizeof(*records),
+			&failureJournal);
+	TEE_Free(journal);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to write failure journal, error=%X", res);
+		failureJournal = TEE_HANDLE_NULL;
+		return res;
+	}
+
+	failureJournalEntries = count;
+	/* users missing from the table may still be in the journal */
+	failureJournalComplete = !carried;
+	return TEE_SUCCESS;
+}
+
+
+static TEE_Result AppendFailureJournal(const failure_record_t *entries,
+		uint32_t count)
+{
+	TEE_Result res;
+
+	res = TEE_SeekObjectData(failureJournal, 0, TEE_DATA_SEEK_END);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(failureJournal, entries,
+				count * sizeof(entries[0]));
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to append to failure journal, error=%X", res);
+		/* the next commit compacts, dropping a torn entry */
+		CloseFailureRecords();
+		return res;
+	}
+
+	failureJournalEntries += count;
+	return TEE_SUCCESS;
+}
+
+
+TEE_Result CommitFailureRecords(void)
+{
+	TEE_Result res;
+	failure_record_t *entries = NULL;
+	failure_record_t stored;
+	failure_slot_t *slot;
+	uint32_t count = 0;
+	uint32_t i;
+
+	/*
+	 * A record put in the table while the journal could not be looked up
+	 * must not replace more failures stored for it
+	 */
+	for (i = 0; failureJournalLoaded && i < failureRecordTable.size; i++) {
+		slot = &failureRecordTable.slots[i];
+		if (slot->known)
+			continue;
+		res = FindStoredFailureRecord(slot->record.secure_user_id,
+				&stored);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to read failure journal, error=%X", res);
+			return res;
 		}
+		MergeFailureRecord(&stored);
+	}
+
+	for (i = 0; i < failureRecordTable.size; i++) {
+		if (FailureRecordChanged(&failureRecordTable.slots[i]))
+			count++;
+	}
+	if (!count)
+		return TEE_SUCCESS;
+
+	if (!failureJournalLoaded) {
+		/* writing before the journal is read would lose what it holds */
+		LoadFailureRecords();
+		if (!failureJournalLoaded)
+			return TEE_ERROR_STORAGE_NOT_AVAILABLE;
+		/* reading it may have changed the table */
+		return CommitFailureRecords();
+	}
 
-		if (records[i].last_checked_timestamp <= min_timestamp) {
-			min_timestamp = records[i].last_checked_timestamp;
-			min_idx = i;
+	if (failureJournal == TEE_HANDLE_NULL ||
+			failureJournalEntries + count >
+			CFG_GK_FAILURE_JOURNAL_ENTRIES) {
+		res = CompactFailureJournal();
+	} else {
+		entries = TEE_Malloc(count * sizeof(*entries),
+				TEE_MALLOC_FILL_ZERO);
+		if (!entries) {
+			EMSG("Failed to allocate failure journal entries");
+			return TEE_ERROR_OUT_OF_MEMORY;
+		}
+		count = 0;
+		for (i = 0; i < failureRecordTable.size; i++) {
+			slot = &failureRecordTable.slots[i];
+			if (FailureRecordChanged(slot))
+				CopyFailureRecord(&entries[count++],
+						&slot->record);
 		}
+		res = AppendFailureJournal(entries, count);
+		TEE_Free(entries);
 	}
+	if (res != TEE_SUCCESS)
+		return res;
 
-	if (i >= MAX_FAILURE_RECORDS) {
-		// replace the oldest element if all records are in use
-		i = min_idx;
-	} else if (i == failureRecordTable.size) {
-		failureRecordTable.size++;
+	for (i = 0; i < failureRecordTable.size; i++) {
+		slot = &failureRecordTable.slots[i];
+		slot->stored = slot->record;
+		slot->known = true;
+	}
+	return TEE_SUCCESS;
+}
+
+
+/*
+ * Finds the record of @user_id, which is brought back from the journal if
+ * it was dropped from the table. @index is NO_SLOT if the user has no
+ * record, an error is returned if the journal can't be read.
+ */
+static TEE_Result LookUpFailureRecord(secure_id_t user_id, uint32_t *index)
+{
+	TEE_Result res;
+	failure_record_t stored;
+
+	LoadFailureRecords();
+	if (!failureJournalLoaded)
+		return TEE_ERROR_STORAGE_NOT_AVAILABLE;
+	*index = FindFailureRecord(user_id);
+	if (*index != NO_SLOT || failureJournalComplete)
+		return TEE_SUCCESS;
+	res = FindStoredFailureRecord(user_id, &stored);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to look up failure record, error=%X", res);
+		return res;
 	}
+	/* dropped from the table, but its failures still count */
+	MergeFailureRecord(&stored);
+	*index = FindFailureRecord(user_id);
+	return TEE_SUCCESS;
+}
+
+
+TEE_Result GetFailureRecord(secure_id_t user_id, failure_record_t *record)
+{
+	TEE_Result res;
+	uint32_t i = NO_SLOT;
+
+	record->secure_user_id = user_id;
+	record->failure_counter = 0;
+	record->last_checked_timestamp = 0;
+
+	res = LookUpFailureRecord(user_id, &i);
+	if (res == TEE_SUCCESS && i != NO_SLOT)
+		*record = failureRecordTable.slots[i].record;
+	return res;
+}
+
+
+void WriteFailureRecord(const failure_record_t *record)
+{
+	uint32_t i;
 
-	records[i] = *record;
+	/*
+	 * The stored record has to be known to tell if it changes, if it
+	 * can't be looked up the commit tries again
+	 */
+	LookUpFailureRecord(record->secure_user_id, &i);
+	PutFailureRecord(record);
 }
 
 
@@ -20,8 +20,25 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <tee_internal_api.h>
 #include "ta_gatekeeper.h"
 
+/*
+ * Number of secure user ids whose failures are tracked, can be overridden
+ * at build time
+ */
+#ifndef CFG_GK_MAX_FAILURE_RECORDS
+#define CFG_GK_MAX_FAILURE_RECORDS 32
+#endif
+
+/*
+ * Number of records the failure journal may hold before it is compacted,
+ * can be overridden at build time
+ */
+#ifndef CFG_GK_FAILURE_JOURNAL_ENTRIES
+#define CFG_GK_FAILURE_JOURNAL_ENTRIES 128
+#endif
+
 /*
  * Structure is a failure table entry
  */
@@ -32,18 +49,37 @@ typedef struct {
 } failure_record_t;
 
 /*
- * Initialize failure record table
+ * Initialize failure record table, the persistent journal is read on first
+ * use
  */
 void InitFailureRecords(void);
 
+/*
+ * Writes the records changed since the last commit to the persistent
+ * journal, with at most one secure storage write. Nothing is written if
+ * the records are back to their stored values.
+ *
+ * @return TEE_SUCCESS once the journal holds the records
+ */
+TEE_Result CommitFailureRecords(void);
+
+/*
+ * Close the persistent journal
+ */
+void CloseFailureRecords(void);
+
 /*
  * Returns failure @record for secure @user_id
+ *
+ * @return TEE_SUCCESS, or an error if the stored record can't be read, in
+ * which case @record must not be relied on
  */
-void GetFailureRecord(secure_id_t user_id, failure_record_t *record);
+TEE_Result GetFailureRecord(secure_id_t user_id, failure_record_t *record);
 
 /*
  * Write failure @record to failure record table. Function will rewrite the
- * oldest record if failure record table is full
+ * oldest record if failure record table is full. The journal is updated on
+ * the next CommitFailureRecords
  */
 void WriteFailureRecord(const failure_record_t *record);
 
@@ -25,11 +25,22 @@
 
 static uint8_t	secret_ID[] = {0xB1, 0x6B, 0x00, 0xB5};
 
+/*
+ * HMAC-SHA256 operations keyed with the master key and with the auth_token
+ * key shared by keymaster. Each is set up on first use and reset by
+ * TEE_MACInit per signature, so enroll and verify neither read secure
+ * storage nor open a session to keymaster every time.
+ */
+static TEE_OperationHandle	masterKeyOp = TEE_HANDLE_NULL;
+static TEE_OperationHandle	authTokenOp = TEE_HANDLE_NULL;
+
 TEE_Result TA_CreateEntryPoint(void)
 {
 	TEE_Result		res = TEE_SUCCESS;
 	TEE_ObjectHandle	secretObj = TEE_HANDLE_NULL;
 
+	InitFailureRecords();
+
 	DMSG("Checking master key secret");
 	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, secret_ID,
 		sizeof(secret_ID), TEE_DATA_FLAG_ACCESS_READ, &secretObj);
@@ -63,6 +74,14 @@ TEE_Result TA_CreateEntryPoint(void)
 
 void TA_DestroyEntryPoint(void)
 {
+	CloseFailureRecords();
+	/* wipes the key material */
+	if (masterKeyOp != TEE_HANDLE_NULL)
+		TEE_FreeOperation(masterKeyOp);
+	masterKeyOp = TEE_HANDLE_NULL;
+	if (authTokenOp != TEE_HANDLE_NULL)
+		TEE_FreeOperation(authTokenOp);
+	authTokenOp = TEE_HANDLE_NULL;
 }
 
 TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
@@ -75,8 +94,6 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	InitFailureRecords();
-
 	/* Unused parameters */
 	(void)&params;
 	(void)&sess_ctx;
@@ -109,6 +126,8 @@ static TEE_Result TA_GetMasterKey(TEE_ObjectHandle masterKey)
 			&readSize);
 	if (res != TEE_SUCCESS || sizeof(secretData) != readSize) {
 		EMSG("Failed to read secret data, bytes = %u", readSize);
+		if (res == TEE_SUCCESS)
+			res = TEE_ERROR_CORRUPT_OBJECT;
 		goto close_obj;
 	}
 
@@ -124,38 +143,83 @@ static TEE_Result TA_GetMasterKey(TEE_ObjectHandle masterKey)
 
 close_obj:
 	TEE_CloseObject(secretObj);
+	memset(secretData, 0, sizeof(secretData));
 exit:
 	return res;
 }
 
-static TEE_Result TA_ComputeSignature(uint8_t *signature, size_t signature_length,
-		TEE_ObjectHandle key, const uint8_t *message, size_t length)
+/*
+ * Sets up an HMAC operation keyed by @getKey in @op, the transient key
+ * object is only needed until the operation has its own copy
+ */
+static TEE_Result TA_CreateMacOperation(TEE_OperationHandle *op,
+		TEE_Result (*getKey)(TEE_ObjectHandle key))
 {
-	uint32_t buf_length = HMAC_SHA256_KEY_SIZE_BYTE;
-	uint8_t buf[buf_length];
-	TEE_OperationHandle op = TEE_HANDLE_NULL;
-	TEE_Result res;
-	uint32_t to_write;
+	TEE_Result		res;
+	TEE_ObjectHandle	key = TEE_HANDLE_NULL;
+
+	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
+			HMAC_SHA256_KEY_SIZE_BIT, &key);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to allocate HMAC key");
+		goto exit;
+	}
 
-	res = TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
+	res = getKey(key);
+	if (res != TEE_SUCCESS)
+		goto free_key;
+
+	res = TEE_AllocateOperation(op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
 			HMAC_SHA256_KEY_SIZE_BIT);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to allocate HMAC operation");
-		goto exit;
+		goto free_key;
 	}
 
-	res = TEE_SetOperationKey(op, key);
+	res = TEE_SetOperationKey(*op, key);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to set secret key");
-		goto free_op;
+		TEE_FreeOperation(*op);
+		*op = TEE_HANDLE_NULL;
 	}
 
+free_key:
+	TEE_FreeTransientObject(key);
+exit:
+	return res;
+}
+
+/* Returns the master key operation, loading the key on first use */
+static TEE_Result TA_LoadMasterKey(TEE_OperationHandle *op)
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	if (masterKeyOp == TEE_HANDLE_NULL) {
+		res = TA_CreateMacOperation(&masterKeyOp, TA_GetMasterKey);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to get master key");
+			return res;
+		}
+	}
+	*op = masterKeyOp;
+	return res;
+}
+
+static TEE_Result TA_ComputeSignature(uint8_t *signature, size_t signature_length,
+		TEE_OperationHandle op, const uint8_t *message, size_t length)
+{
+	uint32_t buf_length = HMAC_SHA256_KEY_SIZE_BYTE;
+	uint8_t buf[buf_length];
+	TEE_Result res;
+	uint32_t to_write;
+
+	/* restarts the operation, whatever it was used for before */
 	TEE_MACInit(op, NULL, 0);
 
-	TEE_MACComputeFinal(op, (void *)message, length, buf, &buf_length);
+	res = TEE_MACComputeFinal(op, (void *)message, length, buf, &buf_length);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to compute HMAC");
-		goto free_op;
+		goto exit;
 	}
 
 	to_write = buf_length;
@@ -165,21 +229,20 @@ static TEE_Result TA_ComputeSignature(uint8_t *signature, size_t signature_lengt
 	memset(signature, 0, signature_length);
 	memcpy(signature, buf, to_write);
 
-free_op:
-	TEE_FreeOperation(op);
 exit:
+	memset(buf, 0, sizeof(buf));
 	return res;
 }
 
 static TEE_Result TA_ComputePasswordSignature(
 		uint8_t *signature, size_t signature_length,
-		TEE_ObjectHandle key,
+		TEE_OperationHandle op,
 		const uint8_t *password, size_t password_length, salt_t salt)
 {
 	uint8_t salted_password[password_length + sizeof(salt)];
 	memcpy(salted_password, &salt, sizeof(salt));
 	memcpy(salted_password + sizeof(salt), password, password_length);
-	return TA_ComputeSignature(signature, signature_length, key,
+	return TA_ComputeSignature(signature, signature_length, op,
 			salted_password, sizeof(salted_password));
 }
 
@@ -194,16 +257,9 @@ static TEE_Result TA_CreatePasswordHandle(password_handle_t *password_handle,
 		sizeof(pw_handle.version);
 	uint8_t to_sign[password_length + metadata_length];
 
-	TEE_ObjectHandle masterKey = TEE_HANDLE_NULL;
+	TEE_OperationHandle masterKey = TEE_HANDLE_NULL;
 	TEE_Result res;
 
-	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
-			HMAC_SHA256_KEY_SIZE_BIT, &masterKey);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to allocate password key");
-		goto exit;
-	}
-
 	pw_handle.version = handle_version;
 	pw_handle.salt = salt;
 	pw_handle.user_id = user_id;
@@ -213,24 +269,23 @@ static TEE_Result TA_CreatePasswordHandle(password_handle_t *password_handle,
 	memcpy(to_sign, &pw_handle, metadata_length);
 	memcpy(to_sign + metadata_length, password, password_length);
 
-	res = TA_GetMasterKey(masterKey);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to get master key");
-		goto free_key;
-	}
+	res = TA_LoadMasterKey(&masterKey);
+	if (res != TEE_SUCCESS)
+		goto exit;
 
 	res = TA_ComputePasswordSignature(pw_handle.signature,
 			sizeof(pw_handle.signature), masterKey,
 			to_sign, sizeof(to_sign), salt);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to compute password signature");
-		goto free_key;
+		/* load the key again next time */
+		TEE_FreeOperation(masterKeyOp);
+		masterKeyOp = TEE_HANDLE_NULL;
+		goto exit;
 	}
 
 	memcpy(password_handle, &pw_handle, sizeof(pw_handle));
 
-free_key:
-	TEE_FreeTransientObject(masterKey);
 exit:
 	return res;
 }
@@ -300,17 +355,45 @@ static TEE_Result TA_GetAuthTokenKey(TEE_ObjectHandle key)
 
 close_sess:
 	TEE_CloseTASession(sess);
+	memset(authTokenKeyData, 0, sizeof(authTokenKeyData));
 exit:
 	return res;
 }
 
+/*
+ * Returns the auth_token key operation, fetching the key from keymaster if
+ * it isn't loaded yet
+ */
+static TEE_Result TA_LoadAuthTokenKey(TEE_OperationHandle *op)
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	if (authTokenOp == TEE_HANDLE_NULL) {
+		res = TA_CreateMacOperation(&authTokenOp, TA_GetAuthTokenKey);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to get auth_token key from keymaster");
+			return res;
+		}
+	}
+	*op = authTokenOp;
+	return res;
+}
+
+/* Drops the cached auth_token key, the next token fetches it again */
+static void TA_DropAuthTokenKey(void)
+{
+	if (authTokenOp != TEE_HANDLE_NULL)
+		TEE_FreeOperation(authTokenOp);
+	authTokenOp = TEE_HANDLE_NULL;
+}
+
 static void TA_MintAuthToken(hw_auth_token_t *auth_token, int64_t timestamp,
 		secure_id_t user_id, secure_id_t authenticator_id,
 		uint64_t challenge) {
 	TEE_Result		res;
 
 	hw_auth_token_t		token;
-	TEE_ObjectHandle	authTokenKey = TEE_HANDLE_NULL;
+	TEE_OperationHandle	key = TEE_HANDLE_NULL;
 
 	const uint8_t		*toSign = (const uint8_t *)&token;
 	const uint32_t		toSignLen = sizeof(token) - sizeof(token.hmac);
@@ -324,29 +407,20 @@ static void TA_MintAuthToken(hw_auth_token_t *auth_token, int64_t timestamp,
 	token.timestamp =  TEE_U64_TO_BIG_ENDIAN(timestamp);
 	memset(token.hmac, 0, sizeof(token.hmac));
 
-	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
-			HMAC_SHA256_KEY_SIZE_BIT, &authTokenKey);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to allocate auth_token key");
+	res = TA_LoadAuthTokenKey(&key);
+	if (res != TEE_SUCCESS)
 		goto exit;
-	}
-
-	res = TA_GetAuthTokenKey(authTokenKey);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to get auth_token key from keymaster");
-		goto free_key;
-	}
 
-	res = TA_ComputeSignature(token.hmac, sizeof(token.hmac), authTokenKey,
+	res = TA_ComputeSignature(token.hmac, sizeof(token.hmac), key,
 			toSign, toSignLen);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to compute auth_token signature");
 		memset(token.hmac, 0, sizeof(token.hmac));
-		goto free_key;
+		/* fetch the key again next time in case it went bad */
+		TA_DropAuthTokenKey();
+		goto exit;
 	}
 
-free_key:
-	TEE_FreeTransientObject(authTokenKey);
 exit:
 	memcpy(auth_token, &token, sizeof(token));
 }
@@ -425,6 +499,7 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 	 */
 	uint32_t error = ERROR_NONE;
 	uint32_t timeout = 0;
+	bool counted = false;
 	password_handle_t password_handle;
 
 	uint8_t *response = params[1].memref.buffer;
@@ -490,7 +565,12 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 		if (throttle) {
 			failure_record_t record;
 			flags |= HANDLE_FLAG_THROTTLE_SECURE;
-			GetFailureRecord(user_id, &record);
+			if (GetFailureRecord(user_id, &record) != TEE_SUCCESS) {
+				// don't check the password without its
+				// stored failures
+				error = ERROR_RETRY;
+				goto serialize_response;
+			}
 
 			if (ThrottleRequest(&record, timestamp, &timeout)) {
 				error = ERROR_RETRY;
@@ -498,6 +578,7 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 			}
 
 			IncrementFailureRecord(&record, timestamp);
+			counted = true;
 		}
 
 		res = TA_DoVerify(pw_handle, current_password,
@@ -514,6 +595,7 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 			goto serialize_response;
 		default:
 			EMSG("Failed to verify password handle");
+			CommitFailureRecords();
 			goto exit;
 		}
 	}
@@ -530,6 +612,11 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 	}
 
 serialize_response:
+	/* a counted attempt is only answered once the journal holds it */
+	if (CommitFailureRecords() != TEE_SUCCESS && counted) {
+		error = ERROR_RETRY;
+	}
+
 	serialize_int(&i_resp, error);
 	switch (error) {
 	case ERROR_INVALID:
@@ -597,6 +684,7 @@ static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
 	uint32_t timeout = 0;
 	hw_auth_token_t auth_token;
 	bool request_reenroll = false;
+	bool counted = false;
 
 	uint8_t *response = params[1].memref.buffer;
 	uint8_t *i_resp = response;
@@ -656,7 +744,11 @@ static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
 	throttle = (password_handle->version >= HANDLE_VERSION_THROTTLE);
 	if (throttle) {
 		failure_record_t record;
-		GetFailureRecord(user_id, &record);
+		if (GetFailureRecord(user_id, &record) != TEE_SUCCESS) {
+			// don't check the password without its stored failures
+			error = ERROR_RETRY;
+			goto serialize_response;
+		}
 
 		if (ThrottleRequest(&record, timestamp, &timeout)) {
 			error = ERROR_RETRY;
@@ -664,6 +756,7 @@ static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
 		}
 
 		IncrementFailureRecord(&record, timestamp);
+		counted = true;
 	} else {
 		request_reenroll = true;
 	}
@@ -687,10 +780,16 @@ static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
 		goto serialize_response;
 	default:
 		EMSG("Failed to verify password handle");
+		CommitFailureRecords();
 		goto exit;
 	}
 
 serialize_response:
+	/* a counted attempt is only answered once the journal holds it */
+	if (CommitFailureRecords() != TEE_SUCCESS && counted) {
+		error = ERROR_RETRY;
+	}
+
 	serialize_int(&i_resp, error);
 	switch (error) {
 	case ERROR_INVALID:
@@ -716,6 +815,8 @@ exit:
 TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx, uint32_t cmd_id,
 			uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS])
 {
+	TEE_Result res;
+
 	if (TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
 			TEE_PARAM_TYPE_MEMREF_OUTPUT,
 			TEE_PARAM_TYPE_NONE,
@@ -725,16 +826,18 @@ TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx, uint32_t cmd_id,
 
 	DMSG("Gatekeeper TA invoke command cmd_id %u", cmd_id);
 
+	(void)&sess_ctx; /* Unused parameter */
+
 	switch (cmd_id) {
 	case GK_ENROLL:
-		return TA_Enroll(params);
+		res = TA_Enroll(params);
+		break;
 	case GK_VERIFY:
-		return TA_Verify(params);
+		res = TA_Verify(params);
+		break;
 	default:
 		return TEE_ERROR_BAD_PARAMETERS;
 	}
 
-	(void)&sess_ctx; /* Unused parameter */
-
-	return TEE_ERROR_BAD_PARAMETERS;
+	return res;
 }
@@ -16,7 +16,9 @@
 
 #include <utils/Log.h>
 #include <cutils/properties.h>
+#include <algorithm>
 #include <cstring>
+#include <iterator>
 #include <memory>
 #include <new>
 
@@ -35,7 +37,6 @@ using ::keymaster::AddEntropyResponse;
 using ::keymaster::AttestKeyRequest;
 using ::keymaster::AttestKeyResponse;
 using ::keymaster::AuthorizationSet;
-using ::keymaster::BeginOperationRequest;
 using ::keymaster::BeginOperationResponse;
 using ::keymaster::ExportKeyRequest;
 using ::keymaster::ExportKeyResponse;
@@ -233,9 +234,210 @@ void addClientAndAppData(const hidl_vec<uint8_t>& clientId, const hidl_vec<uint8
     }
 }
 
+/*
+ * Writers of HIDL parameters in the AuthorizationSet wire format, so hot
+ * path requests are serialized straight into the IPC buffer instead of
+ * being copied into a KmParamSet and then an AuthorizationSet first.
+ * Parameters KmParamSet would turn into KM_TAG_INVALID are sent as such.
+ */
+static size_t hidlParamValueSize(const KeyParameter& param, bool* indirect) {
+    *indirect = false;
+    switch (typeFromTag(legacy_enum_conversion(param.tag))) {
+    case KM_ENUM:
+    case KM_ENUM_REP:
+    case KM_UINT:
+    case KM_UINT_REP:
+        return sizeof(uint32_t);
+    case KM_ULONG:
+    case KM_ULONG_REP:
+    case KM_DATE:
+        return sizeof(uint64_t);
+    case KM_BOOL:
+        return param.f.boolValue ? sizeof(uint8_t) : 0;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        *indirect = true;
+        return 2 * sizeof(uint32_t);
+    default:
+        return 0;
+    }
+}
+
+static size_t hidlParamsSerializedSize(const hidl_vec<KeyParameter>& params) {
+    size_t size = 3 * sizeof(uint32_t);
+    bool indirect;
+
+    for (size_t i = 0; i < params.size(); ++i) {
+        size += sizeof(uint32_t) + hidlParamValueSize(params[i], &indirect);
+        if (indirect)
+            size += params[i].blob.size();
+    }
+    return size;
+}
+
+static uint8_t* serializeHidlParams(const hidl_vec<KeyParameter>& params, uint8_t* buf,
+                                    const uint8_t* end) {
+    uint32_t indirect_size = 0;
+    uint32_t elems_size = 0;
+    uint32_t offset = 0;
+    bool indirect;
+
+    for (size_t i = 0; i < params.size(); ++i) {
+        elems_size += sizeof(uint32_t) + hidlParamValueSize(params[i], &indirect);
+        if (indirect)
+            indirect_size += params[i].blob.size();
+    }
+    buf = ::keymaster::append_uint32_to_buf(buf, end, indirect_size);
+    for (size_t i = 0; i < params.size(); ++i) {
+        hidlParamValueSize(params[i], &indirect);
+        if (indirect)
+            buf = ::keymaster::append_to_buf(buf, end, params[i].blob.data(),
+                                             params[i].blob.size());
+    }
+    buf = ::keymaster::append_uint32_to_buf(buf, end, params.size());
+    buf = ::keymaster::append_uint32_to_buf(buf, end, elems_size);
+    for (size_t i = 0; i < params.size(); ++i) {
+        const KeyParameter& param = params[i];
+        keymaster_tag_t tag = legacy_enum_conversion(param.tag);
+
+        switch (typeFromTag(tag)) {
+        case KM_ENUM:
+        case KM_ENUM_REP:
+        case KM_UINT:
+        case KM_UINT_REP:
+            buf = ::keymaster::append_uint32_to_buf(buf, end, tag);
+            buf = ::keymaster::append_uint32_to_buf(buf, end, param.f.integer);
+            break;
+        case KM_ULONG:
+        case KM_ULONG_REP:
+            buf = ::keymaster::append_uint32_to_buf(buf, end, tag);
+            buf = ::keymaster::append_uint64_to_buf(buf, end, param.f.longInteger);
+            break;
+        case KM_DATE:
+            buf = ::keymaster::append_uint32_to_buf(buf, end, tag);
+            buf = ::keymaster::append_uint64_to_buf(buf, end, param.f.dateTime);
+            break;
+        case KM_BOOL:
+            if (!param.f.boolValue) {
+                buf = ::keymaster::append_uint32_to_buf(buf, end, KM_TAG_INVALID);
+                break;
+            }
+            buf = ::keymaster::append_uint32_to_buf(buf, end, tag);
+            if (buf < end)
+                *buf = 1;
+            buf++;
+            break;
+        case KM_BIGNUM:
+        case KM_BYTES:
+            buf = ::keymaster::append_uint32_to_buf(buf, end, tag);
+            buf = ::keymaster::append_uint32_to_buf(buf, end, param.blob.size());
+            buf = ::keymaster::append_uint32_to_buf(buf, end, offset);
+            offset += param.blob.size();
+            break;
+        default:
+            buf = ::keymaster::append_uint32_to_buf(buf, end, KM_TAG_INVALID);
+            break;
+        }
+    }
+    return buf;
+}
+
+/*
+ * Requests which reference the HIDL arguments instead of copying them, and
+ * serialize in the same format as the libkeymaster request of their
+ * command. They have none of its fields and only go through the request
+ * buffers.
+ */
+class HidlBeginRequest : public ForwardedRequest {
+  public:
+    HidlBeginRequest(int32_t ver, KeyPurpose purpose, const hidl_vec<uint8_t>& key,
+                     const hidl_vec<KeyParameter>& params)
+        : ForwardedRequest(ver, 0), purpose_(legacy_enum_conversion(purpose)), key_(key),
+          params_(params) {}
+
+    size_t SerializedSize() const override {
+        return sizeof(uint32_t) * 2 + key_.size() + hidlParamsSerializedSize(params_);
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = ::keymaster::append_uint32_to_buf(buf, end, purpose_);
+        buf = ::keymaster::append_size_and_data_to_buf(buf, end, key_.data(), key_.size());
+        return serializeHidlParams(params_, buf, end);
+    }
+
+  private:
+    keymaster_purpose_t purpose_;
+    const hidl_vec<uint8_t>& key_;
+    const hidl_vec<KeyParameter>& params_;
+};
+
+class HidlUpdateRequest : public ForwardedRequest {
+  public:
+    HidlUpdateRequest(int32_t ver, uint64_t handle, const hidl_vec<KeyParameter>& params,
+                      const uint8_t* input, size_t input_size)
+        : ForwardedRequest(ver, handle), params_(params), input_(input),
+          input_size_(input_size) {}
+
+    size_t SerializedSize() const override {
+        size_t size = sizeof(uint64_t) + sizeof(uint32_t) + input_size_;
+        if (message_version > 0)
+            size += hidlParamsSerializedSize(params_);
+        return size;
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = ::keymaster::append_uint64_to_buf(buf, end, op_handle);
+        buf = ::keymaster::append_size_and_data_to_buf(buf, end, input_, input_size_);
+        if (message_version > 0)
+            buf = serializeHidlParams(params_, buf, end);
+        return buf;
+    }
+
+  private:
+    const hidl_vec<KeyParameter>& params_;
+    const uint8_t* input_;
+    size_t input_size_;
+};
+
+class HidlFinishRequest : public ForwardedRequest {
+  public:
+    HidlFinishRequest(int32_t ver, uint64_t handle, const hidl_vec<KeyParameter>& params,
+                      const hidl_vec<uint8_t>& input, const hidl_vec<uint8_t>& signature)
+        : ForwardedRequest(ver, handle), params_(params), input_(input), signature_(signature) {}
+
+    size_t SerializedSize() const override {
+        size_t size = sizeof(uint64_t) + sizeof(uint32_t) + signature_.size() +
+                      hidlParamsSerializedSize(params_);
+        if (message_version >= 3)
+            size += sizeof(uint32_t) + input_.size();
+        return size;
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = ::keymaster::append_uint64_to_buf(buf, end, op_handle);
+        buf = ::keymaster::append_size_and_data_to_buf(buf, end, signature_.data(),
+                                                       signature_.size());
+        buf = serializeHidlParams(params_, buf, end);
+        if (message_version >= 3)
+            buf = ::keymaster::append_size_and_data_to_buf(buf, end, input_.data(),
+                                                           input_.size());
+        return buf;
+    }
+
+  private:
+    const hidl_vec<KeyParameter>& params_;
+    const hidl_vec<uint8_t>& input_;
+    const hidl_vec<uint8_t>& signature_;
+};
+
 /*OpteeKeymasterDevice implementation*/
 
-OpteeKeymaster3Device::OpteeKeymaster3Device(OpteeKeymaster* impl) : impl_(impl) {}
+/* Bytes of sign/verify input held back before an update, 0 disables it */
+static const char kCoalesceSizeProperty[] = "ro.vendor.optee.keymaster.coalesce_size";
+static const int32_t kDefaultCoalesceSize = 16 * 1024;
+
+OpteeKeymaster3Device::OpteeKeymaster3Device(OpteeKeymaster* impl) : impl_(impl) {
+    int32_t size = property_get_int32(kCoalesceSizeProperty, kDefaultCoalesceSize);
+
+    coalesce_size_ = size > 0 ? size : 0;
+}
 
 OpteeKeymaster3Device::~OpteeKeymaster3Device() {}
 
@@ -248,6 +450,276 @@ Return<void>  OpteeKeymaster3Device::getHardwareFeatures(getHardwareFeatures_cb
     return Void();
 }
 
+/*
+ * Updates of sign and verify operations only feed a digest or MAC in the
+ * TA and never produce output, unless the data itself is signed (digest
+ * NONE), where the TA checks the length on every update.
+ */
+static bool outputlessUpdates(KeyPurpose purpose, const hidl_vec<KeyParameter>& params) {
+    if (purpose != KeyPurpose::SIGN && purpose != KeyPurpose::VERIFY)
+        return false;
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (legacy_enum_conversion(params[i].tag) == KM_TAG_DIGEST &&
+            params[i].f.integer == static_cast<uint32_t>(KM_DIGEST_NONE))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * AES-GCM decryption holds back the tag and PKCS7 encryption pads, for both
+ * the TA copies the whole input to its heap, which is far smaller than the
+ * large data regions. Their data stays in the request buffers.
+ */
+static bool copiesInput(KeyPurpose purpose, const hidl_vec<KeyParameter>& params) {
+    for (size_t i = 0; i < params.size(); ++i) {
+        keymaster_tag_t tag = legacy_enum_conversion(params[i].tag);
+
+        if (purpose == KeyPurpose::DECRYPT && tag == KM_TAG_BLOCK_MODE &&
+            params[i].f.integer == static_cast<uint32_t>(KM_MODE_GCM))
+            return true;
+        if (purpose == KeyPurpose::ENCRYPT && tag == KM_TAG_PADDING &&
+            params[i].f.integer == static_cast<uint32_t>(KM_PAD_PKCS7))
+            return true;
+    }
+    return false;
+}
+
+/* Returns the entry of map least recently used, by lastUse of each entry */
+template <typename Map, typename LastUse>
+static typename Map::iterator leastRecentlyUsed(Map* map, LastUse lastUse) {
+    return std::min_element(map->begin(), map->end(),
+                            [&](const typename Map::value_type& a,
+                                const typename Map::value_type& b) {
+                                return lastUse(a) < lastUse(b);
+                            });
+}
+
+/*
+ * The TA holds no more operations than OPTEE_KEYMASTER_MAX_OPERATIONS and
+ * aborts the least recently used one first, so that is the one an operation
+ * never finished left behind.
+ */
+void OpteeKeymaster3Device::trackSmallCalls(uint64_t operationHandle) {
+    std::lock_guard<std::mutex> lock(small_calls_lock_);
+
+    if (small_calls_.size() >= OPTEE_KEYMASTER_MAX_OPERATIONS)
+        small_calls_.erase(leastRecentlyUsed(
+            &small_calls_,
+            [](const std::pair<const uint64_t, uint64_t>& e) { return e.second; }));
+    small_calls_[operationHandle] = ++small_calls_uses_;
+}
+
+bool OpteeKeymaster3Device::keepsSmallCalls(uint64_t operationHandle) {
+    std::lock_guard<std::mutex> lock(small_calls_lock_);
+
+    auto it = small_calls_.find(operationHandle);
+    if (it == small_calls_.end())
+        return false;
+    it->second = ++small_calls_uses_;
+    return true;
+}
+
+void OpteeKeymaster3Device::forgetSmallCalls(uint64_t operationHandle) {
+    std::lock_guard<std::mutex> lock(small_calls_lock_);
+
+    small_calls_.erase(operationHandle);
+}
+
+/* Largest input the TA takes in a single update */
+size_t OpteeKeymaster3Device::coalesceLimit() const {
+    size_t large_size = optee_keymaster_large_buffer_size();
+    size_t limit = OPTEE_KEYMASTER_LARGE_THRESHOLD;
+
+    if (large_size > limit + OPTEE_KEYMASTER_LARGE_OUT_SLACK)
+        limit = large_size - OPTEE_KEYMASTER_LARGE_OUT_SLACK;
+    return std::min(coalesce_size_, limit);
+}
+
+/* Begins of one key blob after which it is loaded in the TA */
+static const uint32_t kLoadAfterBegins = 2;
+
+/* Returns the handle of key if it is loaded, else 0 */
+uint64_t OpteeKeymaster3Device::loadedKey(const hidl_vec<uint8_t>& key) {
+    std::vector<uint8_t> blob(key.data(), key.data() + key.size());
+    std::lock_guard<std::mutex> lock(loaded_lock_);
+
+    auto it = loaded_keys_.find(blob);
+    if (it == loaded_keys_.end() || !it->second.handle)
+        return 0;
+    it->second.used = ++loaded_uses_;
+    return it->second.handle;
+}
+
+/*
+ * Counts a begin of key from its blob and loads the key once it was begun
+ * kLoadAfterBegins times. Tracking a new blob unloads the least recently
+ * begun one when OPTEE_KEYMASTER_MAX_LOADED_KEYS are tracked.
+ */
+void OpteeKeymaster3Device::noteBegun(const hidl_vec<uint8_t>& key) {
+    std::vector<uint8_t> blob(key.data(), key.data() + key.size());
+    std::lock_guard<std::mutex> lock(loaded_lock_);
+
+    auto it = loaded_keys_.find(blob);
+    if (it == loaded_keys_.end()) {
+        if (loaded_keys_.size() >= OPTEE_KEYMASTER_MAX_LOADED_KEYS) {
+            auto oldest = leastRecentlyUsed(
+                &loaded_keys_,
+                [](const std::pair<const std::vector<uint8_t>, LoadedKey>& e) {
+                    return e.second.used;
+                });
+            if (oldest->second.handle) {
+                UnloadKeyRequest request(impl_->message_version());
+                UnloadKeyResponse response(impl_->message_version());
+                request.key_handle = oldest->second.handle;
+                impl_->UnloadKey(request, &response);
+            }
+            loaded_keys_.erase(oldest);
+        }
+        it = loaded_keys_.emplace(std::move(blob), LoadedKey{0, 0, 0}).first;
+    }
+    it->second.used = ++loaded_uses_;
+    if (it->second.handle || ++it->second.begins < kLoadAfterBegins)
+        return;
+
+    LoadKeyRequest request(impl_->message_version());
+    LoadKeyResponse response(impl_->message_version());
+    request.key_blob.Reinitialize(key.data(), key.size());
+    impl_->LoadKey(request, &response);
+    if (response.error == KM_ERROR_OK)
+        it->second.handle = response.key_handle;
+    else
+        /* try again after as many begins */
+        it->second.begins = 0;
+}
+
+/* Unloads key, or all keys if NULL, and stops counting its begins */
+void OpteeKeymaster3Device::forgetLoadedKey(const hidl_vec<uint8_t>* key) {
+    std::lock_guard<std::mutex> lock(loaded_lock_);
+    auto it = loaded_keys_.begin();
+    auto end = loaded_keys_.end();
+
+    if (key) {
+        it = loaded_keys_.find(std::vector<uint8_t>(key->data(), key->data() + key->size()));
+        if (it == loaded_keys_.end())
+            return;
+        end = std::next(it);
+    }
+    while (it != end) {
+        if (it->second.handle) {
+            UnloadKeyRequest request(impl_->message_version());
+            UnloadKeyResponse response(impl_->message_version());
+            request.key_handle = it->second.handle;
+            impl_->UnloadKey(request, &response);
+        }
+        it = loaded_keys_.erase(it);
+    }
+}
+
+/*
+ * Starts holding back input for a new operation. Entries of operations the
+ * TA has forgotten, begun before it restarted or aborted by it to make room,
+ * are dropped here in case their client never finishes or aborts them.
+ */
+void OpteeKeymaster3Device::trackCoalesced(uint64_t operationHandle) {
+    std::lock_guard<std::mutex> lock(coalesce_lock_);
+    uint32_t generation = optee_keymaster_generation();
+
+    for (auto it = coalesced_.begin(); it != coalesced_.end();) {
+        if (it->second.generation == generation) {
+            ++it;
+            continue;
+        }
+        ::keymaster::memset_s(it->second.input.data(), 0, it->second.input.size());
+        it = coalesced_.erase(it);
+    }
+    if (coalesced_.size() >= OPTEE_KEYMASTER_MAX_OPERATIONS) {
+        auto oldest = leastRecentlyUsed(
+            &coalesced_,
+            [](const std::pair<const uint64_t, CoalescedInput>& e) { return e.second.used; });
+        ::keymaster::memset_s(oldest->second.input.data(), 0, oldest->second.input.size());
+        coalesced_.erase(oldest);
+    }
+    coalesced_[operationHandle] = {{}, generation, ++coalesce_uses_};
+}
+
+/*
+ * Appends input, if given, to what is held back for the operation when it
+ * fits and returns true. Otherwise moves the held back input to pending and
+ * sets coalesced if the operation holds back input at all. Operations begun
+ * before the TA restarted are forgotten, the TA doesn't know them anymore.
+ */
+bool OpteeKeymaster3Device::holdInput(uint64_t operationHandle, const hidl_vec<uint8_t>* input,
+                                      std::vector<uint8_t>* pending, bool* coalesced) {
+    std::lock_guard<std::mutex> lock(coalesce_lock_);
+
+    *coalesced = false;
+    auto it = coalesced_.find(operationHandle);
+    if (it == coalesced_.end())
+        return false;
+    std::vector<uint8_t>& held = it->second.input;
+    if (it->second.generation != optee_keymaster_generation()) {
+        ::keymaster::memset_s(held.data(), 0, held.size());
+        coalesced_.erase(it);
+        return false;
+    }
+    *coalesced = true;
+    it->second.used = ++coalesce_uses_;
+    if (input && held.size() + input->size() <= coalesceLimit()) {
+        held.insert(held.end(), input->data(), input->data() + input->size());
+        return true;
+    }
+    pending->swap(held);
+    return false;
+}
+
+void OpteeKeymaster3Device::dropCoalesced(uint64_t operationHandle) {
+    std::lock_guard<std::mutex> lock(coalesce_lock_);
+
+    auto it = coalesced_.find(operationHandle);
+    if (it == coalesced_.end())
+        return;
+    std::vector<uint8_t>& held = it->second.input;
+    ::keymaster::memset_s(held.data(), 0, held.size());
+    coalesced_.erase(it);
+}
+
+/* Sends the held back input as plain updates, as the caller would have */
+ErrorCode OpteeKeymaster3Device::flushCoalesced(uint64_t operationHandle,
+                                               std::vector<uint8_t>* pending) {
+    const hidl_vec<KeyParameter> noParams;
+    ErrorCode rc = ErrorCode::OK;
+    size_t sent = 0;
+
+    while (sent < pending->size()) {
+        UpdateOperationResponse response(impl_->message_version());
+        size_t size = pending->size() - sent;
+
+        if (size > OPTEE_KEYMASTER_LARGE_THRESHOLD) {
+            UpdateOperationRequest request(impl_->message_version());
+            request.op_handle = operationHandle;
+            request.input.Reinitialize(pending->data() + sent, size);
+            impl_->UpdateOperation(request, &response);
+        } else {
+            HidlUpdateRequest request(impl_->message_version(), operationHandle, noParams,
+                                      pending->data() + sent, size);
+            impl_->UpdateOperation(request, &response);
+        }
+        if (response.error != KM_ERROR_OK) {
+            rc = legacy_enum_conversion(response.error);
+            break;
+        }
+        if (response.input_consumed == 0) {
+            rc = ErrorCode::UNKNOWN_ERROR;
+            break;
+        }
+        sent += response.input_consumed;
+    }
+    ::keymaster::memset_s(pending->data(), 0, pending->size());
+    pending->clear();
+    return rc;
+}
+
 Return<ErrorCode> OpteeKeymaster3Device::addRngEntropy(const hidl_vec<uint8_t> &data) {
     ErrorCode rc = ErrorCode::OK;
 
@@ -515,6 +987,7 @@ Return<ErrorCode>  OpteeKeymaster3Device::deleteKey(const hidl_vec<uint8_t> &key
     request.SetKeyMaterial(keyBlob.data(), keyBlob.size());
 
     DeleteKeyResponse response(impl_->message_version());
+    forgetLoadedKey(&keyBlob);
     impl_->DeleteKey(request, &response);
 
     return legacy_enum_conversion(response.error);
@@ -523,6 +996,7 @@ Return<ErrorCode>  OpteeKeymaster3Device::deleteKey(const hidl_vec<uint8_t> &key
 Return<ErrorCode> OpteeKeymaster3Device::deleteAllKeys() {
     DeleteAllKeysRequest request(impl_->message_version());
     DeleteAllKeysResponse response(impl_->message_version());
+    forgetLoadedKey(nullptr);
     impl_->DeleteAllKeys(request, &response);
 
     return legacy_enum_conversion(response.error);
@@ -536,17 +1010,36 @@ Return<ErrorCode> OpteeKeymaster3Device::destroyAttestationIds() {
 
 Return<void> OpteeKeymaster3Device::begin(KeyPurpose purpose, const hidl_vec<uint8_t> &key,
                    const hidl_vec<KeyParameter> &inParams, begin_cb _hidl_cb) {
-    BeginOperationRequest request(impl_->message_version());
-    request.purpose = legacy_enum_conversion(purpose);
-    request.SetKeyMaterial(key.data(), key.size());
-    request.additional_params.Reinitialize(KmParamSet(inParams));
-
     BeginOperationResponse response(impl_->message_version());
-    impl_->BeginOperation(request, &response);
+    uint64_t keyHandle = loadedKey(key);
+
+    if (keyHandle) {
+        BeginLoadedRequest request(impl_->message_version());
+        request.purpose = legacy_enum_conversion(purpose);
+        request.key_handle = keyHandle;
+        request.additional_params.Reinitialize(KmParamSet(inParams));
+        impl_->BeginLoadedOperation(request, &response);
+        if (response.error == KM_ERROR_INVALID_KEY_BLOB) {
+            /* lost with its TA session, begin from the blob again */
+            forgetLoadedKey(&key);
+            keyHandle = 0;
+        }
+    }
+    if (!keyHandle) {
+        HidlBeginRequest request(impl_->message_version(), purpose, key, inParams);
+
+        impl_->BeginOperation(request, &response);
+        if (response.error == KM_ERROR_OK)
+            noteBegun(key);
+    }
 
-    hidl_vec<KeyParameter> resultParams(impl_->message_version());
+    hidl_vec<KeyParameter> resultParams;
     if (response.error == KM_ERROR_OK) {
         resultParams = kmParamSet2Hidl(response.output_params);
+        if (coalesce_size_ && outputlessUpdates(purpose, inParams))
+            trackCoalesced(response.op_handle);
+        if (copiesInput(purpose, inParams))
+            trackSmallCalls(response.op_handle);
     }
 
     _hidl_cb(legacy_enum_conversion(response.error), resultParams, response.op_handle);
@@ -555,27 +1048,58 @@ Return<void> OpteeKeymaster3Device::begin(KeyPurpose purpose, const hidl_vec<uin
 
 Return<void> OpteeKeymaster3Device::update(uint64_t operationHandle, const hidl_vec<KeyParameter> &inParams,
                     const hidl_vec<uint8_t> &input, update_cb _hidl_cb) {
-    UpdateOperationRequest request(impl_->message_version());
     UpdateOperationResponse response(impl_->message_version());
     hidl_vec<KeyParameter> resultParams;
     hidl_vec<uint8_t> resultBlob;
     uint32_t resultConsumed = 0;
 
-    request.op_handle = operationHandle;
-    request.additional_params.Reinitialize(KmParamSet(inParams));
+    std::vector<uint8_t> pending;
+    bool coalesced;
+    /* requests with parameters, e.g. auth tokens, go out as they are */
+    if (holdInput(operationHandle, inParams.size() == 0 ? &input : nullptr, &pending,
+                  &coalesced)) {
+        _hidl_cb(ErrorCode::OK, input.size(), resultParams, resultBlob);
+        return Void();
+    }
+    if (!pending.empty()) {
+        ErrorCode rc = flushCoalesced(operationHandle, &pending);
+        if (rc != ErrorCode::OK) {
+            dropCoalesced(operationHandle);
+            _hidl_cb(rc, 0, resultParams, resultBlob);
+            return Void();
+        }
+    }
 
+    bool small = keepsSmallCalls(operationHandle);
     size_t inp_size = input.size();
-    size_t ser_size = request.SerializedSize();
+    /* size of the request without input, computed without building it */
+    size_t ser_size = HidlUpdateRequest(impl_->message_version(), operationHandle, inParams,
+                                        NULL, 0).SerializedSize();
 
     if (ser_size > OPTEE_KEYMASTER_SEND_BUF_SIZE) {
         response.error = KM_ERROR_INVALID_INPUT_LENGTH;
     } else {
-        if (ser_size + inp_size > OPTEE_KEYMASTER_SEND_BUF_SIZE) {
-            inp_size = OPTEE_KEYMASTER_SEND_BUF_SIZE - ser_size;
+        size_t max_size = OPTEE_KEYMASTER_SEND_BUF_SIZE - ser_size;
+        size_t large_size = optee_keymaster_large_buffer_size();
+
+        /* large calls pass the data beside the request */
+        if (!small && large_size > max_size + OPTEE_KEYMASTER_LARGE_OUT_SLACK)
+            max_size = large_size - OPTEE_KEYMASTER_LARGE_OUT_SLACK;
+        if (inp_size > max_size)
+            inp_size = max_size;
+
+        if (!small && inp_size > OPTEE_KEYMASTER_LARGE_THRESHOLD) {
+            /* the large path needs the input in the request itself */
+            UpdateOperationRequest request(impl_->message_version());
+            request.op_handle = operationHandle;
+            request.additional_params.Reinitialize(KmParamSet(inParams));
+            request.input.Reinitialize(input.data(), inp_size);
+            impl_->UpdateOperation(request, &response);
+        } else {
+            HidlUpdateRequest request(impl_->message_version(), operationHandle, inParams,
+                                      input.data(), inp_size);
+            impl_->UpdateOperation(request, &response);
         }
-        request.input.Reinitialize(input.data(), inp_size);
-
-        impl_->UpdateOperation(request, &response);
 
         if (response.error == KM_ERROR_OK) {
             resultConsumed = response.input_consumed;
@@ -583,6 +1107,12 @@ Return<void> OpteeKeymaster3Device::update(uint64_t operationHandle, const hidl_
             resultBlob = kmBuffer2hidlVec(response.output);
         }
     }
+    /* the TA aborts operations whose update failed */
+    if (response.error != KM_ERROR_OK) {
+        if (coalesced)
+            dropCoalesced(operationHandle);
+        forgetSmallCalls(operationHandle);
+    }
     _hidl_cb(legacy_enum_conversion(response.error), resultConsumed, resultParams, resultBlob);
     return Void();
 }
@@ -590,14 +1120,46 @@ Return<void> OpteeKeymaster3Device::update(uint64_t operationHandle, const hidl_
 Return<void>  OpteeKeymaster3Device::finish(uint64_t operationHandle, const hidl_vec<KeyParameter> &inParams,
                     const hidl_vec<uint8_t> &input, const hidl_vec<uint8_t> &signature,
                     finish_cb _hidl_cb) {
-    FinishOperationRequest request(impl_->message_version());
-    request.op_handle = operationHandle;
-    request.input.Reinitialize(input.data(), input.size());
-    request.signature.Reinitialize(signature.data(), signature.size());
-    request.additional_params.Reinitialize(KmParamSet(inParams));
-
     FinishOperationResponse response(impl_->message_version());
-    impl_->FinishOperation(request, &response);
+    hidl_vec<uint8_t> combined;
+    const hidl_vec<uint8_t>* data = &input;
+
+    std::vector<uint8_t> pending;
+    bool coalesced;
+    holdInput(operationHandle, nullptr, &pending, &coalesced);
+    if (!pending.empty()) {
+        if (pending.size() + input.size() <= coalesceLimit()) {
+            /* held back input goes out with the finish */
+            pending.insert(pending.end(), input.data(), input.data() + input.size());
+            combined.setToExternal(pending.data(), pending.size());
+            data = &combined;
+        } else {
+            ErrorCode rc = flushCoalesced(operationHandle, &pending);
+            if (rc != ErrorCode::OK) {
+                dropCoalesced(operationHandle);
+                _hidl_cb(rc, hidl_vec<KeyParameter>(), hidl_vec<uint8_t>());
+                return Void();
+            }
+        }
+    }
+
+    if (!keepsSmallCalls(operationHandle) && data->size() > OPTEE_KEYMASTER_LARGE_THRESHOLD) {
+        /* the large path needs the input in the request itself */
+        FinishOperationRequest request(impl_->message_version());
+        request.op_handle = operationHandle;
+        request.input.Reinitialize(data->data(), data->size());
+        request.signature.Reinitialize(signature.data(), signature.size());
+        request.additional_params.Reinitialize(KmParamSet(inParams));
+        impl_->FinishOperation(request, &response);
+    } else {
+        HidlFinishRequest request(impl_->message_version(), operationHandle, inParams, *data,
+                                  signature);
+        impl_->FinishOperation(request, &response);
+    }
+    if (coalesced)
+        dropCoalesced(operationHandle);
+    ::keymaster::memset_s(pending.data(), 0, pending.size());
+    forgetSmallCalls(operationHandle);
 
     hidl_vec<KeyParameter> resultParams;
     hidl_vec<uint8_t> resultBlob;
@@ -610,6 +1172,9 @@ Return<void>  OpteeKeymaster3Device::finish(uint64_t operationHandle, const hidl
 }
 
 Return<ErrorCode>  OpteeKeymaster3Device::abort(uint64_t operationHandle) {
+    dropCoalesced(operationHandle);
+    forgetSmallCalls(operationHandle);
+
     AbortOperationRequest request(impl_->message_version());
     request.op_handle = operationHandle;
 
@@ -38,6 +38,7 @@ LOCAL_SRC_FILES := \
 	3.0/service.cpp \
 	3.0/optee_keymaster3_device.cpp \
 	ipc/optee_keymaster_ipc.cpp \
+	key_characteristics_cache.cpp \
 	optee_keymaster.cpp
 
 LOCAL_C_INCLUDES := \
@@ -51,6 +52,7 @@ LOCAL_SHARED_LIBRARIES := \
 	libhardware \
 	libutils \
 	libcutils \
+	libcrypto \
 	libkeymaster_messages \
 	libkeymaster3device \
 	android.hardware.keymaster@3.0
@@ -54,6 +54,15 @@ enum keymaster_command : uint32_t {
     KM_DESTROY_ATTESTATION_IDS      = (24 << KEYMASTER_REQ_SHIFT),
     KM_IMPORT_WRAPPED_KEY           = (25 << KEYMASTER_REQ_SHIFT),
     KM_GET_VERSION_2		    = (28 << KEYMASTER_REQ_SHIFT),
+
+    // OP-TEE specific commands
+    KM_NEGOTIATE_BUFFERS            = (0x102 << KEYMASTER_REQ_SHIFT),
+    KM_UPDATE_LARGE                 = (0x103 << KEYMASTER_REQ_SHIFT),
+    KM_FINISH_LARGE                 = (0x104 << KEYMASTER_REQ_SHIFT),
+    KM_GET_CAPABILITIES             = (0x105 << KEYMASTER_REQ_SHIFT),
+    KM_LOAD_KEY                     = (0x106 << KEYMASTER_REQ_SHIFT),
+    KM_UNLOAD_KEY                   = (0x107 << KEYMASTER_REQ_SHIFT),
+    KM_BEGIN_LOADED                 = (0x108 << KEYMASTER_REQ_SHIFT),
 };
 
 #ifdef __ANDROID__
@@ -26,6 +26,27 @@ __BEGIN_DECLS
 
 const uint32_t OPTEE_KEYMASTER_RECV_BUF_SIZE = 2 * PAGE_SIZE;
 const uint32_t OPTEE_KEYMASTER_SEND_BUF_SIZE = 2 * PAGE_SIZE;
+/* Sessions kept open to the TA for concurrent HAL calls */
+const uint32_t OPTEE_KEYMASTER_MAX_SESSIONS = 4;
+/*
+ * Operations the TA keeps at once, its CFG_KM_MAX_OPERATION. It aborts the
+ * least recently used one to begin another.
+ */
+const uint32_t OPTEE_KEYMASTER_MAX_OPERATIONS = 64;
+/*
+ * Keys the HAL keeps loaded in the TA, at most the TA's per-session
+ * CFG_KM_MAX_LOADED_KEYS as they may all have been loaded in one session.
+ */
+const uint32_t OPTEE_KEYMASTER_MAX_LOADED_KEYS = 8;
+/* Data region size asked from the TA for large update/finish calls */
+const uint32_t OPTEE_KEYMASTER_LARGE_BUF_SIZE = 4 * 1024 * 1024;
+/* Update/finish data above this goes through the large calls */
+const uint32_t OPTEE_KEYMASTER_LARGE_THRESHOLD = PAGE_SIZE;
+/*
+ * Output room needed beyond the input size, padding and GCM tag. Must be at
+ * least the TA's KM_LARGE_OUT_SLACK, the TA refuses smaller output regions.
+ */
+const uint32_t OPTEE_KEYMASTER_LARGE_OUT_SLACK = 128;
 
 int optee_keymaster_initialize(void);
 int optee_keymaster_connect(void);
@@ -33,6 +54,34 @@ int optee_keymaster_connect(void);
 keymaster_error_t optee_keymaster_call(uint32_t cmd, const keymaster::Serializable& req,
                         keymaster::KeymasterResponse* rsp);
 
+/*
+ * Like optee_keymaster_call, for a request continuing op_handle which is
+ * not of the libkeymaster type of cmd.
+ */
+keymaster_error_t optee_keymaster_call_op(uint32_t cmd, keymaster_operation_handle_t op_handle,
+                        const keymaster::Serializable& req,
+                        keymaster::KeymasterResponse* rsp);
+
+/*
+ * Like optee_keymaster_call, with the operation data in data regions kept
+ * by the session, which the TA works on in place. out_room is the room the
+ * TA may fill, what it produced is stored in out. Both sizes are limited
+ * to optee_keymaster_large_buffer_size().
+ */
+keymaster_error_t optee_keymaster_call_large(uint32_t cmd, const keymaster::Serializable& req,
+                        keymaster::KeymasterResponse* rsp,
+                        const uint8_t* in, size_t in_size,
+                        size_t out_room, keymaster::Buffer* out);
+
+/* Data region size agreed with the TA at connect time, 0 if unsupported */
+size_t optee_keymaster_large_buffer_size(void);
+
+/*
+ * Changes on every connect and whenever a session had to be reopened after
+ * the TA died, state cached from the TA is stale once it differs.
+ */
+uint32_t optee_keymaster_generation(void);
+
 void optee_keymaster_disconnect(void);
 void optee_keymaster_finalize(void);
 
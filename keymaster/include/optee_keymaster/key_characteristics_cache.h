@@ -0,0 +1,64 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KEY_CHARACTERISTICS_CACHE_H
+#define KEY_CHARACTERISTICS_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <keymaster/android_keymaster_messages.h>
+
+namespace keymaster {
+
+/*
+ * Least recently used key characteristics, keyed by a digest of the key
+ * blob, client id and app data. Characteristics never change for a given
+ * blob, entries only go away when the blob is deleted or upgraded.
+ */
+class KeyCharacteristicsCache {
+  public:
+	static const size_t kMaxEntries = 32;
+
+	/* Fills response and returns true if the request was seen before */
+	bool Lookup(const GetKeyCharacteristicsRequest& request,
+		    GetKeyCharacteristicsResponse* response);
+	/* Remembers a successful response to request */
+	void Insert(const GetKeyCharacteristicsRequest& request,
+		    const GetKeyCharacteristicsResponse& response);
+	/* Drops every entry of the blob, whatever the client id and app data */
+	void Invalidate(const keymaster_key_blob_t& key_blob);
+	void Clear();
+
+  private:
+	struct Entry {
+		std::string digest;
+		std::string blob_digest;
+		AuthorizationSet enforced;
+		AuthorizationSet unenforced;
+	};
+
+	std::mutex lock_;
+	std::list<Entry> entries_; /* most recently used first */
+	std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+};
+
+} // namespace keymaster
+
+#endif /* KEY_CHARACTERISTICS_CACHE_H */
@@ -17,10 +17,184 @@
 #ifndef OPTEE_KEYMASTER_H
 #define OPTEE_KEYMASTER_H
 
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
 #include <keymaster/android_keymaster_messages.h>
+#include <optee_keymaster/key_characteristics_cache.h>
 
 namespace keymaster {
 
+/*
+ * Begin, update or finish request whose fields are kept elsewhere, e.g. in
+ * the arguments of a HIDL call, and which serializes them in the format of
+ * the libkeymaster request of its command. It only goes through the request
+ * buffers, op_handle is the operation continued, 0 for begin.
+ */
+struct ForwardedRequest : public KeymasterMessage {
+	ForwardedRequest(int32_t ver, keymaster_operation_handle_t handle)
+		: KeymasterMessage(ver), op_handle(handle) {}
+
+	/* Only ever sent to the TA */
+	bool Deserialize(const uint8_t**, const uint8_t*) override { return false; }
+
+	keymaster_operation_handle_t op_handle;
+};
+
+/* Algorithm or purpose of a capability entry whose query has no such field */
+const uint32_t KM_CAPABILITY_ANY = UINT32_MAX;
+
+/*
+ * Response of KM_GET_CAPABILITIES: the TA version and the answers to all
+ * KM_GET_SUPPORTED_* queries, keyed by (command, algorithm, purpose).
+ */
+struct CapabilitiesResponse : public KeymasterResponse {
+	typedef std::tuple<uint32_t, uint32_t, uint32_t> Query;
+
+	explicit CapabilitiesResponse(int32_t ver = MAX_MESSAGE_VERSION)
+		: KeymasterResponse(ver) {}
+
+	size_t NonErrorSerializedSize() const override {
+		size_t size = 4 * sizeof(uint32_t);
+		for (const auto& entry : lists)
+			size += (4 + entry.second.size()) * sizeof(uint32_t);
+		return size;
+	}
+	uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
+		buf = append_uint32_to_buf(buf, end, major_ver);
+		buf = append_uint32_to_buf(buf, end, minor_ver);
+		buf = append_uint32_to_buf(buf, end, subminor_ver);
+		buf = append_uint32_to_buf(buf, end, lists.size());
+		for (const auto& entry : lists) {
+			buf = append_uint32_to_buf(buf, end, std::get<0>(entry.first));
+			buf = append_uint32_to_buf(buf, end, std::get<1>(entry.first));
+			buf = append_uint32_to_buf(buf, end, std::get<2>(entry.first));
+			buf = append_uint32_to_buf(buf, end, entry.second.size());
+			for (uint32_t value : entry.second)
+				buf = append_uint32_to_buf(buf, end, value);
+		}
+		return buf;
+	}
+	bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+		uint32_t count;
+
+		lists.clear();
+		if (!copy_uint32_from_buf(buf_ptr, end, &major_ver) ||
+		    !copy_uint32_from_buf(buf_ptr, end, &minor_ver) ||
+		    !copy_uint32_from_buf(buf_ptr, end, &subminor_ver) ||
+		    !copy_uint32_from_buf(buf_ptr, end, &count))
+			return false;
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t command, algorithm, purpose, length;
+			if (!copy_uint32_from_buf(buf_ptr, end, &command) ||
+			    !copy_uint32_from_buf(buf_ptr, end, &algorithm) ||
+			    !copy_uint32_from_buf(buf_ptr, end, &purpose) ||
+			    !copy_uint32_from_buf(buf_ptr, end, &length) ||
+			    length > (size_t)(end - *buf_ptr) / sizeof(uint32_t))
+				return false;
+			std::vector<uint32_t>& values = lists[Query(command, algorithm, purpose)];
+			values.resize(length);
+			for (uint32_t& value : values)
+				if (!copy_uint32_from_buf(buf_ptr, end, &value))
+					return false;
+		}
+		return true;
+	}
+
+	uint32_t major_ver = 0;
+	uint32_t minor_ver = 0;
+	uint32_t subminor_ver = 0;
+	std::map<Query, std::vector<uint32_t>> lists;
+};
+
+/*
+ * Request of KM_LOAD_KEY: the key blob to keep restored in the TA. Loaded
+ * keys belong to the TA session which loaded them and go away with it.
+ */
+struct LoadKeyRequest : public KeymasterMessage {
+	explicit LoadKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+		: KeymasterMessage(ver) {}
+
+	size_t SerializedSize() const override {
+		return sizeof(uint32_t) + key_blob.key_material_size;
+	}
+	uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+		return append_size_and_data_to_buf(buf, end, key_blob.key_material,
+						   key_blob.key_material_size);
+	}
+	/* Only ever sent to the TA */
+	bool Deserialize(const uint8_t**, const uint8_t*) override { return false; }
+
+	KeymasterKeyBlob key_blob;
+};
+
+/* Response of KM_LOAD_KEY: the handle KM_BEGIN_LOADED takes */
+struct LoadKeyResponse : public KeymasterResponse {
+	explicit LoadKeyResponse(int32_t ver = MAX_MESSAGE_VERSION)
+		: KeymasterResponse(ver) {}
+
+	size_t NonErrorSerializedSize() const override { return sizeof(uint64_t); }
+	uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
+		return append_uint64_to_buf(buf, end, key_handle);
+	}
+	bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+		return copy_uint64_from_buf(buf_ptr, end, &key_handle);
+	}
+
+	uint64_t key_handle = 0;
+};
+
+/* Request of KM_UNLOAD_KEY, the response carries only the error code */
+struct UnloadKeyRequest : public KeymasterMessage {
+	explicit UnloadKeyRequest(int32_t ver = MAX_MESSAGE_VERSION)
+		: KeymasterMessage(ver) {}
+
+	size_t SerializedSize() const override { return sizeof(uint64_t); }
+	uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+		return append_uint64_to_buf(buf, end, key_handle);
+	}
+	bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+		return copy_uint64_from_buf(buf_ptr, end, &key_handle);
+	}
+
+	uint64_t key_handle = 0;
+};
+
+struct UnloadKeyResponse : public EmptyKeymasterResponse {
+	explicit UnloadKeyResponse(int32_t ver = MAX_MESSAGE_VERSION)
+		: EmptyKeymasterResponse(ver) {}
+};
+
+/*
+ * Request of KM_BEGIN_LOADED: a begin request naming a loaded key instead
+ * of carrying its blob, the response is a BeginOperationResponse.
+ */
+struct BeginLoadedRequest : public KeymasterMessage {
+	explicit BeginLoadedRequest(int32_t ver = MAX_MESSAGE_VERSION)
+		: KeymasterMessage(ver) {}
+
+	size_t SerializedSize() const override {
+		return sizeof(uint32_t) + sizeof(uint64_t) +
+		       additional_params.SerializedSize();
+	}
+	uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+		buf = append_uint32_to_buf(buf, end, purpose);
+		buf = append_uint64_to_buf(buf, end, key_handle);
+		return additional_params.Serialize(buf, end);
+	}
+	bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+		return copy_uint32_from_buf(buf_ptr, end, &purpose) &&
+		       copy_uint64_from_buf(buf_ptr, end, &key_handle) &&
+		       additional_params.Deserialize(buf_ptr, end);
+	}
+
+	keymaster_purpose_t purpose = KM_PURPOSE_ENCRYPT;
+	uint64_t key_handle = 0;
+	AuthorizationSet additional_params;
+};
+
 class OpteeKeymaster {
   public:
 	OpteeKeymaster();
@@ -56,6 +230,18 @@ class OpteeKeymaster {
 	void UpdateOperation(const UpdateOperationRequest& request, UpdateOperationResponse* response);
 	void FinishOperation(const FinishOperationRequest& request, FinishOperationResponse* response);
 	void AbortOperation(const AbortOperationRequest& request, AbortOperationResponse* response);
+	void BeginOperation(const ForwardedRequest& request, BeginOperationResponse* response);
+	void UpdateOperation(const ForwardedRequest& request, UpdateOperationResponse* response);
+	void FinishOperation(const ForwardedRequest& request, FinishOperationResponse* response);
+	/*
+	 * Loaded keys skip blob decryption and parsing on begin. Handles are
+	 * only valid until unloaded or the TA session they were loaded in is
+	 * closed, in which case begin fails with KM_ERROR_INVALID_KEY_BLOB.
+	 */
+	void LoadKey(const LoadKeyRequest& request, LoadKeyResponse* response);
+	void UnloadKey(const UnloadKeyRequest& request, UnloadKeyResponse* response);
+	void BeginLoadedOperation(const BeginLoadedRequest& request,
+							  BeginOperationResponse* response);
 	GetHmacSharingParametersResponse GetHmacSharingParameters();
 	ComputeSharedHmacResponse ComputeSharedHmac(const ComputeSharedHmacRequest& request);
 	VerifyAuthorizationResponse VerifyAuthorization(const VerifyAuthorizationRequest& request);
@@ -64,7 +250,28 @@ class OpteeKeymaster {
 	uint32_t message_version() const { return message_version_; }
 
   private:
+	/*
+	 * Fetches the capability table, again only once the TA restarted.
+	 * A failed fetch is not retried before that either. Must be called
+	 * with capabilities_lock_ held.
+	 */
+	bool LoadCapabilities();
+	/*
+	 * Answers a KM_GET_SUPPORTED_* query from the capability table, false
+	 * if there is no table and the TA has to be asked.
+	 */
+	template <typename T>
+	bool AnswerSupported(uint32_t command, uint32_t algorithm, uint32_t purpose,
+			     SupportedResponse<T>* response);
+
 	uint32_t message_version_;
+	std::mutex capabilities_lock_;
+	CapabilitiesResponse capabilities_;
+	bool capabilities_loaded_ = false;
+	/* capabilities_loaded_ is the outcome of the fetch in this generation */
+	bool capabilities_tried_ = false;
+	uint32_t capabilities_generation_ = 0;
+	KeyCharacteristicsCache characteristics_cache_;
 };
 
 } // namespace keymaster
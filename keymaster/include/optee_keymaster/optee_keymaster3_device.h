@@ -23,6 +23,11 @@
 #include <hidl/MQDescriptor.h>
 #include <hidl/Status.h>
 
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #include <optee_keymaster/optee_keymaster.h>
 
 namespace keymaster {
@@ -77,7 +82,56 @@ class OpteeKeymaster3Device : public IKeymasterDevice {
 
 
   private:
+    /*
+     * Update input of sign and verify operations, which the TA only digests,
+     * is held here until coalesce_size_ bytes are pending or finish comes.
+     * The held back input is only touched with coalesce_lock_ held.
+     */
+    struct CoalescedInput {
+        std::vector<uint8_t> input;
+        /* optee_keymaster_generation() at begin */
+        uint32_t generation;
+        /* coalesce_uses_ at the last call */
+        uint64_t used;
+    };
+    void trackCoalesced(uint64_t operationHandle);
+    bool holdInput(uint64_t operationHandle, const hidl_vec<uint8_t>* input,
+                   std::vector<uint8_t>* pending, bool* coalesced);
+    ErrorCode flushCoalesced(uint64_t operationHandle, std::vector<uint8_t>* pending);
+    void dropCoalesced(uint64_t operationHandle);
+    size_t coalesceLimit() const;
+    /* Operations whose data must go through the request buffers */
+    void trackSmallCalls(uint64_t operationHandle);
+    bool keepsSmallCalls(uint64_t operationHandle);
+    void forgetSmallCalls(uint64_t operationHandle);
+    /*
+     * Key blobs begun recently. Those begun kLoadAfterBegins times are
+     * loaded in the TA, their begins name the handle instead of the blob.
+     */
+    struct LoadedKey {
+        /* KM_LOAD_KEY handle, 0 while not loaded */
+        uint64_t handle;
+        /* begins since tracked, or since a load failed */
+        uint32_t begins;
+        /* loaded_uses_ at the last begin */
+        uint64_t used;
+    };
+    uint64_t loadedKey(const hidl_vec<uint8_t>& key);
+    void noteBegun(const hidl_vec<uint8_t>& key);
+    void forgetLoadedKey(const hidl_vec<uint8_t>* key);
+
     std::unique_ptr<OpteeKeymaster> impl_;
+    size_t coalesce_size_;
+    std::mutex coalesce_lock_;
+    std::unordered_map<uint64_t, CoalescedInput> coalesced_;
+    uint64_t coalesce_uses_ = 0;
+    std::mutex small_calls_lock_;
+    /* operation handle to small_calls_uses_ at its last call */
+    std::unordered_map<uint64_t, uint64_t> small_calls_;
+    uint64_t small_calls_uses_ = 0;
+    std::mutex loaded_lock_;
+    std::map<std::vector<uint8_t>, LoadedKey> loaded_keys_;
+    uint64_t loaded_uses_ = 0;
 	int osVersion(uint32_t *in);
 	int osPatchlevel(uint32_t *in);
 	int verifiedBootState(uint8_t *in);
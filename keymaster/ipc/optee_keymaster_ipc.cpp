@@ -23,14 +23,202 @@
 #include <tee_client_api.h>
 #include <hardware/keymaster2.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+
+#include <optee_keymaster/optee_keymaster.h>
 #include <optee_keymaster/ipc/optee_keymaster_ipc.h>
 
 #undef LOG_TAG
 #define LOG_TAG "OpteeKeymaster_ipc"
 
 static TEEC_Context ctx;
-static TEEC_Session sess;
+
+/*
+ * A TA session with its request and response buffers, registered once per
+ * session so commands don't pay for temporary memref registration and
+ * bounce copies. The data regions of large calls are allocated on the first
+ * one and only reallocated to grow. A session serves one call at a time.
+ */
+struct optee_keymaster_session {
+    TEEC_Session sess;
+    TEEC_SharedMemory send_shm;
+    TEEC_SharedMemory recv_shm;
+    TEEC_SharedMemory data_in_shm;
+    TEEC_SharedMemory data_out_shm;
+    bool connected;
+    bool busy;
+};
+
+/*
+ * Sessions are opened on demand up to OPTEE_KEYMASTER_MAX_SESSIONS while
+ * the pool is connected. Operations stay on the session which began them,
+ * the TA shares its operation table between sessions so a lost pin only
+ * costs locality. Loaded keys are private to the session which loaded them,
+ * their pins go when the key is unloaded or the TA no longer knows it.
+ */
+static std::mutex pool_lock;
+static std::condition_variable pool_cond;
+static optee_keymaster_session pool[OPTEE_KEYMASTER_MAX_SESSIONS];
 static bool connected = false;
+static std::unordered_map<uint64_t, size_t> op_sessions;
+static const size_t OPTEE_KEYMASTER_MAX_PINNED_OPS = 256;
+static std::unordered_map<uint64_t, size_t> key_sessions;
+/* Data region size granted by the TA, 0 if it has no large commands */
+static size_t large_buf_size = 0;
+/* Bumped whenever the TA may have been restarted, see optee_keymaster_generation */
+static std::atomic<uint32_t> generation(0);
+
+/* Operation data passed beside the request, see optee_keymaster_call_large */
+struct optee_keymaster_data {
+    const uint8_t* in;
+    size_t in_size;
+    size_t out_room;
+    keymaster::Buffer* out;
+};
+/* Data regions grow in steps of this size */
+static const size_t OPTEE_KEYMASTER_DATA_GRANULE = 64 * 1024;
+
+static TEEC_Result optee_keymaster_alloc_shm(TEEC_SharedMemory* shm,
+                                             size_t size, uint32_t flags) {
+    TEEC_Result res;
+
+    (void)memset(shm, 0, sizeof(*shm));
+    shm->size = size;
+    shm->flags = flags;
+    res = TEEC_AllocateSharedMemory(&ctx, shm);
+    if (res != TEEC_SUCCESS) {
+        ALOGE("TEEC_AllocateSharedMemory failed with code 0x%x", res);
+        return res;
+    }
+    (void)memset(shm->buffer, 0, size);
+    return TEEC_SUCCESS;
+}
+
+static void optee_keymaster_free_shm(TEEC_SharedMemory* shm) {
+    if (!shm->buffer)
+        return;
+    keymaster::memset_s(shm->buffer, 0, shm->size);
+    TEEC_ReleaseSharedMemory(shm);
+    shm->buffer = NULL;
+}
+
+/* Makes shm at least size bytes, its content is not kept */
+static TEEC_Result optee_keymaster_reserve_shm(TEEC_SharedMemory* shm,
+                                               size_t size, uint32_t flags) {
+    if (shm->buffer && shm->size >= size)
+        return TEEC_SUCCESS;
+    optee_keymaster_free_shm(shm);
+    size = (size + OPTEE_KEYMASTER_DATA_GRANULE - 1) /
+           OPTEE_KEYMASTER_DATA_GRANULE * OPTEE_KEYMASTER_DATA_GRANULE;
+    return optee_keymaster_alloc_shm(shm, size, flags);
+}
+
+static TEEC_Result optee_keymaster_open_session(optee_keymaster_session* s) {
+    TEEC_Result res;
+    TEEC_UUID uuid = TA_KEYMASTER_UUID;
+    uint32_t err_origin;
+
+    /* Open a session to the TA */
+    res = TEEC_OpenSession(&ctx, &s->sess, &uuid, TEEC_LOGIN_PUBLIC,
+            NULL, NULL, &err_origin);
+    if (res != TEEC_SUCCESS) {
+        ALOGE("TEEC_Opensession failed with code 0x%x origin 0x%x",
+                res, err_origin);
+        return res;
+    }
+    res = optee_keymaster_alloc_shm(&s->send_shm,
+                                    OPTEE_KEYMASTER_SEND_BUF_SIZE,
+                                    TEEC_MEM_INPUT);
+    if (res == TEEC_SUCCESS)
+        res = optee_keymaster_alloc_shm(&s->recv_shm,
+                                        OPTEE_KEYMASTER_RECV_BUF_SIZE,
+                                        TEEC_MEM_OUTPUT);
+    if (res != TEEC_SUCCESS) {
+        optee_keymaster_free_shm(&s->send_shm);
+        TEEC_CloseSession(&s->sess);
+        return res;
+    }
+    s->connected = true;
+    return TEEC_SUCCESS;
+}
+
+static void optee_keymaster_close_session(optee_keymaster_session* s) {
+    if (!s->connected)
+        return;
+    optee_keymaster_free_shm(&s->send_shm);
+    optee_keymaster_free_shm(&s->recv_shm);
+    optee_keymaster_free_shm(&s->data_in_shm);
+    optee_keymaster_free_shm(&s->data_out_shm);
+    TEEC_CloseSession(&s->sess);
+    s->connected = false;
+}
+
+/*
+ * Takes a session for one call: the one handle is pinned to in pins if
+ * given and still open, else any idle one, opening a new one when all are
+ * busy. Returns OPTEE_KEYMASTER_MAX_SESSIONS when the pool is disconnected.
+ */
+static size_t optee_keymaster_acquire(
+		const std::unordered_map<uint64_t, size_t>* pins, uint64_t handle) {
+    std::unique_lock<std::mutex> lock(pool_lock);
+
+    while (connected) {
+        size_t idle = OPTEE_KEYMASTER_MAX_SESSIONS;
+        size_t closed = OPTEE_KEYMASTER_MAX_SESSIONS;
+
+        if (pins) {
+            auto it = pins->find(handle);
+            if (it != pins->end() && pool[it->second].connected) {
+                if (!pool[it->second].busy) {
+                    pool[it->second].busy = true;
+                    return it->second;
+                }
+                pool_cond.wait(lock);
+                continue;
+            }
+        }
+        for (size_t i = 0; i < OPTEE_KEYMASTER_MAX_SESSIONS; i++) {
+            if (pool[i].connected && !pool[i].busy) {
+                idle = i;
+                break;
+            }
+            if (!pool[i].connected && !pool[i].busy &&
+                closed == OPTEE_KEYMASTER_MAX_SESSIONS)
+                closed = i;
+        }
+        if (idle != OPTEE_KEYMASTER_MAX_SESSIONS) {
+            pool[idle].busy = true;
+            return idle;
+        }
+        if (closed != OPTEE_KEYMASTER_MAX_SESSIONS) {
+            /* open outside of the lock, other sessions stay usable */
+            pool[closed].busy = true;
+            lock.unlock();
+            TEEC_Result res = optee_keymaster_open_session(&pool[closed]);
+            lock.lock();
+            if (res == TEEC_SUCCESS)
+                return closed;
+            pool[closed].busy = false;
+            bool any = false;
+            for (size_t i = 0; i < OPTEE_KEYMASTER_MAX_SESSIONS; i++)
+                any = any || pool[i].connected;
+            if (!any)
+                break;
+        }
+        pool_cond.wait(lock);
+    }
+    return OPTEE_KEYMASTER_MAX_SESSIONS;
+}
+
+static void optee_keymaster_release(size_t idx) {
+    std::lock_guard<std::mutex> lock(pool_lock);
+
+    pool[idx].busy = false;
+    pool_cond.notify_all();
+}
 
 int optee_keymaster_initialize(void) {
     TEEC_Result res;
@@ -44,32 +232,87 @@ int optee_keymaster_initialize(void) {
     return 0;
 }
 
-int optee_keymaster_connect(void) {
+/*
+ * Asks the TA for data regions of OPTEE_KEYMASTER_LARGE_BUF_SIZE bytes and
+ * returns the size granted, 0 if the TA doesn't know large commands.
+ */
+static size_t optee_keymaster_negotiate(optee_keymaster_session* s) {
+    TEEC_Operation op;
     TEEC_Result res;
-    TEEC_UUID uuid = TA_KEYMASTER_UUID;
     uint32_t err_origin;
+    uint32_t wanted = OPTEE_KEYMASTER_LARGE_BUF_SIZE;
+    uint32_t granted = 0;
+    int32_t error = KM_ERROR_OK;
+    uint8_t* recv_buf = (uint8_t*)s->recv_shm.buffer;
+
+    (void)memset(&op, 0, sizeof(op));
+    memcpy(s->send_shm.buffer, &wanted, sizeof(wanted));
+    op.paramTypes = (uint32_t)TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT,
+                                               TEEC_MEMREF_PARTIAL_OUTPUT,
+                                               TEEC_NONE,
+                                               TEEC_NONE);
+    op.params[0].memref.parent = &s->send_shm;
+    op.params[0].memref.size = sizeof(wanted);
+    op.params[1].memref.parent = &s->recv_shm;
+    op.params[1].memref.size = OPTEE_KEYMASTER_RECV_BUF_SIZE;
+    res = TEEC_InvokeCommand(&s->sess, KM_NEGOTIATE_BUFFERS, &op, &err_origin);
+    if (res != TEEC_SUCCESS ||
+        op.params[1].memref.size < sizeof(error) + sizeof(granted)) {
+        ALOGI("Large update/finish unavailable, res 0x%x", res);
+        return 0;
+    }
+    memcpy(&error, recv_buf, sizeof(error));
+    memcpy(&granted, recv_buf + sizeof(error), sizeof(granted));
+    if (error != KM_ERROR_OK)
+        return 0;
+    ALOGI("Large update/finish regions of %u bytes", granted);
+    return granted;
+}
+
+int optee_keymaster_connect(void) {
+    TEEC_Result res;
+    std::lock_guard<std::mutex> lock(pool_lock);
 
     if (connected) {
         ALOGE("Connection with trustled application already established");
         return false;
     }
 
-    /* Open a session to the TA */
-    res = TEEC_OpenSession(&ctx, &sess, &uuid, TEEC_LOGIN_PUBLIC,
-            NULL, NULL, &err_origin);
-    if (res != TEEC_SUCCESS) {
-        ALOGE("TEEC_Opensession failed with code 0x%x origin 0x%x",
-                res, err_origin);
+    /* one session up front so the TA is known to be reachable */
+    res = optee_keymaster_open_session(&pool[0]);
+    if (res != TEEC_SUCCESS)
         return (int)res;
-    }
+    large_buf_size = optee_keymaster_negotiate(&pool[0]);
     connected = true;
+    generation++;
     ALOGI("Connection with keystore was established");
     return 0;
 }
 
 void optee_keymaster_disconnect(void) {
-    TEEC_CloseSession(&sess);
-    connected  = false;
+    std::unique_lock<std::mutex> lock(pool_lock);
+
+    connected = false;
+    pool_cond.notify_all();
+    /* let calls in flight finish with their session */
+    for (size_t i = 0; i < OPTEE_KEYMASTER_MAX_SESSIONS; i++) {
+        while (pool[i].busy)
+            pool_cond.wait(lock);
+        optee_keymaster_close_session(&pool[i]);
+    }
+    op_sessions.clear();
+    key_sessions.clear();
+    large_buf_size = 0;
+}
+
+size_t optee_keymaster_large_buffer_size(void) {
+    std::lock_guard<std::mutex> lock(pool_lock);
+
+    return large_buf_size;
+}
+
+uint32_t optee_keymaster_generation(void) {
+    return generation;
 }
 
 void optee_keymaster_finalize(void) {
@@ -195,19 +438,15 @@ const char* keymaster_error_message(uint32_t error) {
     }
 }
 
-keymaster_error_t optee_keymaster_call(uint32_t cmd,
+static keymaster_error_t optee_keymaster_session_call(
+				       optee_keymaster_session* s, uint32_t cmd,
 				       const keymaster::Serializable& req,
-				       keymaster::KeymasterResponse* rsp) {
+				       keymaster::KeymasterResponse* rsp,
+				       const optee_keymaster_data* data) {
     TEEC_Operation op;
     uint32_t res;
     uint32_t err_origin;
 
-    ALOGD("%s %d %u\n", __func__, __LINE__, cmd);
-    if (!connected) {
-	ALOGE("Keystore trusted application is not connected");
-	return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
-    }
-
     (void)memset(&op, 0, sizeof(op));
 
     uint32_t req_size = req.SerializedSize();
@@ -217,33 +456,83 @@ keymaster_error_t optee_keymaster_call(uint32_t cmd,
 	return KM_ERROR_INVALID_INPUT_LENGTH;
     }
 
-    uint8_t send_buf[OPTEE_KEYMASTER_SEND_BUF_SIZE];
-    keymaster::Eraser send_buf_eraser(send_buf, OPTEE_KEYMASTER_SEND_BUF_SIZE);
+    uint8_t* send_buf = (uint8_t*)s->send_shm.buffer;
     req.Serialize(send_buf, send_buf + req_size);
 
-    /* Send it */
-    uint8_t recv_buf[OPTEE_KEYMASTER_RECV_BUF_SIZE];
-    keymaster::Eraser recv_buf_eraser(recv_buf, OPTEE_KEYMASTER_RECV_BUF_SIZE);
+    /* Send it, only the used part of each region crosses the boundary */
     uint32_t rsp_size = OPTEE_KEYMASTER_RECV_BUF_SIZE;
-    op.paramTypes = (uint32_t)TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					       TEEC_MEMREF_TEMP_OUTPUT,
+    op.paramTypes = (uint32_t)TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT,
+					       TEEC_MEMREF_PARTIAL_OUTPUT,
 					       TEEC_NONE,
 					       TEEC_NONE);
-	op.params[0].tmpref.buffer = (void*)send_buf;
-	op.params[0].tmpref.size   = req_size;
-	op.params[1].tmpref.buffer = (void*)recv_buf;
-	op.params[1].tmpref.size   = rsp_size;
+	op.params[0].memref.parent = &s->send_shm;
+	op.params[0].memref.offset = 0;
+	op.params[0].memref.size   = req_size;
+	op.params[1].memref.parent = &s->recv_shm;
+	op.params[1].memref.offset = 0;
+	op.params[1].memref.size   = rsp_size;
+    if (data) {
+	/* the TA writes the produced data straight into data_out_shm */
+	if (optee_keymaster_reserve_shm(&s->data_in_shm, data->in_size,
+					TEEC_MEM_INPUT) != TEEC_SUCCESS ||
+	    optee_keymaster_reserve_shm(&s->data_out_shm, data->out_room,
+					TEEC_MEM_OUTPUT) != TEEC_SUCCESS) {
+	    keymaster::memset_s(send_buf, 0, req_size);
+	    return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+	}
+	memcpy(s->data_in_shm.buffer, data->in, data->in_size);
+	op.paramTypes = (uint32_t)TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT,
+						   TEEC_MEMREF_PARTIAL_OUTPUT,
+						   TEEC_MEMREF_PARTIAL_INPUT,
+						   TEEC_MEMREF_PARTIAL_OUTPUT);
+	op.params[2].memref.parent = &s->data_in_shm;
+	op.params[2].memref.size = data->in_size;
+	op.params[3].memref.parent = &s->data_out_shm;
+	op.params[3].memref.size = data->out_room;
+    }
 
-    res = TEEC_InvokeCommand(&sess, cmd, &op, &err_origin);
+    res = TEEC_InvokeCommand(&s->sess, cmd, &op, &err_origin);
+    keymaster::memset_s(send_buf, 0, req_size);
+    if (data) {
+	size_t out_size = op.params[3].memref.size;
+
+	keymaster::memset_s(s->data_in_shm.buffer, 0, data->in_size);
+	if (res == TEEC_SUCCESS && out_size > data->out_room) {
+	    /* the produced data didn't fit, don't pass it off as empty */
+	    ALOGE("TA produced %zu bytes for %zu bytes of room", out_size,
+		  data->out_room);
+	    return KM_ERROR_UNKNOWN_ERROR;
+	}
+	if (res == TEEC_SUCCESS) {
+	    bool stored = data->out->Reinitialize(
+		static_cast<uint8_t*>(s->data_out_shm.buffer), out_size);
+
+	    keymaster::memset_s(s->data_out_shm.buffer, 0, out_size);
+	    if (!stored)
+		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+	}
+    }
     if (res != TEEC_SUCCESS) {
 	ALOGI("TEEC_InvokeCommand cmd %d failed with code 0x%08x (%s) origin "
 	      "0x%08x", cmd, res, keymaster_error_message(res), err_origin);
 	if (res == TEEC_ERROR_TARGET_DEAD) {
-		optee_keymaster_disconnect();
-		optee_keymaster_connect();
+		/* the other sessions reopen on their own next failure */
+		optee_keymaster_close_session(s);
+		optee_keymaster_open_session(s);
+		generation++;
+		/* recv_shm is a fresh region, there is no response in it */
+		return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
 	}
     }
 
+    uint8_t* recv_buf = (uint8_t*)s->recv_shm.buffer;
+    if (!s->connected) {
+	ALOGE("Keystore trusted application is not connected");
+	return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+    if (op.params[1].memref.size < rsp_size)
+	rsp_size = op.params[1].memref.size;
+    keymaster::Eraser recv_buf_eraser(recv_buf, rsp_size);
     const uint8_t* p = recv_buf;
     if (!rsp->Deserialize(&p, p + rsp_size)) {
 	ALOGE("Error deserializing response of size %d\n", (int)rsp_size);
@@ -269,3 +558,135 @@ keymaster_error_t optee_keymaster_call(uint32_t cmd,
 
     return rsp->error;
 }
+
+/* Returns the loaded key a call uses, if any */
+static bool optee_keymaster_key_handle(uint32_t cmd,
+				       const keymaster::Serializable& req,
+				       uint64_t* key) {
+    switch (cmd) {
+	case KM_UNLOAD_KEY:
+	    *key = static_cast<const keymaster::UnloadKeyRequest&>(req)
+		.key_handle;
+	    return true;
+	case KM_BEGIN_LOADED:
+	    *key = static_cast<const keymaster::BeginLoadedRequest&>(req)
+		.key_handle;
+	    return true;
+	default:
+	    return false;
+    }
+}
+
+/* Returns the operation a call continues, if any */
+static bool optee_keymaster_op_handle(uint32_t cmd,
+				      const keymaster::Serializable& req,
+				      keymaster_operation_handle_t* op) {
+    switch (cmd) {
+	case KM_UPDATE_OPERATION:
+	case KM_UPDATE_LARGE:
+	    *op = static_cast<const keymaster::UpdateOperationRequest&>(req)
+		.op_handle;
+	    return true;
+	case KM_FINISH_OPERATION:
+	case KM_FINISH_LARGE:
+	    *op = static_cast<const keymaster::FinishOperationRequest&>(req)
+		.op_handle;
+	    return true;
+	case KM_ABORT_OPERATION:
+	    *op = static_cast<const keymaster::AbortOperationRequest&>(req)
+		.op_handle;
+	    return true;
+	default:
+	    return false;
+    }
+}
+
+/* op is the operation the call continues, looked up in req if NULL */
+static keymaster_error_t optee_keymaster_dispatch(uint32_t cmd,
+				       const keymaster::Serializable& req,
+				       keymaster::KeymasterResponse* rsp,
+				       const optee_keymaster_data* data,
+				       const keymaster_operation_handle_t* op) {
+    keymaster_operation_handle_t op_handle = 0;
+    uint64_t key_handle = 0;
+    bool pinned;
+    bool keyed;
+    size_t idx;
+    keymaster_error_t err;
+
+    ALOGD("%s %d %u\n", __func__, __LINE__, cmd);
+    if (op) {
+	op_handle = *op;
+	pinned = true;
+    } else {
+	pinned = optee_keymaster_op_handle(cmd, req, &op_handle);
+    }
+    keyed = optee_keymaster_key_handle(cmd, req, &key_handle);
+    if (keyed)
+	idx = optee_keymaster_acquire(&key_sessions, key_handle);
+    else
+	idx = optee_keymaster_acquire(pinned ? &op_sessions : NULL, op_handle);
+    if (idx == OPTEE_KEYMASTER_MAX_SESSIONS) {
+	ALOGE("Keystore trusted application is not connected");
+	return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+    }
+
+    err = optee_keymaster_session_call(&pool[idx], cmd, req, rsp, data);
+
+    {
+	std::lock_guard<std::mutex> lock(pool_lock);
+
+	if ((cmd == KM_BEGIN_OPERATION || cmd == KM_BEGIN_LOADED) &&
+	    err == KM_ERROR_OK) {
+	    /* pins are only a hint, drop them all rather than grow */
+	    if (op_sessions.size() >= OPTEE_KEYMASTER_MAX_PINNED_OPS)
+		op_sessions.clear();
+	    op_sessions[static_cast<keymaster::BeginOperationResponse*>(rsp)
+			->op_handle] = idx;
+	} else if (pinned && ((cmd != KM_UPDATE_OPERATION &&
+			       cmd != KM_UPDATE_LARGE) || err != KM_ERROR_OK)) {
+	    /* finished, aborted or failed operations are gone in the TA */
+	    op_sessions.erase(op_handle);
+	}
+	if (cmd == KM_LOAD_KEY && err == KM_ERROR_OK) {
+	    /* loaded keys only exist in this session, the pin is binding */
+	    key_sessions[static_cast<keymaster::LoadKeyResponse*>(rsp)
+			 ->key_handle] = idx;
+	} else if (keyed && (cmd == KM_UNLOAD_KEY ||
+			     err == KM_ERROR_INVALID_KEY_BLOB)) {
+	    /* unloaded, or lost when the TA restarted */
+	    key_sessions.erase(key_handle);
+	}
+    }
+    optee_keymaster_release(idx);
+    return err;
+}
+
+keymaster_error_t optee_keymaster_call(uint32_t cmd,
+				       const keymaster::Serializable& req,
+				       keymaster::KeymasterResponse* rsp) {
+    return optee_keymaster_dispatch(cmd, req, rsp, NULL, NULL);
+}
+
+keymaster_error_t optee_keymaster_call_op(uint32_t cmd,
+				       keymaster_operation_handle_t op_handle,
+				       const keymaster::Serializable& req,
+				       keymaster::KeymasterResponse* rsp) {
+    return optee_keymaster_dispatch(cmd, req, rsp, NULL, &op_handle);
+}
+
+keymaster_error_t optee_keymaster_call_large(uint32_t cmd,
+				       const keymaster::Serializable& req,
+				       keymaster::KeymasterResponse* rsp,
+				       const uint8_t* in, size_t in_size,
+				       size_t out_room, keymaster::Buffer* out) {
+    optee_keymaster_data data = { in, in_size, out_room, out };
+
+    if (in_size > optee_keymaster_large_buffer_size() ||
+        out_room > optee_keymaster_large_buffer_size()) {
+	ALOGE("Data too big: %zu/%zu Max size: %zu", in_size, out_room,
+	      optee_keymaster_large_buffer_size());
+	return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+    return optee_keymaster_dispatch(cmd, req, rsp, &data, NULL);
+}
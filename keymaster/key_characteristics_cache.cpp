@@ -0,0 +1,117 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <openssl/sha.h>
+
+#include <optee_keymaster/key_characteristics_cache.h>
+
+namespace keymaster {
+
+static std::string BlobDigest(const keymaster_key_blob_t& key_blob) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+
+    SHA256(key_blob.key_material, key_blob.key_material_size, digest);
+    return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+}
+
+static void UpdateWithBlob(SHA256_CTX* ctx, const keymaster_blob_t& blob) {
+    uint32_t length = blob.data_length;
+
+    /* length prefixed so client id and app data can't run into each other */
+    SHA256_Update(ctx, &length, sizeof(length));
+    SHA256_Update(ctx, blob.data, blob.data_length);
+}
+
+static std::string RequestDigest(const std::string& blob_digest,
+                                 const GetKeyCharacteristicsRequest& request) {
+    keymaster_blob_t client_id = {};
+    keymaster_blob_t app_data = {};
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+
+    request.additional_params.GetTagValue(TAG_APPLICATION_ID, &client_id);
+    request.additional_params.GetTagValue(TAG_APPLICATION_DATA, &app_data);
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, blob_digest.data(), blob_digest.size());
+    UpdateWithBlob(&ctx, client_id);
+    UpdateWithBlob(&ctx, app_data);
+    SHA256_Final(digest, &ctx);
+    return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+}
+
+bool KeyCharacteristicsCache::Lookup(const GetKeyCharacteristicsRequest& request,
+                                     GetKeyCharacteristicsResponse* response) {
+    std::string digest = RequestDigest(BlobDigest(request.key_blob), request);
+    std::lock_guard<std::mutex> lock(lock_);
+
+    auto it = index_.find(digest);
+    if (it == index_.end())
+        return false;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    if (!response->enforced.Reinitialize(it->second->enforced) ||
+        !response->unenforced.Reinitialize(it->second->unenforced))
+        return false;
+    response->error = KM_ERROR_OK;
+    return true;
+}
+
+void KeyCharacteristicsCache::Insert(const GetKeyCharacteristicsRequest& request,
+                                     const GetKeyCharacteristicsResponse& response) {
+    std::string blob_digest = BlobDigest(request.key_blob);
+    std::string digest = RequestDigest(blob_digest, request);
+    std::lock_guard<std::mutex> lock(lock_);
+
+    if (index_.find(digest) != index_.end())
+        return;
+    if (entries_.size() >= kMaxEntries) {
+        index_.erase(entries_.back().digest);
+        entries_.pop_back();
+    }
+    entries_.emplace_front();
+    Entry& entry = entries_.front();
+    entry.digest = digest;
+    entry.blob_digest = blob_digest;
+    if (!entry.enforced.Reinitialize(response.enforced) ||
+        !entry.unenforced.Reinitialize(response.unenforced)) {
+        entries_.pop_front();
+        return;
+    }
+    index_[digest] = entries_.begin();
+}
+
+void KeyCharacteristicsCache::Invalidate(const keymaster_key_blob_t& key_blob) {
+    std::string blob_digest = BlobDigest(key_blob);
+    std::lock_guard<std::mutex> lock(lock_);
+
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (it->blob_digest == blob_digest) {
+            index_.erase(it->digest);
+            it = entries_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void KeyCharacteristicsCache::Clear() {
+    std::lock_guard<std::mutex> lock(lock_);
+
+    index_.clear();
+    entries_.clear();
+}
+
+} // namespace keymaster
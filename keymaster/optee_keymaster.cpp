@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <log/log.h>
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/keymaster_configuration.h>
@@ -40,6 +42,12 @@ int OpteeKeymaster::Initialize() {
         return err;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(capabilities_lock_);
+        if (!LoadCapabilities())
+            ALOGW("TA has no capability table, queries go to the TA");
+    }
+
     // Try GetVersion2 first.
     GetVersion2Request versionReq;
     GetVersion2Response versionRsp = GetVersion2(versionReq);
@@ -108,38 +116,112 @@ static void ForwardCommand(enum keymaster_command command, const KeymasterMessag
     }
 }
 
+bool OpteeKeymaster::LoadCapabilities() {
+    uint32_t generation = optee_keymaster_generation();
+    keymaster_error_t err;
+
+    /* a TA without the table stays without it until it is restarted */
+    if (capabilities_tried_ && capabilities_generation_ == generation)
+        return capabilities_loaded_;
+    /* the request has no fields, any empty message will do */
+    GetVersionRequest request;
+    CapabilitiesResponse response;
+    err = optee_keymaster_call(KM_GET_CAPABILITIES, request, &response);
+    capabilities_tried_ = true;
+    capabilities_generation_ = generation;
+    capabilities_loaded_ = err == KM_ERROR_OK;
+    if (!capabilities_loaded_)
+        return false;
+    capabilities_.major_ver = response.major_ver;
+    capabilities_.minor_ver = response.minor_ver;
+    capabilities_.subminor_ver = response.subminor_ver;
+    capabilities_.lists.swap(response.lists);
+    return true;
+}
+
+template <typename T>
+bool OpteeKeymaster::AnswerSupported(uint32_t command, uint32_t algorithm, uint32_t purpose,
+                                     SupportedResponse<T>* response) {
+    std::lock_guard<std::mutex> lock(capabilities_lock_);
+
+    if (!LoadCapabilities())
+        return false;
+    const auto& lists = capabilities_.lists;
+    auto it = lists.find(CapabilitiesResponse::Query(command, algorithm, purpose));
+    if (it == lists.end()) {
+        /* a known algorithm without an entry doesn't support the purpose */
+        auto algorithms = lists.find(CapabilitiesResponse::Query(
+            KM_GET_SUPPORTED_ALGORITHMS, KM_CAPABILITY_ANY, KM_CAPABILITY_ANY));
+        bool known = algorithms != lists.end() &&
+                     std::find(algorithms->second.begin(), algorithms->second.end(),
+                               algorithm) != algorithms->second.end();
+        response->error = known ? KM_ERROR_UNSUPPORTED_PURPOSE : KM_ERROR_UNSUPPORTED_ALGORITHM;
+        return true;
+    }
+
+    std::vector<T> results;
+    for (uint32_t value : it->second)
+        results.push_back(static_cast<T>(value));
+    response->error = KM_ERROR_OK;
+    response->SetResults(results.data(), results.size());
+    return true;
+}
+
 void OpteeKeymaster::GetVersion(const GetVersionRequest& request, GetVersionResponse* response) {
+    {
+        std::lock_guard<std::mutex> lock(capabilities_lock_);
+
+        if (LoadCapabilities()) {
+            response->major_ver = capabilities_.major_ver;
+            response->minor_ver = capabilities_.minor_ver;
+            response->subminor_ver = capabilities_.subminor_ver;
+            response->error = KM_ERROR_OK;
+            return;
+        }
+    }
     ForwardCommand(KM_GET_VERSION, request, response);
 }
 
 void OpteeKeymaster::SupportedAlgorithms(const SupportedAlgorithmsRequest& request,
                                           SupportedAlgorithmsResponse* response) {
-    ForwardCommand(KM_GET_SUPPORTED_ALGORITHMS, request, response);
+    if (!AnswerSupported(KM_GET_SUPPORTED_ALGORITHMS, KM_CAPABILITY_ANY, KM_CAPABILITY_ANY,
+                         response))
+        ForwardCommand(KM_GET_SUPPORTED_ALGORITHMS, request, response);
 }
 
 void OpteeKeymaster::SupportedBlockModes(const SupportedBlockModesRequest& request,
                                           SupportedBlockModesResponse* response) {
-    ForwardCommand(KM_GET_SUPPORTED_BLOCK_MODES, request, response);
+    if (!AnswerSupported(KM_GET_SUPPORTED_BLOCK_MODES, request.algorithm, request.purpose,
+                         response))
+        ForwardCommand(KM_GET_SUPPORTED_BLOCK_MODES, request, response);
 }
 
 void OpteeKeymaster::SupportedPaddingModes(const SupportedPaddingModesRequest& request,
                                             SupportedPaddingModesResponse* response) {
-    ForwardCommand(KM_GET_SUPPORTED_PADDING_MODES, request, response);
+    if (!AnswerSupported(KM_GET_SUPPORTED_PADDING_MODES, request.algorithm, request.purpose,
+                         response))
+        ForwardCommand(KM_GET_SUPPORTED_PADDING_MODES, request, response);
 }
 
 void OpteeKeymaster::SupportedDigests(const SupportedDigestsRequest& request,
                                        SupportedDigestsResponse* response) {
-    ForwardCommand(KM_GET_SUPPORTED_DIGESTS, request, response);
+    if (!AnswerSupported(KM_GET_SUPPORTED_DIGESTS, request.algorithm, request.purpose,
+                         response))
+        ForwardCommand(KM_GET_SUPPORTED_DIGESTS, request, response);
 }
 
 void OpteeKeymaster::SupportedImportFormats(const SupportedImportFormatsRequest& request,
                                              SupportedImportFormatsResponse* response) {
-    ForwardCommand(KM_GET_SUPPORTED_IMPORT_FORMATS, request, response);
+    if (!AnswerSupported(KM_GET_SUPPORTED_IMPORT_FORMATS, request.algorithm, KM_CAPABILITY_ANY,
+                         response))
+        ForwardCommand(KM_GET_SUPPORTED_IMPORT_FORMATS, request, response);
 }
 
 void OpteeKeymaster::SupportedExportFormats(const SupportedExportFormatsRequest& request,
                                              SupportedExportFormatsResponse* response) {
-    ForwardCommand(KM_GET_SUPPORTED_EXPORT_FORMATS, request, response);
+    if (!AnswerSupported(KM_GET_SUPPORTED_EXPORT_FORMATS, request.algorithm, KM_CAPABILITY_ANY,
+                         response))
+        ForwardCommand(KM_GET_SUPPORTED_EXPORT_FORMATS, request, response);
 }
 
 void OpteeKeymaster::AddRngEntropy(const AddEntropyRequest& request,
@@ -165,7 +247,11 @@ void OpteeKeymaster::GenerateKey(const GenerateKeyRequest& request,
 
 void OpteeKeymaster::GetKeyCharacteristics(const GetKeyCharacteristicsRequest& request,
                                             GetKeyCharacteristicsResponse* response) {
+    if (characteristics_cache_.Lookup(request, response))
+        return;
     ForwardCommand(KM_GET_KEY_CHARACTERISTICS, request, response);
+    if (response->error == KM_ERROR_OK)
+        characteristics_cache_.Insert(request, *response);
 }
 
 void OpteeKeymaster::ImportKey(const ImportKeyRequest& request, ImportKeyResponse* response) {
@@ -187,14 +273,18 @@ void OpteeKeymaster::AttestKey(const AttestKeyRequest& request, AttestKeyRespons
 
 void OpteeKeymaster::UpgradeKey(const UpgradeKeyRequest& request, UpgradeKeyResponse* response) {
     ForwardCommand(KM_UPGRADE_KEY, request, response);
+    if (response->error == KM_ERROR_OK)
+        characteristics_cache_.Invalidate(request.key_blob);
 }
 
 void OpteeKeymaster::DeleteKey(const DeleteKeyRequest& request, DeleteKeyResponse* response) {
+    characteristics_cache_.Invalidate(request.key_blob);
     ForwardCommand(KM_DELETE_KEY, request, response);
 }
 
 void OpteeKeymaster::DeleteAllKeys(const DeleteAllKeysRequest& request,
                                     DeleteAllKeysResponse* response) {
+    characteristics_cache_.Clear();
     ForwardCommand(KM_DELETE_ALL_KEYS, request, response);
 }
 
@@ -203,14 +293,59 @@ void OpteeKeymaster::BeginOperation(const BeginOperationRequest& request,
     ForwardCommand(KM_BEGIN_OPERATION, request, response);
 }
 
+/*
+ * Data too big for the request buffers travels in its own regions, which the
+ * TA processes in place, provided the TA agreed to take regions that large.
+ */
+static bool UseLargeCall(const Buffer& input) {
+    size_t size = input.available_read();
+
+    return size > OPTEE_KEYMASTER_LARGE_THRESHOLD &&
+           size + OPTEE_KEYMASTER_LARGE_OUT_SLACK <= optee_keymaster_large_buffer_size();
+}
+
+/* Sends req with input as its data, the produced data is stored in output */
+static void ForwardLargeCommand(enum keymaster_command command, const KeymasterMessage& req,
+                                const Buffer& input, KeymasterResponse* rsp,
+                                Buffer* output) {
+    size_t room = input.available_read() + OPTEE_KEYMASTER_LARGE_OUT_SLACK;
+    keymaster_error_t err;
+
+    /* the response itself carries an empty output blob */
+    err = optee_keymaster_call_large(command, req, rsp, input.peek_read(),
+                                     input.available_read(), room, output);
+    if (err != KM_ERROR_OK) {
+        ALOGE("Failed to send cmd %d err: %d", command, err);
+        rsp->error = err;
+    }
+}
+
 void OpteeKeymaster::UpdateOperation(const UpdateOperationRequest& request,
                                       UpdateOperationResponse* response) {
-    ForwardCommand(KM_UPDATE_OPERATION, request, response);
+    if (!UseLargeCall(request.input)) {
+        ForwardCommand(KM_UPDATE_OPERATION, request, response);
+        return;
+    }
+    UpdateOperationRequest header(message_version());
+    header.op_handle = request.op_handle;
+    header.additional_params.Reinitialize(request.additional_params);
+    ForwardLargeCommand(KM_UPDATE_LARGE, header, request.input, response,
+                        &response->output);
 }
 
 void OpteeKeymaster::FinishOperation(const FinishOperationRequest& request,
                                       FinishOperationResponse* response) {
-    ForwardCommand(KM_FINISH_OPERATION, request, response);
+    if (!UseLargeCall(request.input)) {
+        ForwardCommand(KM_FINISH_OPERATION, request, response);
+        return;
+    }
+    FinishOperationRequest header(message_version());
+    header.op_handle = request.op_handle;
+    header.signature.Reinitialize(request.signature.peek_read(),
+                                  request.signature.available_read());
+    header.additional_params.Reinitialize(request.additional_params);
+    ForwardLargeCommand(KM_FINISH_LARGE, header, request.input, response,
+                        &response->output);
 }
 
 void OpteeKeymaster::AbortOperation(const AbortOperationRequest& request,
@@ -218,6 +353,45 @@ void OpteeKeymaster::AbortOperation(const AbortOperationRequest& request,
     ForwardCommand(KM_ABORT_OPERATION, request, response);
 }
 
+void OpteeKeymaster::BeginOperation(const ForwardedRequest& request,
+                                     BeginOperationResponse* response) {
+    ForwardCommand(KM_BEGIN_OPERATION, request, response);
+}
+
+static void ForwardOperationCommand(enum keymaster_command command,
+                                    const ForwardedRequest& req, KeymasterResponse* rsp) {
+    keymaster_error_t err;
+
+    err = optee_keymaster_call_op(command, req.op_handle, req, rsp);
+    if (err != KM_ERROR_OK) {
+        ALOGE("Failed to send cmd %d err: %d", command, err);
+        rsp->error = err;
+    }
+}
+
+void OpteeKeymaster::UpdateOperation(const ForwardedRequest& request,
+                                      UpdateOperationResponse* response) {
+    ForwardOperationCommand(KM_UPDATE_OPERATION, request, response);
+}
+
+void OpteeKeymaster::FinishOperation(const ForwardedRequest& request,
+                                      FinishOperationResponse* response) {
+    ForwardOperationCommand(KM_FINISH_OPERATION, request, response);
+}
+
+void OpteeKeymaster::LoadKey(const LoadKeyRequest& request, LoadKeyResponse* response) {
+    ForwardCommand(KM_LOAD_KEY, request, response);
+}
+
+void OpteeKeymaster::UnloadKey(const UnloadKeyRequest& request, UnloadKeyResponse* response) {
+    ForwardCommand(KM_UNLOAD_KEY, request, response);
+}
+
+void OpteeKeymaster::BeginLoadedOperation(const BeginLoadedRequest& request,
+                                           BeginOperationResponse* response) {
+    ForwardCommand(KM_BEGIN_LOADED, request, response);
+}
+
 /* Methods for Keymaster 4.0 functionality -- not yet implemented */
 GetHmacSharingParametersResponse OpteeKeymaster::GetHmacSharingParameters() {
     GetHmacSharingParametersResponse response(message_version());
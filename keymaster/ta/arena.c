@@ -0,0 +1,203 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arena.h"
+#include "util.h"
+
+#define ARENA_ALIGN sizeof(uint64_t)
+/* First size of the spill index, doubled as it fills */
+#define ARENA_SPILL_INDEX_MIN 16U
+
+#if CFG_KM_ARENA_SIZE < 1024 || CFG_KM_ARENA_SIZE % 8
+#error "CFG_KM_ARENA_SIZE must be a multiple of 8 and at least 1024"
+#endif
+
+/* Header of a heap allocation made while the arena block was full */
+typedef struct {
+	size_t size;
+	size_t reserved; /* keeps data as aligned as TEE_Malloc does */
+} arena_spill_t;
+
+static uint64_t arena_block[CFG_KM_ARENA_SIZE / sizeof(uint64_t)];
+static size_t arena_used;
+/*
+ * Open-addressed (linear probing) set of the data pointers of spills, NULL
+ * marks an empty position. Allocated on the first spill of a command.
+ */
+static void **spill_index;
+static size_t spill_index_size;
+static size_t spill_count;
+static bool arena_active;
+
+static size_t TA_arena_spill_hash(const void *ptr)
+{
+	/* heap blocks are at least 16 bytes apart */
+	return ((uintptr_t)ptr >> 4) & (spill_index_size - 1);
+}
+
+/* Returns position of ptr in spill_index or spill_index_size */
+static size_t TA_arena_spill_find(const void *ptr)
+{
+	size_t pos = 0;
+
+	if (!spill_count)
+		return spill_index_size;
+	for (pos = TA_arena_spill_hash(ptr); spill_index[pos];
+	     pos = (pos + 1) & (spill_index_size - 1)) {
+		if (spill_index[pos] == ptr)
+			return pos;
+	}
+	return spill_index_size;
+}
+
+static void TA_arena_spill_insert(void *ptr)
+{
+	size_t pos = TA_arena_spill_hash(ptr);
+
+	while (spill_index[pos])
+		pos = (pos + 1) & (spill_index_size - 1);
+	spill_index[pos] = ptr;
+	spill_count++;
+}
+
+static void TA_arena_spill_remove(size_t pos)
+{
+	size_t next = pos;
+	size_t home = 0;
+	const size_t mask = spill_index_size - 1;
+
+	/* backward shift deletion, as for the operation index */
+	spill_index[pos] = NULL;
+	spill_count--;
+	for (;;) {
+		next = (next + 1) & mask;
+		if (!spill_index[next])
+			break;
+		home = TA_arena_spill_hash(spill_index[next]);
+		if (((next - home) & mask) >= ((next - pos) & mask)) {
+			spill_index[pos] = spill_index[next];
+			spill_index[next] = NULL;
+			pos = next;
+		}
+	}
+}
+
+/* Makes room for one more spill, keeping the index at most half full */
+static bool TA_arena_spill_reserve(void)
+{
+	void **old = spill_index;
+	const size_t old_size = spill_index_size;
+	size_t i = 0;
+
+	if ((spill_count + 1) * 2 <= old_size)
+		return true;
+	spill_index_size = old_size ? old_size * 2 : ARENA_SPILL_INDEX_MIN;
+	spill_index = TEE_Malloc(spill_index_size * sizeof(*spill_index),
+				 TEE_MALLOC_FILL_ZERO);
+	if (!spill_index) {
+		spill_index = old;
+		spill_index_size = old_size;
+		return false;
+	}
+	spill_count = 0;
+	for (i = 0; i < old_size; i++) {
+		if (old[i])
+			TA_arena_spill_insert(old[i]);
+	}
+	TEE_Free(old);
+	return true;
+}
+
+static void TA_arena_spill_release(void *ptr)
+{
+	arena_spill_t *spill = (arena_spill_t *)ptr - 1;
+
+	TEE_MemFill(spill, 0, sizeof(*spill) + spill->size);
+	TEE_Free(spill);
+}
+
+void TA_arena_begin(void)
+{
+	arena_used = 0;
+	arena_active = true;
+}
+
+void TA_arena_end(void)
+{
+	size_t i = 0;
+
+	/* block is handed out zero filled, so only the used part is dirty */
+	TEE_MemFill(arena_block, 0, arena_used);
+	for (i = 0; i < spill_index_size; i++) {
+		if (spill_index[i])
+			TA_arena_spill_release(spill_index[i]);
+	}
+	TEE_Free(spill_index);
+	spill_index = NULL;
+	spill_index_size = 0;
+	spill_count = 0;
+	arena_used = 0;
+	arena_active = false;
+}
+
+void *TA_arena_alloc(const size_t size)
+{
+	size_t aligned = 0;
+	size_t total = 0;
+	arena_spill_t *spill = NULL;
+	void *ptr = NULL;
+
+	if (!arena_active)
+		return TEE_Malloc(size, TEE_MALLOC_FILL_ZERO);
+	if (ADD_OVERFLOW(size, ARENA_ALIGN - 1, &aligned))
+		return NULL;
+	aligned &= ~(ARENA_ALIGN - 1);
+	if (aligned <= sizeof(arena_block) - arena_used) {
+		ptr = (uint8_t *)arena_block + arena_used;
+		arena_used += aligned;
+		return ptr;
+	}
+
+	if (ADD_OVERFLOW(sizeof(*spill), size, &total) ||
+	    !TA_arena_spill_reserve())
+		return NULL;
+	spill = TEE_Malloc(total, TEE_MALLOC_FILL_ZERO);
+	if (!spill)
+		return NULL;
+	spill->size = size;
+	TA_arena_spill_insert(spill + 1);
+	return spill + 1;
+}
+
+void TA_arena_free(void *ptr)
+{
+	const uint8_t *p = ptr;
+	size_t pos = 0;
+
+	if (!ptr)
+		return;
+	if (p >= (const uint8_t *)arena_block &&
+	    p < (const uint8_t *)arena_block + sizeof(arena_block))
+		return;
+	pos = TA_arena_spill_find(ptr);
+	if (pos != spill_index_size) {
+		TA_arena_spill_remove(pos);
+		TA_arena_spill_release(ptr);
+		return;
+	}
+	TEE_Free(ptr);
+}
@@ -22,6 +22,12 @@
  */
 static uint8_t auth_token_key_id[] = { 0xB1, 0x60, 0x71, 0x75 };
 
+/*
+ * HMAC-SHA256 operation keyed with the auth_token key, loaded once so token
+ * validation doesn't go to secure storage. Reset by TEE_MACInit per token.
+ */
+static TEE_OperationHandle auth_token_mac_op = TEE_HANDLE_NULL;
+
 /*
  * This function creates auth_token key persistent object if it doesn't exist.
  * This function should be called once in TA_CreateEntryPoint function.
@@ -176,20 +182,52 @@ exit:
 	return res;
 }
 
+/*
+ * Compares @length bytes of @a and @b in time independent of their content.
+ *
+ * @return true if they are equal
+ */
+static bool TA_ConstTimeEqual(const void *a, const void *b, size_t length)
+{
+	const volatile uint8_t *pa = a;
+	const volatile uint8_t *pb = b;
+	uint8_t diff = 0;
+
+	for (size_t i = 0; i < length; i++)
+		diff |= pa[i] ^ pb[i];
+	return diff == 0;
+}
+
 /*
  * This function checks that @in_params and @key_params meet all necessary
- * requirements. After that, it checks hw_auth_token signature.
+ * requirements. After that, it checks hw_auth_token signature unless the
+ * token is the one @record already accepted.
  */
 keymaster_error_t TA_do_auth(const keymaster_key_param_set_t in_params,
-				const keymaster_key_param_set_t key_params)
+				const keymaster_key_param_set_t key_params,
+				keymaster_auth_record_t *record)
 {
 	uint64_t suid[MAX_SUID];
 	uint32_t suid_count = 0;
-	bool found_token = false;
+	const keymaster_blob_t *token = NULL;
 	hw_authenticator_type_t auth_type = UNDEFINED;
 	hw_auth_token_t auth_token;
 	keymaster_error_t res = KM_ERROR_OK;
 
+	/* the last token of the right size is the one checked */
+	for (size_t i = 0; i < in_params.length; i++) {
+		if (in_params.params[i].tag == KM_TAG_AUTH_TOKEN &&
+		    in_params.params[i].key_param.blob.data_length ==
+				sizeof(auth_token))
+			token = &in_params.params[i].key_param.blob;
+	}
+
+	/* the key of an operation doesn't change, neither does the verdict */
+	if (record->valid && token &&
+	    TA_ConstTimeEqual(&record->token, token->data,
+			      sizeof(record->token)))
+		return KM_ERROR_OK;
+
 	for (size_t i = 0; i < key_params.length; i++) {
 		switch (key_params.params[i].tag) {
 		case KM_TAG_NO_AUTH_REQUIRED:
@@ -219,66 +257,49 @@ keymaster_error_t TA_do_auth(const keymaster_key_param_set_t in_params,
 		}
 	}
 
-	for (size_t i = 0; i < in_params.length; i++) {
-		if (in_params.params[i].tag == KM_TAG_AUTH_TOKEN) {
-			if (in_params.params[i].key_param.blob.data_length ==
-					sizeof(auth_token)) {
-				found_token = true;
-				TEE_MemMove(&auth_token,
-					in_params.params[i].key_param.blob.data,
-					sizeof(auth_token));
-			}
-		}
-	}
+	if (token)
+		TEE_MemMove(&auth_token, token->data, sizeof(auth_token));
 
-	if (!suid_count || !found_token) {
+	if (!suid_count || !token) {
 		EMSG("Authentication failed. Key can not be used");
 		res = KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
 		goto exit;
 	}
 
 	res = TA_check_auth_token(suid, suid_count, auth_type, &auth_token);
+	if (res == KM_ERROR_OK) {
+		TEE_MemMove(&record->token, &auth_token, sizeof(auth_token));
+		record->valid = true;
+	}
 
 exit:
+	TEE_MemFill(&auth_token, 0, sizeof(auth_token));
 	return res;
 }
 
 /*
- * Compute HMAC for @message buffer that has @length byte size. Operation key
- * is @key. The output will be stored in @signature and will be truncated if it
- * will be greater than @signature_length.
+ * Compute HMAC for @message buffer that has @length byte size with the keyed
+ * MAC operation @op, which is reset first. The output will be stored in
+ * @signature and will be truncated if it will be greater than
+ * @signature_length.
  * All parameters have to be valid.
  *
  * @return TEE_SUCCESS on success
  */
 static TEE_Result TA_ComputeSignature(uint8_t *signature, size_t signature_length,
-	TEE_ObjectHandle key, const uint8_t *message, size_t length)
+	TEE_OperationHandle op, const uint8_t *message, size_t length)
 {
 	uint32_t		buf_length = HMAC_SHA256_KEY_SIZE_BYTE;
 	uint8_t			buf[buf_length];
-	TEE_OperationHandle	op = TEE_HANDLE_NULL;
 	TEE_Result		res;
 	uint32_t		to_write;
 
-	res = TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
-			HMAC_SHA256_KEY_SIZE_BIT);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to allocate HMAC operation, res=%x", res);
-		goto exit;
-	}
-
-	res = TEE_SetOperationKey(op, key);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to set secret key, res=%x", res);
-		goto free_op;
-	}
-
 	TEE_MACInit(op, NULL, 0);
 
 	res = TEE_MACComputeFinal(op, (void *)message, length, buf, &buf_length);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to compute HMAC, res=%x", res);
-		goto free_op;
+		goto exit;
 	}
 
 	to_write = buf_length;
@@ -288,9 +309,8 @@ static TEE_Result TA_ComputeSignature(uint8_t *signature, size_t signature_lengt
 	memset(signature, 0, signature_length);
 	memcpy(signature, buf, to_write);
 
-free_op:
-	TEE_FreeOperation(op);
 exit:
+	TEE_MemFill(buf, 0, sizeof(buf));
 	return res;
 }
 
@@ -325,26 +345,22 @@ static TEE_Result TA_GetAuthKeyObj(TEE_ObjectHandle auth_token_key_obj)
 	}
 
 exit:
+	TEE_MemFill(auth_token_key, 0, sizeof(auth_token_key));
 	return res;
 }
 
 /*
- * Check that authintication token @token has valid HMAC value.
+ * This function reads auth_token key once and keeps it in a ready HMAC
+ * operation. It should be called in TA_CreateEntryPoint function after
+ * TA_InitializeAuthTokenKey.
  *
  * @return TEE_SUCCESS on success
  */
-static TEE_Result TA_ValidateTokenSignature(const hw_auth_token_t *token)
+TEE_Result TA_LoadAuthTokenKey(void)
 {
 	TEE_Result res = TEE_SUCCESS;
-
-	// Signature covers entire token except HMAC field.
-	const uint8_t *token_data = (const uint8_t *)token;
-	const uint32_t token_data_length = (const uint8_t *)token->hmac - token_data;
-
-	const uint32_t computed_hmac_length = sizeof(token->hmac);
-	uint8_t computed_hmac[computed_hmac_length];
-
 	TEE_ObjectHandle auth_token_key_obj = TEE_HANDLE_NULL;
+	TEE_OperationHandle op = TEE_HANDLE_NULL;
 
 	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
 			HMAC_SHA256_KEY_SIZE_BIT, &auth_token_key_obj);
@@ -359,21 +375,81 @@ static TEE_Result TA_ValidateTokenSignature(const hw_auth_token_t *token)
 		goto close_obj;
 	}
 
-	res = TA_ComputeSignature(computed_hmac, computed_hmac_length, auth_token_key_obj,
-			token_data, token_data_length);
+	res = TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
+			HMAC_SHA256_KEY_SIZE_BIT);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to compute auth_token signature, res=%x", res);
+		EMSG("Failed to allocate HMAC operation, res=%x", res);
 		goto close_obj;
 	}
 
-	if (memcmp(token->hmac, computed_hmac, computed_hmac_length) != 0) {
-		res = TEE_ERROR_MAC_INVALID;
-		EMSG("auth_token has invallid HMAC");
+	/* the operation keeps its own copy of the key */
+	res = TEE_SetOperationKey(op, auth_token_key_obj);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to set secret key, res=%x", res);
+		TEE_FreeOperation(op);
 		goto close_obj;
 	}
 
+	TA_FreeAuthTokenKey();
+	auth_token_mac_op = op;
+
 close_obj:
-	TEE_CloseObject(auth_token_key_obj);
+	TEE_FreeTransientObject(auth_token_key_obj);
+exit:
+	return res;
+}
+
+/*
+ * This function wipes the loaded auth_token key. It should be called in
+ * TA_DestroyEntryPoint function.
+ */
+void TA_FreeAuthTokenKey(void)
+{
+	if (auth_token_mac_op == TEE_HANDLE_NULL)
+		return;
+	TEE_FreeOperation(auth_token_mac_op);
+	auth_token_mac_op = TEE_HANDLE_NULL;
+}
+
+/*
+ * Check that authintication token @token has valid HMAC value.
+ *
+ * @return TEE_SUCCESS on success
+ */
+static TEE_Result TA_ValidateTokenSignature(const hw_auth_token_t *token)
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	// Signature covers entire token except HMAC field.
+	const uint8_t *token_data = (const uint8_t *)token;
+	const uint32_t token_data_length = (const uint8_t *)token->hmac - token_data;
+
+	const uint32_t computed_hmac_length = sizeof(token->hmac);
+	uint8_t computed_hmac[computed_hmac_length];
+
+	/* only reached if loading at TA creation failed */
+	if (auth_token_mac_op == TEE_HANDLE_NULL) {
+		res = TA_LoadAuthTokenKey();
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to load auth_token key, res=%x", res);
+			goto exit;
+		}
+	}
+
+	res = TA_ComputeSignature(computed_hmac, computed_hmac_length,
+			auth_token_mac_op, token_data, token_data_length);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to compute auth_token signature, res=%x", res);
+		goto exit;
+	}
+
+	if (!TA_ConstTimeEqual(token->hmac, computed_hmac,
+			computed_hmac_length)) {
+		res = TEE_ERROR_MAC_INVALID;
+		EMSG("auth_token has invallid HMAC");
+		goto exit;
+	}
+
 exit:
 	return res;
 }
@@ -57,7 +57,8 @@ uint32_t *TA_get_attrs_list(const keymaster_algorithm_t algorithm)
 	return TA_get_attrs_list_short(algorithm, false);
 }
 
-uint32_t TA_get_key_size(const keymaster_algorithm_t algorithm)
+/* Size of the key section of version 1 key material, characteristics follow */
+static uint32_t TA_get_key_size_v1(const keymaster_algorithm_t algorithm)
 {
 	switch (algorithm) {
 	case KM_ALGORITHM_AES:
@@ -86,15 +87,170 @@ uint32_t TA_get_key_size(const keymaster_algorithm_t algorithm)
 	}
 }
 
+static uint32_t TA_blob_header_size(const uint32_t attrs_count)
+{
+	return sizeof(key_blob_header_t) +
+		attrs_count * sizeof(key_blob_attr_t);
+}
+
+/* Largest key section of version 2 key material, characteristics follow */
+uint32_t TA_get_key_size(const keymaster_algorithm_t algorithm)
+{
+	switch (algorithm) {
+	case KM_ALGORITHM_AES:
+		return TA_blob_header_size(KM_ATTR_COUNT_AES_HMAC) +
+			KM_ATTR_COUNT_AES_HMAC * KM_AES_ATTR_SIZE;
+	case KM_ALGORITHM_HMAC:
+		return TA_blob_header_size(KM_ATTR_COUNT_AES_HMAC) +
+			KM_ATTR_COUNT_AES_HMAC * KM_HMAC_ATTR_SIZE;
+	case KM_ALGORITHM_RSA:
+		return TA_blob_header_size(KM_ATTR_COUNT_RSA) +
+			KM_ATTR_COUNT_RSA * KM_RSA_ATTR_SIZE;
+	case KM_ALGORITHM_EC:
+		return TA_blob_header_size(KM_ATTR_COUNT_EC) +
+			KM_ATTR_COUNT_EC * KM_EC_ATTR_SIZE;
+	default:
+		return 0;
+	}
+}
+
+static keymaster_algorithm_t TA_type_to_algorithm(const uint32_t type)
+{
+	switch (type) {
+	case TEE_TYPE_AES:
+		return KM_ALGORITHM_AES;
+	case TEE_TYPE_RSA_KEYPAIR:
+		return KM_ALGORITHM_RSA;
+	case TEE_TYPE_ECDSA_KEYPAIR:
+		return KM_ALGORITHM_EC;
+	default: /* HMAC */
+		return KM_ALGORITHM_HMAC;
+	}
+}
+
+/*
+ * Starts version 2 key material. Until the characteristics are written
+ * params_offset is where the next attribute buffer goes.
+ */
+static void TA_blob_init(uint8_t *key_material, const uint32_t type,
+			 const uint32_t key_size, const uint32_t attrs_count)
+{
+	key_blob_header_t *hdr = (key_blob_header_t *)key_material;
+
+	hdr->magic = KM_BLOB_MAGIC;
+	hdr->version = KM_BLOB_VERSION;
+	hdr->type = type;
+	hdr->key_size = key_size;
+	hdr->attrs_count = attrs_count;
+	hdr->params_offset = TA_blob_header_size(attrs_count);
+	hdr->params_length = 0;
+}
+
+/* Stores attribute i, a buffer is copied only if it isn't in place yet */
+static keymaster_error_t TA_blob_add_attr(uint8_t *key_material,
+					  const uint32_t size,
+					  const uint32_t i,
+					  const TEE_Attribute *attr)
+{
+	key_blob_header_t *hdr = (key_blob_header_t *)key_material;
+	key_blob_attr_t *entry = hdr->attrs + i;
+
+	entry->id = attr->attributeID;
+	if (is_attr_value(attr->attributeID)) {
+		entry->a = attr->content.value.a;
+		entry->b = attr->content.value.b;
+		return KM_ERROR_OK;
+	}
+	if (attr->content.ref.length > size - hdr->params_offset) {
+		EMSG("Attribute %x doesn't fit into key blob",
+		     attr->attributeID);
+		return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+	}
+	entry->a = hdr->params_offset;
+	entry->b = attr->content.ref.length;
+	if (attr->content.ref.buffer != key_material + entry->a)
+		TEE_MemMove(key_material + entry->a,
+			    attr->content.ref.buffer, entry->b);
+	hdr->params_offset += entry->b;
+	return KM_ERROR_OK;
+}
+
+keymaster_error_t TA_serialize_key_params(uint8_t *key_material,
+				const uint32_t size,
+				const keymaster_key_param_set_t *params,
+				size_t *blob_size)
+{
+	key_blob_header_t *hdr = (key_blob_header_t *)key_material;
+	bool oob = false;
+
+	hdr->params_length = TA_serialize_param_set(
+				key_material + hdr->params_offset,
+				key_material + size - TAG_LENGTH, params, &oob);
+	if (oob) {
+		EMSG("Out of key blob space for characteristics");
+		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+	*blob_size = hdr->params_offset + hdr->params_length + TAG_LENGTH;
+	return KM_ERROR_OK;
+}
+
+bool TA_is_key_material_v2(const uint8_t *key_material, const uint32_t size)
+{
+	const key_blob_header_t *hdr = (const key_blob_header_t *)key_material;
+
+	/* version 1 starts with the object type, never equal to the magic */
+	return size >= sizeof(key_blob_header_t) &&
+		hdr->magic == KM_BLOB_MAGIC && hdr->version == KM_BLOB_VERSION;
+}
+
+/*
+ * Fills att from version 2 key material of size bytes. att->attrs must have
+ * room for KM_MAX_ATTR_COUNT entries, buffers point into key_material.
+ */
+static keymaster_error_t TA_key_attrs_v2(uint8_t *key_material,
+					 const uint32_t size,
+					 tee_key_attributes *att)
+{
+	const key_blob_header_t *hdr = (const key_blob_header_t *)key_material;
+	const key_blob_attr_t *entry = NULL;
+
+	if (hdr->attrs_count > KM_MAX_ATTR_COUNT ||
+	    TA_blob_header_size(hdr->attrs_count) > size ||
+	    hdr->params_offset > size ||
+	    hdr->params_length > size - hdr->params_offset) {
+		EMSG("Malformed key blob header");
+		return KM_ERROR_INVALID_KEY_BLOB;
+	}
+	att->type = hdr->type;
+	att->size = hdr->key_size;
+	att->alg = TA_type_to_algorithm(hdr->type);
+	att->attrs_count = hdr->attrs_count;
+	for (uint32_t i = 0; i < hdr->attrs_count; i++) {
+		entry = hdr->attrs + i;
+		if (is_attr_value(entry->id)) {
+			TEE_InitValueAttribute(att->attrs + i, entry->id,
+					       entry->a, entry->b);
+			continue;
+		}
+		if (entry->a > size || entry->b > size - entry->a) {
+			EMSG("Key blob attribute %x out of bounds", entry->id);
+			return KM_ERROR_INVALID_KEY_BLOB;
+		}
+		TEE_InitRefAttribute(att->attrs + i, entry->id,
+				     key_material + entry->a, entry->b);
+	}
+	return KM_ERROR_OK;
+}
+
 void free_attrs(TEE_Attribute *attrs, uint32_t size)
 {
 	if (!attrs)
 		return;
 	for (uint32_t i = 0; i < size; i++) {
 		if ((!is_attr_value(attrs[i].attributeID)) && (attrs[i].content.ref.buffer != NULL))
-			(void)TEE_Free(attrs[i].content.ref.buffer);
+			TA_arena_free(attrs[i].content.ref.buffer);
 	}
-	(void)TEE_Free(attrs);
+	TA_arena_free(attrs);
 }
 
 uint32_t purpose_to_mode(const keymaster_purpose_t purpose)
@@ -211,8 +367,8 @@ keymaster_error_t TA_import_key(const keymaster_algorithm_t algorithm,
 				const uint32_t attrs_in_count)
 {
 	uint32_t type;
-	uint32_t padding = 0;
-
+	uint32_t key_buffer_size = TA_get_key_size(algorithm);
+	keymaster_error_t res = KM_ERROR_OK;
 
 	switch (algorithm) {
 	case KM_ALGORITHM_AES:
@@ -251,35 +407,16 @@ keymaster_error_t TA_import_key(const keymaster_algorithm_t algorithm,
 	default:
 		return KM_ERROR_UNSUPPORTED_ALGORITHM;
 	}
-	TEE_MemMove(key_material, &type, sizeof(type));
-	padding += sizeof(type);
-	TEE_MemMove(key_material + padding, &key_size, sizeof(key_size));
-	padding += sizeof(key_size);
+	if (attrs_in_count > KM_MAX_ATTR_COUNT) {
+		EMSG("Too many key attributes %u", attrs_in_count);
+		return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+	}
+	TA_blob_init(key_material, type, key_size, attrs_in_count);
 	for (uint32_t i = 0; i < attrs_in_count; i++) {
-		TEE_MemMove(key_material + padding, &attrs_in[i].attributeID,
-					sizeof(attrs_in[i].attributeID));
-		padding += sizeof(attrs_in[i].attributeID);
-		if (is_attr_value(attrs_in[i].attributeID)) {
-			/* value */
-			TEE_MemMove(key_material + padding,
-					&attrs_in[i].content.value.a,
-					sizeof(attrs_in[i].content.value.a));
-			padding += sizeof(attrs_in[i].content.value.a);
-			TEE_MemMove(key_material + padding,
-					&attrs_in[i].content.value.b,
-					sizeof(attrs_in[i].content.value.b));
-			padding += sizeof(attrs_in[i].content.value.b);
-		} else {
-			/* buffer */
-			TEE_MemMove(key_material + padding,
-					&attrs_in[i].content.ref.length,
-					sizeof(attrs_in[i].content.ref.length));
-			padding += sizeof(attrs_in[i].content.ref.length);
-			TEE_MemMove(key_material + padding,
-					attrs_in[i].content.ref.buffer,
-					attrs_in[i].content.ref.length);
-			padding += attrs_in[i].content.ref.length;
-		}
+		res = TA_blob_add_attr(key_material, key_buffer_size, i,
+				       attrs_in + i);
+		if (res != KM_ERROR_OK)
+			return res;
 	}
 	return KM_ERROR_OK;
 }
@@ -310,7 +447,6 @@ keymaster_error_t TA_generate_key(const keymaster_algorithm_t algorithm,
 {
 	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
 	TEE_Result res = TEE_SUCCESS;
-	uint32_t padding = 0;
 	uint32_t *attributes = NULL;
 	uint32_t attr_count = 0;
 	uint32_t attr_size = 0;
@@ -318,7 +454,10 @@ keymaster_error_t TA_generate_key(const keymaster_algorithm_t algorithm,
 	uint32_t a = 0;
 	uint32_t b = 0;
 	uint32_t curve = UNDEFINED;
-	uint8_t buffer[KM_MAX_ATTR_SIZE] = { 0 };
+	uint8_t *buffer = NULL;
+	uint32_t key_buffer_size = TA_get_key_size(algorithm);
+	key_blob_header_t *hdr = NULL;
+	TEE_Attribute attr;
 	uint8_t *buf_pe = NULL;
 	uint64_t be_pe = 0;
 	TEE_Attribute *attrs_in = NULL;
@@ -423,18 +562,9 @@ keymaster_error_t TA_generate_key(const keymaster_algorithm_t algorithm,
 		goto gk_out;
 	}
 
-	TEE_MemMove(key_material, &type, sizeof(type));
-	padding += sizeof(type);
-	DMSG("padding = %u", padding);
-	TEE_MemMove(key_material + padding, &key_size, sizeof(key_size));
-	padding += sizeof(key_size);
-	DMSG("padding = %u", padding);
+	TA_blob_init(key_material, type, key_size, attr_count);
+	hdr = (key_blob_header_t *)key_material;
 	for (uint32_t i = 0; i < attr_count; i++) {
-		attr_size = KM_MAX_ATTR_SIZE;
-		TEE_MemMove(key_material + padding, attributes + i,
-						sizeof(attributes[i]));
-		padding += sizeof(attributes[i]);
-		DMSG("i = %u padding = %u", i, padding);
 		if (is_attr_value(attributes[i])) {
 			/* value */
 			res = TEE_GetObjectValueAttribute(obj_h,
@@ -443,14 +573,11 @@ keymaster_error_t TA_generate_key(const keymaster_algorithm_t algorithm,
 				EMSG("Failed to get value attribute, res = %x", res);
 				break;
 			}
-			TEE_MemMove(key_material + padding, &a, sizeof(a));
-			padding += sizeof(a);
-			DMSG("i = %u padding = %u a = %u", i, padding, a);
-			TEE_MemMove(key_material + padding, &b, sizeof(b));
-			padding += sizeof(b);
-			DMSG("i = %u padding = %u b = %u", i, padding, b);
+			TEE_InitValueAttribute(&attr, attributes[i], a, b);
 		} else {
-			/* buffer */
+			/* buffer, read straight into its place in the blob */
+			attr_size = key_buffer_size - hdr->params_offset;
+			buffer = key_material + hdr->params_offset;
 			res = TEE_GetObjectBufferAttribute(obj_h,
 					attributes[i], buffer, &attr_size);
 			if (res != TEE_SUCCESS) {
@@ -458,14 +585,14 @@ keymaster_error_t TA_generate_key(const keymaster_algorithm_t algorithm,
 								attributes[i], res);
 				break;
 			}
-			TEE_MemMove(key_material + padding,
-					&attr_size, sizeof(attr_size));
-			padding += sizeof(attr_size);
-			DMSG("i = %u padding = %u attr_size = %u", i, padding, attr_size);
-			TEE_MemMove(key_material + padding, buffer, attr_size);
-			padding += attr_size;
-			DMSG("i = %u padding = %u attr_size = %u", i, padding, attr_size);
+			TEE_InitRefAttribute(&attr, attributes[i], buffer,
+					     attr_size);
 		}
+		DMSG("i = %u attr = %x", i, attributes[i]);
+		res = TA_blob_add_attr(key_material, key_buffer_size, i,
+				       &attr);
+		if (res != KM_ERROR_OK)
+			break;
 	}
 gk_out:
 	if (obj_h != TEE_HANDLE_NULL)
@@ -576,8 +703,7 @@ keymaster_error_t TA_populate_key_attrs(uint8_t *key_material,
 		DMSG("HMAC attrs_count = %u algorithm = %d",
 		     att->attrs_count, att->alg);
 	}
-	att->attrs = TEE_Malloc(att->attrs_count * sizeof(TEE_Attribute),
-				TEE_MALLOC_FILL_ZERO);
+	att->attrs = TA_arena_alloc(att->attrs_count * sizeof(TEE_Attribute));
 	if (!att->attrs) {
 		EMSG("Failed to allocate memory for attributes array");
 		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -610,8 +736,8 @@ keymaster_error_t TA_populate_key_attrs(uint8_t *key_material,
 			padding += sizeof(attr_size);
 			DMSG("i = %u padding = %u attr_size = %u",
 			     i, padding, attr_size);
-			/* will be freed when parameters array is destroyed */
-			buf = TEE_Malloc(attr_size, TEE_MALLOC_FILL_ZERO);
+			/* released with the command arena */
+			buf = TA_arena_alloc(attr_size);
 			if (!buf) {
 				res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
 				EMSG("Failed to allocate memory for attribute");
@@ -719,8 +845,13 @@ keymaster_error_t TA_restore_key(uint8_t *key_material,
 				keymaster_key_param_set_t *params_t)
 {
 	tee_key_attributes attrs;
+	TEE_Attribute attrs_v2[KM_MAX_ATTR_COUNT];
 	keymaster_error_t res = KM_ERROR_OK;
-	uint32_t padding;
+	const key_blob_header_t *hdr = NULL;
+	uint8_t *params = NULL;
+	uint8_t *params_end = NULL;
+	uint32_t size = 0;
+	bool v2 = false;
 
 	if (!key_material) {
 		EMSG("Failed to allocate memory for key_material");
@@ -729,9 +860,13 @@ keymaster_error_t TA_restore_key(uint8_t *key_material,
 
 	*obj_h = TEE_HANDLE_NULL;
 
-	TEE_MemMove(key_material, key_blob->key_material,
-		    key_blob->key_material_size);
-	res = TA_decrypt(key_material, key_blob->key_material_size);
+	if (key_blob->key_material_size < TAG_LENGTH) {
+		EMSG("Key blob is shorter than its tag");
+		return KM_ERROR_INVALID_KEY_BLOB;
+	}
+	size = key_blob->key_material_size - TAG_LENGTH;
+	res = TA_decrypt_to(key_material, key_blob->key_material,
+			    key_blob->key_material_size);
 	if (res != TEE_SUCCESS) {
 		if (res == (keymaster_error_t)TEE_ERROR_MAC_INVALID) {
 			res = KM_ERROR_INVALID_KEY_BLOB;
@@ -748,10 +883,24 @@ keymaster_error_t TA_restore_key(uint8_t *key_material,
 		return res;
 	}
 
-	res = TA_populate_key_attrs(key_material, &attrs);
-	if (res != KM_ERROR_OK)	{
-	    EMSG("Failed to get key attributes from rey data");
-	    return KM_ERROR_INVALID_KEY_BLOB;
+	v2 = TA_is_key_material_v2(key_material, size);
+	if (v2) {
+		/* attributes refer to key_material, nothing to free */
+		attrs.attrs = attrs_v2;
+		res = TA_key_attrs_v2(key_material, size, &attrs);
+		if (res != KM_ERROR_OK)
+			return res;
+		hdr = (const key_blob_header_t *)key_material;
+		params = key_material + hdr->params_offset;
+		params_end = params + hdr->params_length;
+	} else {
+		res = TA_populate_key_attrs(key_material, &attrs);
+		if (res != KM_ERROR_OK)	{
+		    EMSG("Failed to get key attributes from rey data");
+		    return KM_ERROR_INVALID_KEY_BLOB;
+		}
+		/* offset from array begin where parameters are stored */
+		params = key_material + TA_get_key_size_v1(attrs.alg);
 	}
 
 	if (attrs.alg == KM_ALGORITHM_HMAC) {
@@ -769,10 +918,7 @@ keymaster_error_t TA_restore_key(uint8_t *key_material,
 
 	}
 
-	/* offset from array begin where parameters are stored */
-	padding = TA_get_key_size(attrs.alg);
-	TA_deserialize_param_set(key_material + padding, NULL,
-						params_t, false, &res);
+	TA_deserialize_param_set(params, params_end, params_t, false, &res);
 	if (res != KM_ERROR_OK)
 		goto out_rk;
 
@@ -788,8 +934,70 @@ out_rk:
 
 
 	EMSG("populate attrs is finished with err %d", res);
-	free_attrs(attrs.attrs, attrs.attrs_count);
+	if (!v2)
+		free_attrs(attrs.attrs, attrs.attrs_count);
+
+	return res;
+}
+
+keymaster_error_t TA_upgrade_key_material(uint8_t *key_material,
+					  const uint32_t size,
+					  keymaster_key_blob_t *blob)
+{
+	tee_key_attributes attrs;
+	keymaster_key_param_set_t params_t = {.params = NULL, .length = 0};
+	keymaster_error_t res = KM_ERROR_OK;
+	key_blob_header_t *hdr = NULL;
+	uint8_t *params = NULL;
+	uint8_t *v2 = NULL;
+	uint32_t params_length = 0;
+	uint32_t key_buffer_size = 0;
+	uint32_t v2_size = 0;
+
+	res = TA_populate_key_attrs(key_material, &attrs);
+	if (res != KM_ERROR_OK) {
+		EMSG("Failed to get key attributes from key data");
+		return KM_ERROR_INVALID_KEY_BLOB;
+	}
+	/* characteristics are copied as they are, parsing only sizes them */
+	key_buffer_size = TA_get_key_size(attrs.alg);
+	params = key_material + TA_get_key_size_v1(attrs.alg);
+	params_length = TA_deserialize_param_set(params, key_material + size,
+						 &params_t, false, &res);
+	TA_free_params(&params_t);
+	if (res != KM_ERROR_OK)
+		goto out;
 
+	v2_size = key_buffer_size + params_length + TAG_LENGTH;
+	v2 = TEE_Malloc(v2_size, TEE_MALLOC_FILL_ZERO);
+	if (!v2) {
+		EMSG("Failed to allocate memory for key blob");
+		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+		goto out;
+	}
+	TA_blob_init(v2, attrs.type, attrs.size, attrs.attrs_count);
+	for (uint32_t i = 0; i < attrs.attrs_count; i++) {
+		res = TA_blob_add_attr(v2, key_buffer_size, i, attrs.attrs + i);
+		if (res != KM_ERROR_OK)
+			goto out;
+	}
+	hdr = (key_blob_header_t *)v2;
+	TEE_MemMove(v2 + hdr->params_offset, params, params_length);
+	hdr->params_length = params_length;
+	v2_size = hdr->params_offset + params_length + TAG_LENGTH;
+
+	res = TA_encrypt(v2, v2_size);
+	if (res != KM_ERROR_OK) {
+		EMSG("Failed to encrypt key blob, res=%x", res);
+		goto out;
+	}
+	blob->key_material = v2;
+	blob->key_material_size = v2_size;
+	v2 = NULL;
+out:
+	if (v2)
+		TEE_Free(v2);
+	free_attrs(attrs.attrs, attrs.attrs_count);
 	return res;
 }
 
@@ -0,0 +1,50 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_OPTEE_ARENA_H
+#define ANDROID_OPTEE_ARENA_H
+
+/*
+ * Size of the block backing per-command allocations, can be overridden at
+ * build time. Requests which don't fit spill to the heap.
+ */
+#ifndef CFG_KM_ARENA_SIZE
+#define CFG_KM_ARENA_SIZE (16 * 1024)
+#endif
+
+#include <tee_internal_api.h>
+#include <tee_internal_api_extensions.h>
+
+/* Starts a command, everything allocated from now on is released together */
+void TA_arena_begin(void);
+
+/* Wipes and releases all allocations of the current command */
+void TA_arena_end(void);
+
+/*
+ * Returns zero filled memory which lives until TA_arena_end. Outside of a
+ * command it falls back to TEE_Malloc.
+ */
+void *TA_arena_alloc(const size_t size);
+
+/*
+ * Frees heap memory, including blocks the arena spilled to the heap. The
+ * arena block is released on TA_arena_end.
+ */
+void TA_arena_free(void *ptr);
+
+#endif/* ANDROID_OPTEE_ARENA_H */
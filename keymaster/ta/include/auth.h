@@ -27,8 +27,18 @@
 #include "ta_ca_defs.h"
 #include "tables.h"
 
+/* Last auth token accepted for an operation */
+typedef struct {
+	hw_auth_token_t token;
+	bool valid;
+} keymaster_auth_record_t;
+
 TEE_Result TA_InitializeAuthTokenKey(void);
 
+TEE_Result TA_LoadAuthTokenKey(void);
+
+void TA_FreeAuthTokenKey(void);
+
 keymaster_error_t TA_GetAuthTokenKey(TEE_Param params[TEE_NUM_PARAMS]);
 
 keymaster_error_t TA_check_auth_token(const uint64_t *suid,
@@ -36,8 +46,13 @@ keymaster_error_t TA_check_auth_token(const uint64_t *suid,
 					const hw_authenticator_type_t auth_type,
 					const hw_auth_token_t *auth_token);
 
+/*
+ * A token byte-identical to the one in @record is accepted without being
+ * checked again, @record is updated when a new token passes.
+ */
 keymaster_error_t TA_do_auth(const keymaster_key_param_set_t in_params,
-				const keymaster_key_param_set_t key_params);
+				const keymaster_key_param_set_t key_params,
+				keymaster_auth_record_t *record);
 
 #define HMAC_SHA256_KEY_SIZE_BYTE 32
 #define HMAC_SHA256_KEY_SIZE_BIT (8*HMAC_SHA256_KEY_SIZE_BYTE)
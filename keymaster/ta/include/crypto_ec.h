@@ -34,7 +34,7 @@ keymaster_error_t TA_ec_update(keymaster_operation_t *operation,
 				size_t *input_consumed,
 				const uint32_t input_provided);
 
-keymaster_error_t TA_ec_finish(const keymaster_operation_t *operation,
+keymaster_error_t TA_ec_finish(keymaster_operation_t *operation,
 				keymaster_blob_t *input,
 				keymaster_blob_t *output,
 				keymaster_blob_t *signature,
@@ -48,6 +48,35 @@
 #include "parsel.h"
 #include "parameters.h"
 
+#define KM_MAX_ATTR_COUNT KM_ATTR_COUNT_RSA
+
+/*
+ * Key material version 2, encrypted with the master key and followed by the
+ * GCM tag: header, attribute table, attribute buffers, characteristics.
+ * Offsets are counted from the start of the header, so attributes and
+ * characteristics can be used in place once the blob is decrypted.
+ * Version 1 key material has no header and starts with the object type.
+ */
+#define KM_BLOB_MAGIC 0x324b424fU /* "OBK2" */
+#define KM_BLOB_VERSION 2
+
+typedef struct {
+	uint32_t id;
+	uint32_t a;/*value a, or offset of the attribute buffer*/
+	uint32_t b;/*value b, or length of the attribute buffer*/
+} key_blob_attr_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type;
+	uint32_t key_size;
+	uint32_t params_offset;/*serialized characteristics*/
+	uint32_t params_length;
+	uint32_t attrs_count;
+	key_blob_attr_t attrs[];
+} key_blob_header_t;
+
 typedef struct tee_key_attributes
 {
 	TEE_Attribute *attrs;
@@ -71,6 +100,16 @@ keymaster_error_t TA_generate_key(const keymaster_algorithm_t algorithm,
 				const keymaster_digest_t digest,
 				const uint64_t rsa_public_exponent);
 
+/*
+ * Appends characteristics to the key material written by TA_generate_key or
+ * TA_import_key into a buffer of size bytes. blob_size gets the size of the
+ * key blob to encrypt, including the tag.
+ */
+keymaster_error_t TA_serialize_key_params(uint8_t *key_material,
+				const uint32_t size,
+				const keymaster_key_param_set_t *params,
+				size_t *blob_size);
+
 keymaster_error_t TA_restore_key(uint8_t *key_material,
 				const keymaster_key_blob_t *key_blob,
 				uint32_t *key_size, uint32_t *type,
@@ -99,6 +138,16 @@ keymaster_error_t TA_check_hmac_key_size(keymaster_blob_t *key_data,
 keymaster_error_t TA_populate_key_attrs(uint8_t *key_material,
 					tee_key_attributes *att);
 
+bool TA_is_key_material_v2(const uint8_t *key_material, const uint32_t size);
+
+/*
+ * Converts decrypted version 1 key material of size bytes into a version 2
+ * blob. blob gets the encrypted result, to be freed by the caller.
+ */
+keymaster_error_t TA_upgrade_key_material(uint8_t *key_material,
+					  const uint32_t size,
+					  keymaster_key_blob_t *blob);
+
 keymaster_error_t TA_key_from_attrs(TEE_ObjectHandle *obj_h,
 				    const tee_key_attributes *attrs);
 
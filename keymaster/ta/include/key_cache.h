@@ -0,0 +1,73 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_OPTEE_KEY_CACHE_H
+#define ANDROID_OPTEE_KEY_CACHE_H
+
+/*
+ * Maximum number of restored keys kept between commands and the TA heap
+ * they may use, can be overridden at build time. The budget is checked
+ * against TA_DATA_SIZE in key_cache.c.
+ */
+#ifndef CFG_KM_KEY_CACHE_ENTRIES
+#define CFG_KM_KEY_CACHE_ENTRIES 16
+#endif
+#ifndef CFG_KM_KEY_CACHE_SIZE
+#define CFG_KM_KEY_CACHE_SIZE (32 * 1024)
+#endif
+
+#include <tee_internal_api.h>
+#include <tee_internal_api_extensions.h>
+#include <utee_defines.h>
+
+#include "ta_ca_defs.h"
+#include "master_crypto.h"
+
+typedef struct keymaster_cached_key {
+	uint8_t key_id[TAG_LENGTH];/*GCM tag of the key blob*/
+	keymaster_key_blob_t blob;/*encrypted blob, compared on lookup*/
+	TEE_ObjectHandle obj;
+	keymaster_key_param_set_t params;/*characteristics of obj*/
+	uint32_t key_size;
+	uint32_t type;
+	uint32_t refs;
+	uint32_t cost;/*heap charged against CFG_KM_KEY_CACHE_SIZE*/
+	uint32_t ops;/*active operations, charged cost once between them*/
+	bool cached;/*false once evicted, freed on last TA_put_key*/
+	struct keymaster_cached_key *lru_prev;
+	struct keymaster_cached_key *lru_next;
+} keymaster_cached_key_t;
+
+/*
+ * Returns a reference to the restored key_blob, decrypting it only if it is
+ * not cached yet. The key object and parameters are shared and must not be
+ * modified or freed, release the reference with TA_put_key.
+ */
+keymaster_error_t TA_get_key(const keymaster_key_blob_t *key_blob,
+			     keymaster_cached_key_t **key);
+
+/* Takes another reference to a key already held by the caller */
+void TA_hold_key(keymaster_cached_key_t *key);
+
+void TA_put_key(keymaster_cached_key_t *key);
+
+/* Drops key_blob from the cache, references already taken stay valid */
+void TA_invalidate_key(const keymaster_key_blob_t *key_blob);
+
+void TA_invalidate_all_keys(void);
+
+#endif/* ANDROID_OPTEE_KEY_CACHE_H */
@@ -24,6 +24,8 @@
 #include <string.h>
 
 #include "operations.h"
+#include "key_cache.h"
+#include "loaded_keys.h"
 #include "tables.h"
 #include "parsel.h"
 #include "master_crypto.h"
@@ -40,6 +42,26 @@
  */
 #define KM_RECV_BUF_SIZE 8192
 
+/*
+ * Largest data region of KM_UPDATE_LARGE and KM_FINISH_LARGE, can be
+ * overridden at build time. The regions are mapped, not copied, so this
+ * doesn't count against the TA heap.
+ */
+#ifndef CFG_KM_LARGE_BUFFER_SIZE
+#define CFG_KM_LARGE_BUFFER_SIZE (4 * 1024 * 1024)
+#endif
+
+/*
+ * Room an output region needs beyond the expected size, padding and tag.
+ * OPTEE_KEYMASTER_LARGE_OUT_SLACK in the HAL must not be smaller.
+ */
+#define KM_LARGE_OUT_SLACK (2 * BLOCK_SIZE)
+
+/* Version reported by KM_GET_CAPABILITIES */
+#define KM_TA_VERSION_MAJOR 3
+#define KM_TA_VERSION_MINOR 0
+#define KM_TA_VERSION_SUBMINOR 0
+
 /* Max size of attestation challenge */
 #define MAX_ATTESTATION_CHALLENGE 128
 
@@ -51,28 +73,6 @@
 #define EMPTY_CHARACTS {					\
 			.hw_enforced = EMPTY_PARAM_SET,		\
 			.sw_enforced = EMPTY_PARAM_SET}
-#define EMPTY_OPERATION {					\
-			.key = NULL,				\
-			.nonce = EMPTY_BLOB,			\
-			.op_handle = UNDEFINED,			\
-			.purpose = UNDEFINED,			\
-			.padding = UNDEFINED,			\
-			.mode = UNDEFINED,			\
-			.sf_item = NULL,			\
-			.last_access = NULL,			\
-			.operation = TEE_HANDLE_NULL,		\
-			.digest_op = TEE_HANDLE_NULL,		\
-			.prev_in_size = UNDEFINED,		\
-			.min_sec = UNDEFINED,			\
-			.mac_length = UNDEFINED,		\
-			.a_data_length = 0,			\
-			.a_data = NULL,				\
-			.do_auth = false,			\
-			.got_input = false,			\
-			.buffering = false,			\
-			.padded = false,			\
-			.first = true,				\
-			.last_block = EMPTY_BLOB}
 
 uint64_t identifier_rsa[] = {1, 2, 840, 113549, 1, 1, 1};
 /* RSAPrivateKey ::= SEQUENCE {
@@ -129,11 +129,15 @@ static keymaster_error_t TA_deleteAllKeys(TEE_Param params[TEE_NUM_PARAMS]);
 static keymaster_error_t TA_destroyAttestationIds(
 					TEE_Param params[TEE_NUM_PARAMS]);
 
-static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS]);
+static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS],
+				  keymaster_session_t *session,
+				  const bool loaded);
 
-static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS]);
+static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS],
+				   const bool large);
 
-static keymaster_error_t TA_finish(TEE_Param params[TEE_NUM_PARAMS]);
+static keymaster_error_t TA_finish(TEE_Param params[TEE_NUM_PARAMS],
+				   const bool large);
 
 static keymaster_error_t TA_abort(TEE_Param params[TEE_NUM_PARAMS]);
 
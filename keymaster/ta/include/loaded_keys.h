@@ -0,0 +1,73 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_OPTEE_LOADED_KEYS_H
+#define ANDROID_OPTEE_LOADED_KEYS_H
+
+/*
+ * Maximum number of keys one session may keep loaded, can be overridden at
+ * build time. Loaded keys hold a key cache reference, so they stay resident
+ * even once evicted from the cache. The quota is per session: a client with
+ * the HAL's pool of 4 sessions may pin up to 4 * 8 = 32 keys in the TA heap.
+ */
+#ifndef CFG_KM_MAX_LOADED_KEYS
+#define CFG_KM_MAX_LOADED_KEYS 8
+#endif
+
+#include <tee_internal_api.h>
+#include <tee_internal_api_extensions.h>
+
+#include "ta_ca_defs.h"
+#include "key_cache.h"
+
+typedef struct keymaster_loaded_key {
+	uint64_t handle;
+	keymaster_cached_key_t *key;/*taken on load, put on unload*/
+	struct keymaster_loaded_key *next;
+} keymaster_loaded_key_t;
+
+/* Per-session state, stored in the session context */
+typedef struct {
+	keymaster_loaded_key_t *loaded;
+	uint32_t loaded_count;
+} keymaster_session_t;
+
+keymaster_session_t *TA_create_session(void);
+
+/* Unloads all keys of session and frees it */
+void TA_destroy_session(keymaster_session_t *session);
+
+/*
+ * Restores key_blob, or reuses its cached copy, and keeps it resident until
+ * unloaded. The returned handle is only valid within session.
+ */
+keymaster_error_t TA_load_key(keymaster_session_t *session,
+			      const keymaster_key_blob_t *key_blob,
+			      uint64_t *handle);
+
+keymaster_error_t TA_unload_key(keymaster_session_t *session,
+				const uint64_t handle);
+
+/*
+ * Returns a new reference to a loaded key, release it with TA_put_key.
+ * Unknown handles give KM_ERROR_INVALID_KEY_BLOB.
+ */
+keymaster_error_t TA_get_loaded_key(keymaster_session_t *session,
+				    const uint64_t handle,
+				    keymaster_cached_key_t **key);
+
+#endif/* ANDROID_OPTEE_LOADED_KEYS_H */
@@ -33,9 +33,12 @@ TEE_Result TA_open_secret_key(TEE_ObjectHandle *secretKey);
 
 TEE_Result TA_create_secret_key(void);
 
-TEE_Result TA_execute(uint8_t *data, const size_t size, const uint32_t mode);
+TEE_Result TA_execute(const uint8_t *in, uint8_t *out, const size_t size,
+		      const uint32_t mode);
 TEE_Result TA_encrypt(uint8_t *data, const size_t size);
 TEE_Result TA_decrypt(uint8_t *data, const size_t size);
+/* Decrypts blob in into out (size bytes) leaving in untouched */
+TEE_Result TA_decrypt_to(uint8_t *out, const uint8_t *in, const size_t size);
 
 void TA_free_master_key(void);
 
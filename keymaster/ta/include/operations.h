@@ -18,7 +18,23 @@
 #ifndef ANDROID_OPTEE_OPERATIONS_H
 #define ANDROID_OPTEE_OPERATIONS_H
 
-#define KM_MAX_OPERATION 20U
+/*
+ * Maximum number of concurrent operations, can be overridden at build time
+ * with CFG_KM_MAX_OPERATION. Heap held by active operations is limited to
+ * half of TA_DATA_SIZE in operations.c, old operations are aborted to stay
+ * within it.
+ */
+#ifndef CFG_KM_MAX_OPERATION
+#define CFG_KM_MAX_OPERATION 64
+#endif
+#define KM_MAX_OPERATION CFG_KM_MAX_OPERATION
+
+/* Handle index size, power of two and at least twice KM_MAX_OPERATION */
+#define KM_OP_INDEX_SIZE (KM_MAX_OPERATION <= 16 ? 32U :	\
+			  KM_MAX_OPERATION <= 32 ? 64U :	\
+			  KM_MAX_OPERATION <= 64 ? 128U :	\
+			  KM_MAX_OPERATION <= 128 ? 256U :	\
+			  KM_MAX_OPERATION <= 256 ? 512U : 1024U)
 
 #include <tee_internal_api.h>
 #include <tee_internal_api_extensions.h>
@@ -27,23 +43,25 @@
 #include "ta_ca_defs.h"
 #include "tables.h"
 #include "master_crypto.h"
-
-typedef struct keymaster_blob_list_item_t {
-	keymaster_blob_t data;
-	struct keymaster_blob_list_item_t *next;
-} keymaster_blob_list_item_t;
+#include "key_cache.h"
+#include "auth.h"
 
 typedef struct {
 	uint8_t key_id[TAG_LENGTH];
-	keymaster_key_blob_t *key;
+	keymaster_cached_key_t *key;/*taken in begin, put on abort*/
 	keymaster_blob_t nonce;
 	keymaster_blob_t last_block;
 	keymaster_operation_handle_t op_handle;
 	keymaster_purpose_t purpose;
 	keymaster_padding_t padding;
 	keymaster_block_mode_t mode;
-	keymaster_blob_list_item_t *sf_item;/*sign/verify data*/
-	TEE_Time *last_access;
+	keymaster_blob_t sf_data;/*buffered sign/verify data*/
+	uint32_t sf_capacity;/*allocated size of sf_data*/
+	uint32_t sf_limit;/*sf_data can't grow beyond key size*/
+	TEE_Time last_access;
+	uint32_t lru_prev;/*slot accessed just before, UNDEFINED if oldest*/
+	uint32_t lru_next;/*slot accessed just after, UNDEFINED if newest*/
+	uint32_t footprint;/*heap charged against the operation budget, key aside*/
 	TEE_OperationHandle *operation;
 	TEE_OperationHandle *digest_op;
 	size_t prev_in_size;
@@ -52,6 +70,7 @@ typedef struct {
 	uint32_t digestLength;
 	uint32_t a_data_length;
 	uint8_t *a_data;
+	keymaster_auth_record_t auth;/*token accepted in update/finish*/
 	bool do_auth;
 	bool got_input;
 	bool buffering;
@@ -59,11 +78,33 @@ typedef struct {
 	bool first;
 } keymaster_operation_t;
 
-void TA_free_blob_list(keymaster_blob_list_item_t *item);
+/* Resets all fields of op to their unused state, nothing is freed */
+void TA_clear_operation(keymaster_operation_t *op);
+
+/* Frees everything op owns and clears it */
+void TA_release_operation(keymaster_operation_t *op);
+
+/*
+ * Initializes op, which doesn't have to be a table slot. On success op takes
+ * ownership of the key reference, operation and digest_op, nonce is copied.
+ */
+keymaster_error_t TA_fill_operation(keymaster_operation_t *op,
+				keymaster_cached_key_t *key,
+				const uint32_t min_sec,
+				TEE_OperationHandle *operation,
+				const keymaster_purpose_t purpose,
+				TEE_OperationHandle *digest_op,
+				const bool do_auth,
+				const keymaster_padding_t padding,
+				const keymaster_block_mode_t mode,
+				const uint32_t mac_length,
+				const keymaster_digest_t digest,
+				const keymaster_blob_t nonce,
+				uint8_t *key_id);
 
 keymaster_error_t TA_try_start_operation(
 				const keymaster_operation_handle_t op_handle,
-				const keymaster_key_blob_t key,
+				keymaster_cached_key_t *key,
 				const uint32_t min_sec,
 				TEE_OperationHandle *operation,
 				const keymaster_purpose_t purpose,
@@ -78,7 +119,7 @@ keymaster_error_t TA_try_start_operation(
 
 keymaster_error_t TA_start_operation(
 				const keymaster_operation_handle_t op_handle,
-				const keymaster_key_blob_t key,
+				keymaster_cached_key_t *key,
 				const uint32_t min_sec,
 				TEE_OperationHandle *operation,
 				const keymaster_purpose_t purpose,
@@ -91,11 +132,12 @@ keymaster_error_t TA_start_operation(
 				const keymaster_blob_t nonce,
 				uint8_t *key_id);
 
+/*
+ * Looks up an active operation. The returned pointer refers to the table
+ * slot itself and stays valid until the operation is aborted.
+ */
 keymaster_error_t TA_get_operation(const keymaster_operation_handle_t op_handle,
-				keymaster_operation_t *operation);
-
-keymaster_error_t TA_update_operation(const keymaster_operation_handle_t op_handle,
-				keymaster_operation_t *operation);
+				keymaster_operation_t **operation);
 
 keymaster_error_t TA_kill_old_operation(void);
 
@@ -106,7 +148,7 @@ keymaster_error_t TA_store_sf_data(const keymaster_blob_t *input,
 				keymaster_operation_t *operation);
 
 keymaster_error_t TA_append_sf_data(keymaster_blob_t *input,
-				const keymaster_operation_t *operation,
+				keymaster_operation_t *operation,
 				bool *is_input_ext);
 
 void TA_add_to_nonce(keymaster_operation_t *operation, const uint64_t value);
@@ -42,6 +42,7 @@
 #include "tables.h"
 #include "auth.h"
 #include "common.h"
+#include "arena.h"
 
 uint32_t get_digest_size(const keymaster_digest_t *digest);
 
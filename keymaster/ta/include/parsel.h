@@ -24,6 +24,7 @@
 
 #include "common.h"
 #include "ta_ca_defs.h"
+#include "arena.h"
 
 #define MAX_OCTET_COUNT 10
 #define ADDITIONAL_TAGS 6 /*
@@ -0,0 +1,205 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "key_cache.h"
+#include "generator.h"
+#include "parameters.h"
+#include "user_ta_header_defines.h"
+
+#if CFG_KM_KEY_CACHE_ENTRIES < 1
+#error "CFG_KM_KEY_CACHE_ENTRIES must be at least 1"
+#endif
+/* Operations table may take half of the heap, leave a quarter for commands */
+#if CFG_KM_KEY_CACHE_SIZE > TA_DATA_SIZE / 4
+#error "CFG_KM_KEY_CACHE_SIZE is too big for TA_DATA_SIZE"
+#endif
+
+/* Cached keys ordered by last use, least recently used first */
+static keymaster_cached_key_t *key_lru_head;
+static keymaster_cached_key_t *key_lru_tail;
+static uint32_t key_cache_count;
+static uint32_t key_cache_used;
+
+static void TA_key_lru_unlink(keymaster_cached_key_t *key)
+{
+	if (key->lru_prev)
+		key->lru_prev->lru_next = key->lru_next;
+	else
+		key_lru_head = key->lru_next;
+	if (key->lru_next)
+		key->lru_next->lru_prev = key->lru_prev;
+	else
+		key_lru_tail = key->lru_prev;
+	key->lru_prev = NULL;
+	key->lru_next = NULL;
+}
+
+static void TA_key_lru_append(keymaster_cached_key_t *key)
+{
+	key->lru_prev = key_lru_tail;
+	key->lru_next = NULL;
+	if (key_lru_tail)
+		key_lru_tail->lru_next = key;
+	else
+		key_lru_head = key;
+	key_lru_tail = key;
+}
+
+static void TA_free_key(keymaster_cached_key_t *key)
+{
+	if (key->obj != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(key->obj);
+	TA_free_params(&key->params);
+	if (key->blob.key_material)
+		TEE_Free(key->blob.key_material);
+	TEE_Free(key);
+}
+
+/* Takes key out of the cache, it lives on while references are held */
+static void TA_evict_key(keymaster_cached_key_t *key)
+{
+	TA_key_lru_unlink(key);
+	key->cached = false;
+	key_cache_count--;
+	key_cache_used -= key->cost;
+	if (key->refs == 0)
+		TA_free_key(key);
+}
+
+/* Adds a freshly restored key, evicting least recently used ones */
+static void TA_cache_key(keymaster_cached_key_t *key)
+{
+	if (key->cost > CFG_KM_KEY_CACHE_SIZE)
+		return;
+	while (key_lru_head &&
+	       (key_cache_count >= CFG_KM_KEY_CACHE_ENTRIES ||
+		key_cache_used + key->cost > CFG_KM_KEY_CACHE_SIZE))
+		TA_evict_key(key_lru_head);
+	TA_key_lru_append(key);
+	key->cached = true;
+	key_cache_count++;
+	key_cache_used += key->cost;
+}
+
+static keymaster_cached_key_t *TA_find_key(const keymaster_key_blob_t *key_blob)
+{
+	const uint8_t *tag = key_blob->key_material +
+			key_blob->key_material_size - TAG_LENGTH;
+	keymaster_cached_key_t *key = NULL;
+
+	/* most recently used keys are the likely hits */
+	for (key = key_lru_tail; key; key = key->lru_prev) {
+		if (!TEE_MemCompare(key->key_id, tag, TAG_LENGTH))
+			return key;
+	}
+	return NULL;
+}
+
+keymaster_error_t TA_get_key(const keymaster_key_blob_t *key_blob,
+			     keymaster_cached_key_t **key)
+{
+	keymaster_cached_key_t *k = NULL;
+	uint8_t *key_material = NULL;
+	const size_t size = key_blob->key_material_size;
+	keymaster_error_t res = KM_ERROR_OK;
+
+	*key = NULL;
+	if (!key_blob->key_material || size <= TAG_LENGTH) {
+		EMSG("Key blob is too short");
+		return KM_ERROR_INVALID_KEY_BLOB;
+	}
+
+	k = TA_find_key(key_blob);
+	/* the tag only selects the entry, the whole blob has to match */
+	if (k && k->blob.key_material_size == size &&
+	    !TEE_MemCompare(k->blob.key_material, key_blob->key_material,
+			    size)) {
+		TA_key_lru_unlink(k);
+		TA_key_lru_append(k);
+		k->refs++;
+		*key = k;
+		return KM_ERROR_OK;
+	}
+
+	k = TEE_Malloc(sizeof(keymaster_cached_key_t), TEE_MALLOC_FILL_ZERO);
+	if (!k) {
+		EMSG("Failed to allocate memory for cached key");
+		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+	}
+	k->obj = TEE_HANDLE_NULL;
+	k->blob.key_material = TEE_Malloc(size, TEE_MALLOC_FILL_ZERO);
+	key_material = TEE_Malloc(size, TEE_MALLOC_FILL_ZERO);
+	if (!k->blob.key_material || !key_material) {
+		EMSG("Failed to allocate memory for key material");
+		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+		goto out;
+	}
+	TEE_MemMove(k->blob.key_material, key_blob->key_material, size);
+	k->blob.key_material_size = size;
+
+	res = TA_restore_key(key_material, key_blob, &k->key_size, &k->type,
+			     &k->obj, &k->params);
+	if (res != KM_ERROR_OK) {
+		/* TA_restore_key has already freed the object */
+		k->obj = TEE_HANDLE_NULL;
+		goto out;
+	}
+	TEE_MemMove(k->key_id, key_blob->key_material + size - TAG_LENGTH,
+		    TAG_LENGTH);
+	k->refs = 1;
+	k->cost = sizeof(keymaster_cached_key_t) + 2 * size;
+	TA_cache_key(k);
+	*key = k;
+
+out:
+	if (key_material)
+		TEE_Free(key_material);
+	if (res != KM_ERROR_OK)
+		TA_free_key(k);
+	return res;
+}
+
+void TA_hold_key(keymaster_cached_key_t *key)
+{
+	key->refs++;
+}
+
+void TA_put_key(keymaster_cached_key_t *key)
+{
+	if (!key)
+		return;
+	key->refs--;
+	if (!key->cached && key->refs == 0)
+		TA_free_key(key);
+}
+
+void TA_invalidate_key(const keymaster_key_blob_t *key_blob)
+{
+	keymaster_cached_key_t *key = NULL;
+
+	if (!key_blob->key_material ||
+	    key_blob->key_material_size <= TAG_LENGTH)
+		return;
+	while ((key = TA_find_key(key_blob)) != NULL)
+		TA_evict_key(key);
+}
+
+void TA_invalidate_all_keys(void)
+{
+	while (key_lru_head)
+		TA_evict_key(key_lru_head);
+}
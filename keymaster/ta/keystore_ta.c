@@ -63,6 +63,9 @@ TEE_Result TA_CreateEntryPoint(void)
 		EMSG("Something wrong with authorization token (%x)", res);
 		goto exit;
 	}
+	/* not fatal, the key is loaded again on the first token check */
+	if (TA_LoadAuthTokenKey() != TEE_SUCCESS)
+		EMSG("Failed to load authorization token key");
 
 	res = TEE_OpenTASession(&rng_entropy_uuid, TEE_TIMEOUT_INFINITE,
 				exp_param_types, params, &session_rngSTA,
@@ -79,14 +82,16 @@ exit:
 void TA_DestroyEntryPoint(void)
 {
 	DMSG("%s %d", __func__, __LINE__);
+	TA_invalidate_all_keys();
 	TA_free_master_key();
+	TA_FreeAuthTokenKey();
 	TEE_CloseTASession(session_rngSTA);
 	session_rngSTA = TEE_HANDLE_NULL;
 }
 
 TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
 				    TEE_Param params[TEE_NUM_PARAMS] __unused,
-				    void **sess_ctx __unused)
+				    void **sess_ctx)
 {
 	uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
 						   TEE_PARAM_TYPE_NONE,
@@ -96,12 +101,19 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
+	*sess_ctx = TA_create_session();
+	if (!*sess_ctx) {
+		EMSG("Failed to allocate memory for session");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
 	return TEE_SUCCESS;
 }
 
-void TA_CloseSessionEntryPoint(void *sess_ctx __unused)
+void TA_CloseSessionEntryPoint(void *sess_ctx)
 {
 	DMSG("%s %d", __func__, __LINE__);
+	/* keys the client left loaded go away with its session */
+	TA_destroy_session(sess_ctx);
 }
 
 static uint32_t TA_possibe_size(const uint32_t type, const uint32_t key_size,
@@ -237,6 +249,194 @@ static keymaster_error_t TA_getVersion(TEE_Param params[TEE_NUM_PARAMS])
 	return res;
 }
 
+/* One KM_GET_SUPPORTED_* answer, UNDEFINED where the query has no field */
+typedef struct {
+	uint32_t cmd;
+	uint32_t algorithm;
+	uint32_t purpose;
+	const uint32_t *values;
+	uint32_t count;
+} keymaster_capability_t;
+
+#define CAP(c, a, p, v) { c, a, p, v, sizeof(v) / sizeof(v[0]) }
+#define CAP_EMPTY(c, a, p) { c, a, p, NULL, 0 }
+
+static const uint32_t cap_algorithms[] = {
+	KM_ALGORITHM_RSA, KM_ALGORITHM_EC, KM_ALGORITHM_AES, KM_ALGORITHM_HMAC
+};
+static const uint32_t cap_aes_modes[] = {
+	KM_MODE_ECB, KM_MODE_CBC, KM_MODE_CTR, KM_MODE_GCM
+};
+static const uint32_t cap_aes_paddings[] = { KM_PAD_NONE, KM_PAD_PKCS7 };
+static const uint32_t cap_rsa_crypt_paddings[] = {
+	KM_PAD_NONE, KM_PAD_RSA_OAEP, KM_PAD_RSA_PKCS1_1_5_ENCRYPT
+};
+static const uint32_t cap_rsa_sign_paddings[] = {
+	KM_PAD_NONE, KM_PAD_RSA_PSS, KM_PAD_RSA_PKCS1_1_5_SIGN
+};
+static const uint32_t cap_ec_paddings[] = { KM_PAD_NONE };
+static const uint32_t cap_digests[] = {
+	KM_DIGEST_NONE, KM_DIGEST_MD5, KM_DIGEST_SHA1, KM_DIGEST_SHA_2_224,
+	KM_DIGEST_SHA_2_256, KM_DIGEST_SHA_2_384, KM_DIGEST_SHA_2_512
+};
+static const uint32_t cap_hmac_digests[] = {
+	KM_DIGEST_SHA1, KM_DIGEST_SHA_2_224, KM_DIGEST_SHA_2_256,
+	KM_DIGEST_SHA_2_384, KM_DIGEST_SHA_2_512
+};
+static const uint32_t cap_pkcs8[] = { KM_KEY_FORMAT_PKCS8 };
+static const uint32_t cap_raw[] = { KM_KEY_FORMAT_RAW };
+static const uint32_t cap_x509[] = { KM_KEY_FORMAT_X509 };
+
+/* What this TA accepts, kept in line with the checks in parameters.c */
+static const keymaster_capability_t capabilities[] = {
+	CAP(KM_GET_SUPPORTED_ALGORITHMS, UNDEFINED, UNDEFINED, cap_algorithms),
+
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_RSA,
+		  KM_PURPOSE_ENCRYPT),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_RSA,
+		  KM_PURPOSE_DECRYPT),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_RSA,
+		  KM_PURPOSE_SIGN),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_RSA,
+		  KM_PURPOSE_VERIFY),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_EC,
+		  KM_PURPOSE_SIGN),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_EC,
+		  KM_PURPOSE_VERIFY),
+	CAP(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_AES,
+	    KM_PURPOSE_ENCRYPT, cap_aes_modes),
+	CAP(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_AES,
+	    KM_PURPOSE_DECRYPT, cap_aes_modes),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_HMAC,
+		  KM_PURPOSE_SIGN),
+	CAP_EMPTY(KM_GET_SUPPORTED_BLOCK_MODES, KM_ALGORITHM_HMAC,
+		  KM_PURPOSE_VERIFY),
+
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_ENCRYPT, cap_rsa_crypt_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_DECRYPT, cap_rsa_crypt_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_SIGN, cap_rsa_sign_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_VERIFY, cap_rsa_sign_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_EC,
+	    KM_PURPOSE_SIGN, cap_ec_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_EC,
+	    KM_PURPOSE_VERIFY, cap_ec_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_AES,
+	    KM_PURPOSE_ENCRYPT, cap_aes_paddings),
+	CAP(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_AES,
+	    KM_PURPOSE_DECRYPT, cap_aes_paddings),
+	CAP_EMPTY(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_HMAC,
+		  KM_PURPOSE_SIGN),
+	CAP_EMPTY(KM_GET_SUPPORTED_PADDING_MODES, KM_ALGORITHM_HMAC,
+		  KM_PURPOSE_VERIFY),
+
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_ENCRYPT, cap_digests),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_DECRYPT, cap_digests),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_SIGN, cap_digests),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_RSA,
+	    KM_PURPOSE_VERIFY, cap_digests),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_EC,
+	    KM_PURPOSE_SIGN, cap_digests),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_EC,
+	    KM_PURPOSE_VERIFY, cap_digests),
+	CAP_EMPTY(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_AES,
+		  KM_PURPOSE_ENCRYPT),
+	CAP_EMPTY(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_AES,
+		  KM_PURPOSE_DECRYPT),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_HMAC,
+	    KM_PURPOSE_SIGN, cap_hmac_digests),
+	CAP(KM_GET_SUPPORTED_DIGESTS, KM_ALGORITHM_HMAC,
+	    KM_PURPOSE_VERIFY, cap_hmac_digests),
+
+	CAP(KM_GET_SUPPORTED_IMPORT_FORMATS, KM_ALGORITHM_RSA, UNDEFINED,
+	    cap_pkcs8),
+	CAP(KM_GET_SUPPORTED_IMPORT_FORMATS, KM_ALGORITHM_EC, UNDEFINED,
+	    cap_pkcs8),
+	CAP(KM_GET_SUPPORTED_IMPORT_FORMATS, KM_ALGORITHM_AES, UNDEFINED,
+	    cap_raw),
+	CAP(KM_GET_SUPPORTED_IMPORT_FORMATS, KM_ALGORITHM_HMAC, UNDEFINED,
+	    cap_raw),
+
+	CAP(KM_GET_SUPPORTED_EXPORT_FORMATS, KM_ALGORITHM_RSA, UNDEFINED,
+	    cap_x509),
+	CAP(KM_GET_SUPPORTED_EXPORT_FORMATS, KM_ALGORITHM_EC, UNDEFINED,
+	    cap_x509),
+	CAP_EMPTY(KM_GET_SUPPORTED_EXPORT_FORMATS, KM_ALGORITHM_AES,
+		  UNDEFINED),
+	CAP_EMPTY(KM_GET_SUPPORTED_EXPORT_FORMATS, KM_ALGORITHM_HMAC,
+		  UNDEFINED),
+};
+
+static uint8_t *TA_put_uint32(uint8_t *out, const uint32_t value)
+{
+	TEE_MemMove(out, &value, sizeof(value));
+	return out + sizeof(value);
+}
+
+/*
+ * Returns the version and every KM_GET_SUPPORTED_* answer in one go, for
+ * the HAL to answer those queries itself. After the error code come the
+ * major, minor and subminor version, the number of entries and the entries
+ * as (command, algorithm, purpose, count, values).
+ */
+static keymaster_error_t TA_getCapabilities(TEE_Param params[TEE_NUM_PARAMS])
+{
+	uint8_t *out = NULL;
+	uint8_t *out_end = NULL;
+	size_t out_size = 0;
+	size_t size = 0;
+	const keymaster_capability_t *cap = NULL;
+	const uint32_t entries = sizeof(capabilities) / sizeof(capabilities[0]);
+	keymaster_error_t res = KM_ERROR_OK;
+	bool oob = false; /* out of bounds flag */
+
+	DMSG("%s %d", __func__, __LINE__);
+
+	out = (uint8_t *)params[1].memref.buffer;
+	out_size = (size_t)params[1].memref.size; /* limited to 8192 */
+	out_end = out + out_size;
+	if (!out) {
+		EMSG("Unexpected null pointer");
+		return KM_ERROR_UNEXPECTED_NULL_POINTER;
+	}
+	if (out_size < KM_RECV_BUF_SIZE) {
+		EMSG("Insufficient output buffer space!");
+		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+
+	size = 4 * sizeof(uint32_t);
+	for (cap = capabilities; cap < capabilities + entries; cap++)
+		size += (4 + cap->count) * sizeof(uint32_t);
+	if (TA_is_out_of_bounds(out, out_end, SIZE_LENGTH_AKMS + size)) {
+		EMSG("Out of output buffer space");
+		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
+	if (res == KM_ERROR_OK) {
+		out = TA_put_uint32(out, KM_TA_VERSION_MAJOR);
+		out = TA_put_uint32(out, KM_TA_VERSION_MINOR);
+		out = TA_put_uint32(out, KM_TA_VERSION_SUBMINOR);
+		out = TA_put_uint32(out, entries);
+		for (cap = capabilities; cap < capabilities + entries; cap++) {
+			out = TA_put_uint32(out, cap->cmd);
+			out = TA_put_uint32(out, cap->algorithm);
+			out = TA_put_uint32(out, cap->purpose);
+			out = TA_put_uint32(out, cap->count);
+			for (uint32_t i = 0; i < cap->count; i++)
+				out = TA_put_uint32(out, cap->values[i]);
+		}
+	}
+	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
+
+	return res;
+}
+
 /* Adds caller-provided entropy to the pool */
 static keymaster_error_t TA_addRngEntropy(TEE_Param params[TEE_NUM_PARAMS])
 {
@@ -436,14 +636,11 @@ static keymaster_error_t TA_generateKey(TEE_Param params[TEE_NUM_PARAMS])
 		goto exit;
 	}
 
-	TA_serialize_param_set(key_material + key_buffer_size,
-			       key_material + key_blob.key_material_size,
-			       &params_t, &oob);
-	if (oob) {
-		EMSG("Out of output buffer space");
-		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	res = TA_serialize_key_params(key_material,
+				      key_blob.key_material_size, &params_t,
+				      &key_blob.key_material_size);
+	if (res != KM_ERROR_OK)
 		goto exit;
-	}
 
 	res = TA_encrypt(key_material, key_blob.key_material_size);
 	if (res != KM_ERROR_OK) {
@@ -495,17 +692,13 @@ static keymaster_error_t TA_getKeyCharacteristics(
 	uint8_t *out = NULL;
 	uint8_t *out_end = NULL;
 	size_t out_size = 0;
-	uint8_t *key_material = NULL;
 	keymaster_key_blob_t key_blob = EMPTY_KEY_BLOB; /* IN */
 	keymaster_blob_t client_id = EMPTY_BLOB; /* IN */
 	keymaster_blob_t app_data = EMPTY_BLOB; /* IN */
 	keymaster_key_characteristics_t chr = EMPTY_CHARACTS; /* OUT */
-	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
+	keymaster_cached_key_t *key = NULL;
 	keymaster_error_t res = KM_ERROR_OK;
-	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
 	uint32_t characts_size = 0;
-	uint32_t key_size = 0;
-	uint32_t type = 0;
 	bool exportable = false;
 	bool oob = false; /* out of bounds flag */
 
@@ -543,23 +736,16 @@ static keymaster_error_t TA_getKeyCharacteristics(
 		res = KM_ERROR_UNSUPPORTED_KEY_FORMAT;
 		goto exit;
 	}
-	key_material = TEE_Malloc(key_blob.key_material_size,
-				  TEE_MALLOC_FILL_ZERO);
-	if (!key_material) {
-		EMSG("Failed to allocate memory for key material");
-		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto exit;
-	}
-	res = TA_restore_key(key_material, &key_blob, &key_size, &type, &obj_h,
-			     &params_t);
+	res = TA_get_key(&key_blob, &key);
 	if (res != KM_ERROR_OK)
 		goto exit;
 
-	res = TA_check_permission(&params_t, client_id, app_data, &exportable);
+	res = TA_check_permission(&key->params, client_id, app_data,
+				  &exportable);
 	if (res != KM_ERROR_OK)
 		goto exit;
 
-	res = TA_fill_characteristics(&chr, &params_t, &characts_size);
+	res = TA_fill_characteristics(&chr, &key->params, &characts_size);
 	if (res != KM_ERROR_OK)
 		goto exit;
 
@@ -582,19 +768,15 @@ exit:
 out:
 	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
 
-	if (obj_h != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(obj_h);
+	TA_put_key(key);
 	if (key_blob.key_material)
-		TEE_Free(key_blob.key_material);
+		TA_arena_free(key_blob.key_material);
 	if (client_id.data)
 		TEE_Free(client_id.data);
 	if (app_data.data)
 		TEE_Free(app_data.data);
-	if (key_material)
-		TEE_Free(key_material);
 	TA_free_params(&chr.sw_enforced);
 	TA_free_params(&chr.hw_enforced);
-	TA_free_params(&params_t);
 
 	return res;
 }
@@ -766,14 +948,11 @@ static keymaster_error_t TA_importKey(TEE_Param params[TEE_NUM_PARAMS])
 		EMSG("Failed to import key");
 		goto out;
 	}
-	TA_serialize_param_set(key_material + key_buffer_size,
-			       key_material + key_blob.key_material_size,
-			       &params_t, &oob);
-	if (oob) {
-		EMSG("Out of output buffer space");
-		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	res = TA_serialize_key_params(key_material,
+				      key_blob.key_material_size, &params_t,
+				      &key_blob.key_material_size);
+	if (res != KM_ERROR_OK)
 		goto out;
-	}
 
 	res = TA_encrypt(key_material, key_blob.key_material_size);
 	if (res != KM_ERROR_OK) {
@@ -837,12 +1016,8 @@ static keymaster_error_t TA_exportKey(TEE_Param params[TEE_NUM_PARAMS])
 	keymaster_key_param_set_t in_params = EMPTY_PARAM_SET; /* IN */
 	keymaster_blob_t export_data = EMPTY_BLOB; /* OUT */
 	keymaster_error_t res = KM_ERROR_OK;
-	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
-	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
+	keymaster_cached_key_t *key = NULL;
 	bool exportable = false;
-	uint8_t *key_material = NULL;
-	uint32_t key_size = UNDEFINED;
-	uint32_t type = 0;
 	bool oob = false; /* out of bounds flag */
 
 	DMSG("%s %d", __func__, __LINE__);
@@ -880,18 +1055,10 @@ static keymaster_error_t TA_exportKey(TEE_Param params[TEE_NUM_PARAMS])
 		res = KM_ERROR_UNSUPPORTED_KEY_FORMAT;
 		goto out;
 	}
-	key_material = TEE_Malloc(key_to_export.key_material_size,
-				  TEE_MALLOC_FILL_ZERO);
-	if (!key_material) {
-		EMSG("Failed to allocate memory for key material");
-		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto out;
-	}
-	res = TA_restore_key(key_material, &key_to_export, &key_size, &type,
-			     &obj_h, &params_t);
+	res = TA_get_key(&key_to_export, &key);
 	if (res != KM_ERROR_OK)
 		goto out;
-	res = TA_check_permission(&params_t,
+	res = TA_check_permission(&key->params,
 				  /* client id */
 				  in_params.params[0].key_param.blob,
 				  /* app_data */
@@ -899,13 +1066,13 @@ static keymaster_error_t TA_exportKey(TEE_Param params[TEE_NUM_PARAMS])
 				  &exportable);
 	if (res != KM_ERROR_OK)
 		goto out;
-	if (!exportable && type != TEE_TYPE_RSA_KEYPAIR
-	    && type != TEE_TYPE_ECDSA_KEYPAIR) {
+	if (!exportable && key->type != TEE_TYPE_RSA_KEYPAIR
+	    && key->type != TEE_TYPE_ECDSA_KEYPAIR) {
 		res = KM_ERROR_UNSUPPORTED_KEY_FORMAT;
 		EMSG("This key type is not exportable");
 		goto out;
 	}
-	res = mbedTLS_encode_key(&export_data, type, &obj_h);
+	res = mbedTLS_encode_key(&export_data, key->type, &key->obj);
 	if (res != KM_ERROR_OK)
 		goto out;
 
@@ -928,15 +1095,11 @@ out:
 exit:
 	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
 
-	if (obj_h != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(obj_h);
+	TA_put_key(key);
 	if (key_to_export.key_material)
-		TEE_Free(key_to_export.key_material);
-	if (key_material)
-		TEE_Free(key_material);
+		TA_arena_free(key_to_export.key_material);
 	if (export_data.data)
 		TEE_Free(export_data.data);
-	TA_free_params(&params_t);
 	TA_free_params(&in_params);
 
 	return res;
@@ -962,10 +1125,7 @@ static keymaster_error_t TA_attestKey(TEE_Param params[TEE_NUM_PARAMS])
 	keymaster_blob_t *attest_app_id = NULL;
 	bool exportable = false;
 
-	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
-	TEE_ObjectHandle attestedKey = TEE_HANDLE_NULL;
-	uint8_t *key_material = NULL;
-	uint32_t key_size = 0;
+	keymaster_cached_key_t *attestedKey = NULL;
 	uint32_t key_type = 0;
 
 	keymaster_key_characteristics_t key_chr = EMPTY_CHARACTS;
@@ -1019,14 +1179,6 @@ static keymaster_error_t TA_attestKey(TEE_Param params[TEE_NUM_PARAMS])
 		goto exit;
 	}
 
-	key_material = TEE_Malloc(key_to_attest.key_material_size,
-				  TEE_MALLOC_FILL_ZERO);
-	if (!key_material) {
-		EMSG("Failed to allocate memory for key material");
-		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto exit;
-	}
-
 	/* Deserialize parameters necessary for attestation */
 	in += TA_deserialize_auth_set(in, in_end, &attest_params, false, &res);
 	if (res != KM_ERROR_OK)
@@ -1082,14 +1234,14 @@ static keymaster_error_t TA_attestKey(TEE_Param params[TEE_NUM_PARAMS])
 	}
 
 	/* Restore key */
-	res = TA_restore_key(key_material, &key_to_attest, &key_size,
-			     &key_type, &attestedKey, &params_t);
+	res = TA_get_key(&key_to_attest, &attestedKey);
 	if (res != KM_ERROR_OK)
 		goto exit;
+	key_type = attestedKey->type;
 
 	if (app_id != NULL && app_data != NULL) {
-		res = TA_check_permission(&params_t, *app_id, *app_data,
-					  &exportable);
+		res = TA_check_permission(&attestedKey->params, *app_id,
+					  *app_data, &exportable);
 		if (res != KM_ERROR_OK)
 			goto exit;
 	}
@@ -1103,7 +1255,8 @@ static keymaster_error_t TA_attestKey(TEE_Param params[TEE_NUM_PARAMS])
 		goto exit;
 	}
 
-	res = TA_fill_characteristics(&key_chr, &params_t, &key_chr_size);
+	res = TA_fill_characteristics(&key_chr, &attestedKey->params,
+				      &key_chr_size);
 	if (res != KM_ERROR_OK)
 		goto exit;
 
@@ -1142,8 +1295,8 @@ static keymaster_error_t TA_attestKey(TEE_Param params[TEE_NUM_PARAMS])
 		goto exit;
 	}
 	/* Generate key attestation certificate (using STA ASN.1) */
-	result = TA_gen_key_attest_cert(key_type, attestedKey, &attest_params,
-					&key_chr, &cert_chain,
+	result = TA_gen_key_attest_cert(key_type, attestedKey->obj,
+					&attest_params, &key_chr, &cert_chain,
 					verified_boot_state, includeUniqueID);
 	if (result != TEE_SUCCESS) {
 		EMSG("Failed to gen key att cert, res=%x", result);
@@ -1179,18 +1332,13 @@ out:
 	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
 
 	if (key_to_attest.key_material)
-		TEE_Free(key_to_attest.key_material);
-
-	if (attestedKey != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(attestedKey);
+		TA_arena_free(key_to_attest.key_material);
 
-	if (key_material)
-		TEE_Free(key_material);
+	TA_put_key(attestedKey);
 
 	TA_free_params(&attest_params);
 	TA_free_params(&key_chr.sw_enforced);
 	TA_free_params(&key_chr.hw_enforced);
-	TA_free_params(&params_t);
 	TA_free_cert_chain(&cert_chain);
 
 	return res;
@@ -1206,7 +1354,15 @@ static keymaster_error_t TA_upgradeKey(TEE_Param params[TEE_NUM_PARAMS])
 	keymaster_key_blob_t key_to_upgrade = EMPTY_KEY_BLOB; /* IN */
 	keymaster_key_param_set_t upgr_params = EMPTY_PARAM_SET; /* IN */
 	keymaster_key_blob_t upgraded_key = EMPTY_KEY_BLOB; /* OUT */
+	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
+	keymaster_blob_t client_id = EMPTY_BLOB;
+	keymaster_blob_t app_data = EMPTY_BLOB;
 	keymaster_error_t res = KM_ERROR_OK;
+	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
+	uint8_t *key_material = NULL;
+	uint32_t key_size = 0;
+	uint32_t type = 0;
+	bool exportable = false;
 	bool oob = false; /* out of bounds flag */
 
 	DMSG("%s %d", __func__, __LINE__);
@@ -1230,13 +1386,46 @@ static keymaster_error_t TA_upgradeKey(TEE_Param params[TEE_NUM_PARAMS])
 	in += TA_deserialize_key_blob_akms(in, in_end, &key_to_upgrade, &res);
 	if (res != KM_ERROR_OK)
 		goto out;
+	/* Old blob must not be served from the cache once it is replaced */
+	TA_invalidate_key(&key_to_upgrade);
 	in += TA_deserialize_auth_set(in, in_end, &upgr_params, false, &res);
 	if (res != KM_ERROR_OK)
 		goto out;
 	TA_add_origin(&upgr_params, KM_ORIGIN_UNKNOWN, false);
 
+	for (size_t i = 0; i < upgr_params.length; i++) {
+		if (upgr_params.params[i].tag == KM_TAG_APPLICATION_ID)
+			client_id = upgr_params.params[i].key_param.blob;
+		else if (upgr_params.params[i].tag == KM_TAG_APPLICATION_DATA)
+			app_data = upgr_params.params[i].key_param.blob;
+	}
+	if (key_to_upgrade.key_material_size <= TAG_LENGTH) {
+		EMSG("Bad key blob");
+		res = KM_ERROR_INVALID_KEY_BLOB;
+		goto out;
+	}
+	key_material = TEE_Malloc(key_to_upgrade.key_material_size,
+				  TEE_MALLOC_FILL_ZERO);
+	if (!key_material) {
+		EMSG("Failed to allocate memory for key material");
+		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+		goto out;
+	}
+	res = TA_restore_key(key_material, &key_to_upgrade, &key_size, &type,
+			     &obj_h, &params_t);
+	if (res != KM_ERROR_OK)
+		goto out;
+	res = TA_check_permission(&params_t, client_id, app_data, &exportable);
+	if (res != KM_ERROR_OK)
+		goto out;
+	/* Empty blob tells the caller that the key is up to date */
+	if (!TA_is_key_material_v2(key_material,
+			key_to_upgrade.key_material_size - TAG_LENGTH))
+		res = TA_upgrade_key_material(key_material,
+				key_to_upgrade.key_material_size - TAG_LENGTH,
+				&upgraded_key);
+
 out:
-	/* TODO Upgrade Key */
 	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
 	if (oob) {
 		EMSG("Out of output buffer space");
@@ -1255,23 +1444,36 @@ out:
 exit:
 	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
 
+	if (obj_h != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(obj_h);
+	if (key_material)
+		TEE_Free(key_material);
+	if (upgraded_key.key_material)
+		TEE_Free(upgraded_key.key_material);
+	TA_free_params(&params_t);
 	TA_free_params(&upgr_params);
 	if (key_to_upgrade.key_material)
-		TEE_Free(key_to_upgrade.key_material);
+		TA_arena_free(key_to_upgrade.key_material);
 	return res;
 }
 
 /* Deletes the provided key */
 static keymaster_error_t TA_deleteKey(TEE_Param params[TEE_NUM_PARAMS])
 {
+	uint8_t *in = NULL;
+	uint8_t *in_end = NULL;
 	uint8_t *out = NULL;
 	uint8_t *out_end = NULL;
 	size_t out_size = 0;
+	keymaster_key_blob_t key_to_delete = EMPTY_KEY_BLOB; /* IN */
 	keymaster_error_t res = KM_ERROR_OK;
+	keymaster_error_t in_res = KM_ERROR_OK;
 	bool oob = false; /* out of bounds flag */
 
 	DMSG("%s %d", __func__, __LINE__);
 
+	in = (uint8_t *)params[0].memref.buffer;
+	in_end = in + params[0].memref.size;
 	out = (uint8_t *)params[1].memref.buffer;
 	out_size = (size_t)params[1].memref.size; /* limited to 8192 */
 	out_end = out + out_size;
@@ -1283,6 +1485,15 @@ static keymaster_error_t TA_deleteKey(TEE_Param params[TEE_NUM_PARAMS])
 		EMSG("Insufficient output buffer space!");
 		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 	}
+	/* Blobs are not stored, only the restored copy has to go */
+	if (in) {
+		TA_deserialize_key_blob_akms(in, in_end, &key_to_delete,
+					     &in_res);
+		if (in_res == KM_ERROR_OK)
+			TA_invalidate_key(&key_to_delete);
+		else
+			TA_invalidate_all_keys();
+	}
 	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
 	if (oob) {
 		EMSG("Out of output buffer space");
@@ -1290,6 +1501,8 @@ static keymaster_error_t TA_deleteKey(TEE_Param params[TEE_NUM_PARAMS])
 	}
 	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
 
+	if (key_to_delete.key_material)
+		TA_arena_free(key_to_delete.key_material);
 	return res;
 }
 
@@ -1315,6 +1528,7 @@ static keymaster_error_t TA_deleteAllKeys(TEE_Param params[TEE_NUM_PARAMS])
 		EMSG("Insufficient output buffer space!");
 		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 	}
+	TA_invalidate_all_keys();
 	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
 	if (oob) {
 		EMSG("Out of output buffer space");
@@ -1358,32 +1572,22 @@ static keymaster_error_t TA_destroyAttestationIds(
 }
 
 /*
- * Begins a cryptographic operation, using the specified key, for the specified
- * purpose, with the specified parameters (as appropriate), and returns an
- * operation handle that is used with update and finish to complete the
- * operation
+ * Sets up crypto operations for a restored key and puts them into the
+ * operations table under op_handle, consuming the reference the caller
+ * holds on the key.
  */
-static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS])
+static keymaster_error_t TA_begin_key_operation(
+				const keymaster_purpose_t purpose,
+				keymaster_cached_key_t *restored,
+				const keymaster_key_param_set_t *in_params,
+				keymaster_key_param_set_t *out_params,
+				const keymaster_operation_handle_t op_handle)
 {
-	uint8_t *in = NULL;
-	uint8_t *in_end = NULL;
-	uint8_t *out = NULL;
-	uint8_t *out_end = NULL;
-	size_t out_size = 0;
-	uint8_t *key_material = NULL;
 	uint8_t *secretIV = NULL;
 	uint32_t mac_length = UNDEFINED;
-	uint32_t key_size = 0;
 	uint32_t IVsize = UNDEFINED;
 	uint32_t min_sec = UNDEFINED;
-	uint32_t type = 0;
 	bool do_auth = false;
-	keymaster_purpose_t purpose = UNDEFINED; /* IN */
-	keymaster_key_blob_t key = EMPTY_KEY_BLOB; /* IN */
-	keymaster_key_param_set_t in_params = EMPTY_PARAM_SET; /* IN */
-	keymaster_key_param_set_t out_params = EMPTY_PARAM_SET; /* OUT */
-	keymaster_operation_handle_t operation_handle = 0; /* OUT */
-	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
 	keymaster_key_param_t *nonce_param = NULL;
 	keymaster_error_t res = KM_ERROR_OK;
 	keymaster_algorithm_t algorithm = UNDEFINED;
@@ -1391,29 +1595,9 @@ static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS])
 	keymaster_digest_t digest = UNDEFINED;
 	keymaster_block_mode_t mode = UNDEFINED;
 	keymaster_padding_t padding = UNDEFINED;
-	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
 	TEE_OperationHandle *operation = TEE_HANDLE_NULL;
 	TEE_OperationHandle *digest_op = TEE_HANDLE_NULL;
 	uint8_t key_id[TAG_LENGTH];
-	bool oob = false; /* out of bounds flag */
-
-	DMSG("%s %d", __func__, __LINE__);
-
-	in = (uint8_t *)params[0].memref.buffer;
-	in_end = in + params[0].memref.size;
-	out = (uint8_t *)params[1].memref.buffer;
-	out_size = (size_t)params[1].memref.size; /* limited to 8192 */
-	out_end = out + out_size;
-
-	if (!in || !out) {
-		EMSG("Unexpected null pointer");
-		return KM_ERROR_UNEXPECTED_NULL_POINTER;
-	}
-
-	if (out_size < KM_RECV_BUF_SIZE) {
-		EMSG("Insufficient output buffer space!");
-		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
-	}
 
 	/* Freed when operation is aborted (TA_abort_operation) */
 	operation = TEE_Malloc(sizeof(TEE_OperationHandle),
@@ -1434,25 +1618,9 @@ static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS])
 	*operation = TEE_HANDLE_NULL;
 	*digest_op = TEE_HANDLE_NULL;
 
-	in += TA_deserialize_purpose(in, in_end, &purpose, &res);
-	if (res != KM_ERROR_OK)
-		goto out;
-	in += TA_deserialize_key_blob_akms(in, in_end, &key, &res);
-	if (res != KM_ERROR_OK)
-		goto out;
-	in += TA_deserialize_auth_set(in, in_end, &in_params, false, &res);
-	if (res != KM_ERROR_OK)
-		goto out;
-	key_material = TEE_Malloc(key.key_material_size, TEE_MALLOC_FILL_ZERO);
-
-	memcpy(key_id, key.key_material + key.key_material_size - TAG_LENGTH,
-	       TAG_LENGTH);
+	memcpy(key_id, restored->key_id, TAG_LENGTH);
 
-	res = TA_restore_key(key_material, &key, &key_size, &type, &obj_h,
-			     &params_t);
-	if (res != KM_ERROR_OK)
-		goto out;
-	switch (type) {
+	switch (restored->type) {
 	case TEE_TYPE_AES:
 		algorithm = KM_ALGORITHM_AES;
 		break;
@@ -1465,9 +1633,9 @@ static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS])
 	default:/* HMAC */
 		algorithm = KM_ALGORITHM_HMAC;
 	}
-	res = TA_check_params(&params_t, &in_params, &algorithm, purpose,
-			      &digest, &mode, &padding, &mac_length, &nonce,
-			      &min_sec, &do_auth, key_id);
+	res = TA_check_params(&restored->params, in_params, &algorithm,
+			      purpose, &digest, &mode, &padding, &mac_length,
+			      &nonce, &min_sec, &do_auth, key_id);
 	if (res != KM_ERROR_OK)
 		goto out;
 	if (algorithm == KM_ALGORITHM_AES && mode != KM_MODE_ECB &&
@@ -1477,17 +1645,15 @@ static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS])
 		} else { /* GCM mode */
 			IVsize = 12;
 		}
-		out_params.length = 1;
-		secretIV = TEE_Malloc(IVsize, TEE_MALLOC_FILL_ZERO);
+		out_params->length = 1;
+		secretIV = TA_arena_alloc(IVsize);
 		if (!secretIV) {
 			EMSG("Failed to allocate memory for secretIV");
 			res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
 			goto out;
 		}
-		nonce_param = TEE_Malloc(sizeof(keymaster_key_param_t),
-					 TEE_MALLOC_FILL_ZERO);
+		nonce_param = TA_arena_alloc(sizeof(keymaster_key_param_t));
 		if (!nonce_param) {
-			TEE_Free(secretIV);
 			EMSG("Failed to allocate memory for parameters");
 			res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
 			goto out;
@@ -1496,100 +1662,92 @@ static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS])
 		nonce_param->tag = KM_TAG_NONCE;
 		nonce_param->key_param.blob.data = secretIV;
 		nonce_param->key_param.blob.data_length = IVsize;
-		out_params.params = nonce_param;
+		out_params->params = nonce_param;
 		nonce.data_length = IVsize;
 		nonce.data = secretIV;
 	}
 
-	res = TA_create_operation(operation, obj_h, purpose, algorithm,
-				  key_size, nonce, digest, mode, padding,
-				  mac_length);
+	res = TA_create_operation(operation, restored->obj, purpose,
+				  algorithm, restored->key_size, nonce, digest,
+				  mode, padding, mac_length);
 	if (res != KM_ERROR_OK)
 		goto out;
 
-	TEE_GenerateRandom(&operation_handle, sizeof(operation_handle));
 	if (purpose == KM_PURPOSE_SIGN || purpose == KM_PURPOSE_VERIFY ||
 	    (algorithm == KM_ALGORITHM_RSA && padding == KM_PAD_RSA_PSS)) {
 		res = TA_create_digest_op(digest_op, digest);
 		if (res != KM_ERROR_OK)
 			goto out;
 	}
-	res = TA_start_operation(operation_handle, key, min_sec, operation,
+	res = TA_start_operation(op_handle, restored, min_sec, operation,
 				 purpose, digest_op, do_auth, padding, mode,
 				 mac_length, digest, nonce, key_id);
 	if (res != KM_ERROR_OK)
 		goto out;
+	/* Key reference and handles now belong to operation */
+	restored = NULL;
+	operation = NULL;
+	digest_op = NULL;
 
 out:
-	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
-	if (oob) {
-		EMSG("Out of output buffer space");
-		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
-	}
-	if (res == KM_ERROR_OK) {
-		if (TA_is_out_of_bounds(out, out_end,
-					sizeof(operation_handle))) {
-			EMSG("Out of output buffer space");
-			res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
-			goto exit;
-		}
-		TEE_MemMove(out, &operation_handle, sizeof(operation_handle));
-		out += sizeof(operation_handle);
-		out += TA_serialize_auth_set(out, out_end, &out_params, &oob);
-		if (oob) {
-			EMSG("Out of output buffer space");
-			res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
-			goto exit;
-		}
-	}
-
-exit:
-	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
-
-	if (obj_h != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(obj_h);
-	if (key.key_material)
-		TEE_Free(key.key_material);
-	if (res != KM_ERROR_OK) {
-		if (*digest_op != TEE_HANDLE_NULL)
-			TEE_FreeOperation(*digest_op);
+	TA_put_key(restored);
+	if (operation) {
 		if (*operation != TEE_HANDLE_NULL)
 			TEE_FreeOperation(*operation);
 		TEE_Free(operation);
+	}
+	if (digest_op) {
+		if (*digest_op != TEE_HANDLE_NULL)
+			TEE_FreeOperation(*digest_op);
 		TEE_Free(digest_op);
 	}
-	if (key_material)
-		TEE_Free(key_material);
-	TA_free_params(&in_params);
-	TA_free_params(&params_t);
-	TA_free_params(&out_params);
 	return res;
 }
 
-/* Provides data to process in an ongoing operation started with begin */
-static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS])
+/*
+ * Takes a reference to the restored key and sets up crypto operations for it,
+ * see TA_begin_key_operation.
+ */
+static keymaster_error_t TA_begin_operation(const keymaster_purpose_t purpose,
+				const keymaster_key_blob_t *key,
+				const keymaster_key_param_set_t *in_params,
+				keymaster_key_param_set_t *out_params,
+				const keymaster_operation_handle_t op_handle)
+{
+	keymaster_cached_key_t *restored = NULL;
+	keymaster_error_t res = KM_ERROR_OK;
+
+	res = TA_get_key(key, &restored);
+	if (res != KM_ERROR_OK)
+		return res;
+	return TA_begin_key_operation(purpose, restored, in_params, out_params,
+				      op_handle);
+}
+
+/*
+ * Begins a cryptographic operation, using the specified key, for the specified
+ * purpose, with the specified parameters (as appropriate), and returns an
+ * operation handle that is used with update and finish to complete the
+ * operation. With loaded set the key is given as a handle returned by
+ * KM_LOAD_KEY in session instead of a key blob.
+ */
+static keymaster_error_t TA_begin(TEE_Param params[TEE_NUM_PARAMS],
+				  keymaster_session_t *session,
+				  const bool loaded)
 {
 	uint8_t *in = NULL;
 	uint8_t *in_end = NULL;
 	uint8_t *out = NULL;
 	uint8_t *out_end = NULL;
 	size_t out_size = 0;
-	keymaster_operation_handle_t operation_handle = 0; /* IN */
+	keymaster_purpose_t purpose = UNDEFINED; /* IN */
+	keymaster_key_blob_t key = EMPTY_KEY_BLOB; /* IN */
+	uint64_t key_handle = 0; /* IN */
 	keymaster_key_param_set_t in_params = EMPTY_PARAM_SET; /* IN */
-	keymaster_blob_t input = EMPTY_BLOB; /* IN */
-	size_t input_consumed = 0; /* OUT */
 	keymaster_key_param_set_t out_params = EMPTY_PARAM_SET; /* OUT */
-	keymaster_blob_t output = EMPTY_BLOB; /* OUT */
-	uint8_t *key_material = NULL;
-	uint32_t key_size = 0;
-	uint32_t type = 0;
-	uint32_t keyblob_out_size = 0;
-	uint32_t input_provided = 0;
+	keymaster_operation_handle_t operation_handle = 0; /* OUT */
+	keymaster_cached_key_t *restored = NULL;
 	keymaster_error_t res = KM_ERROR_OK;
-	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
-	keymaster_operation_t operation = EMPTY_OPERATION;
-	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
-	bool is_input_ext = false;
 	bool oob = false; /* out of bounds flag */
 
 	DMSG("%s %d", __func__, __LINE__);
@@ -1610,28 +1768,167 @@ static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS])
 		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 	}
 
-	in += TA_deserialize_op_handle(in, in_end, &operation_handle, &res);
+	in += TA_deserialize_purpose(in, in_end, &purpose, &res);
 	if (res != KM_ERROR_OK)
 		goto out;
-	in += TA_deserialize_blob_akms(in, in_end, &input, false, &res, true);
+	if (loaded)
+		in += TA_deserialize_op_handle(in, in_end, &key_handle, &res);
+	else
+		in += TA_deserialize_key_blob_akms(in, in_end, &key, &res);
 	if (res != KM_ERROR_OK)
 		goto out;
 	in += TA_deserialize_auth_set(in, in_end, &in_params, false, &res);
 	if (res != KM_ERROR_OK)
 		goto out;
 
-	input_provided = input.data_length;
-	res = TA_get_operation(operation_handle, &operation);
-	if (res != KM_ERROR_OK)
+	if (loaded) {
+		/* the key stays restored, no blob to decrypt and parse */
+		res = TA_get_loaded_key(session, key_handle, &restored);
+		if (res != KM_ERROR_OK)
+			goto out;
+		TEE_GenerateRandom(&operation_handle, sizeof(operation_handle));
+		res = TA_begin_key_operation(purpose, restored, &in_params,
+					     &out_params, operation_handle);
+	} else {
+		TEE_GenerateRandom(&operation_handle, sizeof(operation_handle));
+		res = TA_begin_operation(purpose, &key, &in_params,
+					 &out_params, operation_handle);
+	}
+
+out:
+	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
+	if (oob) {
+		EMSG("Out of output buffer space");
+		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+	if (res == KM_ERROR_OK) {
+		if (TA_is_out_of_bounds(out, out_end,
+					sizeof(operation_handle))) {
+			EMSG("Out of output buffer space");
+			res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+			goto exit;
+		}
+		TEE_MemMove(out, &operation_handle, sizeof(operation_handle));
+		out += sizeof(operation_handle);
+		out += TA_serialize_auth_set(out, out_end, &out_params, &oob);
+		if (oob) {
+			EMSG("Out of output buffer space");
+			res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+			goto exit;
+		}
+	}
+
+exit:
+	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
+
+	if (res != KM_ERROR_OK && operation_handle != 0)
+		TA_abort_operation(operation_handle);
+	if (key.key_material)
+		TA_arena_free(key.key_material);
+	TA_free_params(&in_params);
+	TA_free_params(&out_params);
+	return res;
+}
+
+/*
+ * Points input and output at the data regions of a KM_UPDATE_LARGE or
+ * KM_FINISH_LARGE command, output data_length is the room available. The
+ * data is processed in place and never copied to the heap.
+ */
+static keymaster_error_t TA_large_regions(TEE_Param params[TEE_NUM_PARAMS],
+					  keymaster_blob_t *input,
+					  keymaster_blob_t *output)
+{
+	if (input->data_length != 0) {
+		EMSG("Input passed both in the request and in a data region");
+		return KM_ERROR_INVALID_ARGUMENT;
+	}
+	if (params[2].memref.size > CFG_KM_LARGE_BUFFER_SIZE ||
+	    params[3].memref.size > CFG_KM_LARGE_BUFFER_SIZE) {
+		EMSG("Data region is larger than the negotiated size");
+		return KM_ERROR_INVALID_INPUT_LENGTH;
+	}
+	if (!params[3].memref.buffer) {
+		EMSG("Unexpected null pointer");
+		return KM_ERROR_UNEXPECTED_NULL_POINTER;
+	}
+	input->data = params[2].memref.buffer;
+	input->data_length = params[2].memref.size;
+	output->data = params[3].memref.buffer;
+	output->data_length = params[3].memref.size;
+	return KM_ERROR_OK;
+}
+
+/*
+ * Provides data to process in an ongoing operation started with begin. With
+ * large set the data comes from and goes to the regions in params[2] and
+ * params[3], the output blob in the response is left empty.
+ */
+static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS],
+				   const bool large)
+{
+	uint8_t *in = NULL;
+	uint8_t *in_end = NULL;
+	uint8_t *out = NULL;
+	uint8_t *out_end = NULL;
+	size_t out_size = 0;
+	keymaster_operation_handle_t operation_handle = 0; /* IN */
+	keymaster_key_param_set_t in_params = EMPTY_PARAM_SET; /* IN */
+	keymaster_blob_t input = EMPTY_BLOB; /* IN */
+	size_t input_consumed = 0; /* OUT */
+	keymaster_key_param_set_t out_params = EMPTY_PARAM_SET; /* OUT */
+	keymaster_blob_t output = EMPTY_BLOB; /* OUT */
+	uint32_t key_size = 0;
+	uint32_t type = 0;
+	uint32_t keyblob_out_size = 0;
+	uint32_t input_provided = 0;
+	keymaster_error_t res = KM_ERROR_OK;
+	keymaster_operation_t *operation = NULL;
+	bool is_input_ext = false;
+	bool oob = false; /* out of bounds flag */
+
+	DMSG("%s %d", __func__, __LINE__);
+
+	in = (uint8_t *)params[0].memref.buffer;
+	in_end = in + params[0].memref.size;
+	out = (uint8_t *)params[1].memref.buffer;
+	out_size = (size_t)params[1].memref.size; /* limited to 8192 */
+	out_end = out + out_size;
+
+	if (!in || !out) {
+		EMSG("Unexpected null pointer");
+		return KM_ERROR_UNEXPECTED_NULL_POINTER;
+	}
+
+	if (out_size < KM_RECV_BUF_SIZE) {
+		EMSG("Insufficient output buffer space!");
+		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+
+	in += TA_deserialize_op_handle(in, in_end, &operation_handle, &res);
+	if (res != KM_ERROR_OK)
 		goto out;
-	key_material = TEE_Malloc(operation.key->key_material_size,
-				  TEE_MALLOC_FILL_ZERO);
-	res = TA_restore_key(key_material, operation.key, &key_size, &type,
-			     &obj_h, &params_t);
+	in += TA_deserialize_blob_akms(in, in_end, &input, false, &res, true);
 	if (res != KM_ERROR_OK)
 		goto out;
-	if (operation.do_auth) {
-		res = TA_do_auth(in_params, params_t);
+	in += TA_deserialize_auth_set(in, in_end, &in_params, false, &res);
+	if (res != KM_ERROR_OK)
+		goto out;
+	if (large) {
+		res = TA_large_regions(params, &input, &output);
+		if (res != KM_ERROR_OK)
+			goto out;
+	}
+
+	input_provided = input.data_length;
+	res = TA_get_operation(operation_handle, &operation);
+	if (res != KM_ERROR_OK)
+		goto out;
+	key_size = operation->key->key_size;
+	type = operation->key->type;
+	if (operation->do_auth) {
+		res = TA_do_auth(in_params, operation->key->params,
+				 &operation->auth);
 		if (res != KM_ERROR_OK) {
 			EMSG("Authentication failed");
 			goto out;
@@ -1639,31 +1936,43 @@ static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS])
 	}
 
 	if (input.data_length != 0 && type == TEE_TYPE_RSA_KEYPAIR)
-		operation.got_input = true;
+		operation->got_input = true;
 	keyblob_out_size = TA_possibe_size(type, key_size, input, 0);
-	output.data = TEE_Malloc(keyblob_out_size, TEE_MALLOC_FILL_ZERO);
-	if (!output.data) {
-		EMSG("Failed to allocate memory for output");
-		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto out;
+	if (large) {
+		if (output.data_length < keyblob_out_size + KM_LARGE_OUT_SLACK) {
+			EMSG("Output region is too small");
+			res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+			goto out;
+		}
+		keyblob_out_size = output.data_length;
+		output.data_length = 0;
+	} else {
+		output.data = TEE_Malloc(keyblob_out_size,
+					 TEE_MALLOC_FILL_ZERO);
+		if (!output.data) {
+			EMSG("Failed to allocate memory for output");
+			res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+			goto out;
+		}
 	}
 	switch (type) {
 	case TEE_TYPE_AES:
-		res = TA_aes_update(&operation, &input, &output, &keyblob_out_size,
+		res = TA_aes_update(operation, &input, &output, &keyblob_out_size,
 				    input_provided, &input_consumed,
 				    &in_params, &is_input_ext);
 		break;
 	case TEE_TYPE_RSA_KEYPAIR:
-		res = TA_rsa_update(&operation, &input, &output,
+		res = TA_rsa_update(operation, &input, &output,
 				    &keyblob_out_size, key_size,
-				    &input_consumed, input_provided, obj_h);
+				    &input_consumed, input_provided,
+				    operation->key->obj);
 		break;
 	case TEE_TYPE_ECDSA_KEYPAIR:
-		res = TA_ec_update(&operation, &input, &output,
+		res = TA_ec_update(operation, &input, &output,
 				   &input_consumed, input_provided);
 		break;
 	default:/* HMAC */
-		TEE_MACUpdate(*operation.operation, input.data,
+		TEE_MACUpdate(*operation->operation, input.data,
 			      input.data_length);
 		input_consumed = input_provided;
 	}
@@ -1673,6 +1982,12 @@ static keymaster_error_t TA_update(TEE_Param params[TEE_NUM_PARAMS])
 	}
 
 out:
+	if (large) {
+		/* the response only carries the size of the produced data */
+		params[3].memref.size = res == KM_ERROR_OK ?
+					output.data_length : 0;
+		output.data_length = 0;
+	}
 	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
 	if (oob) {
 		EMSG("Out of output buffer space");
@@ -1698,7 +2013,6 @@ out:
 			res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 			goto exit;
 		}
-		TA_update_operation(operation_handle, &operation);
 	}
 
 exit:
@@ -1706,25 +2020,121 @@ exit:
 
 	if (input.data && is_input_ext)
 		TEE_Free(input.data);
-	if (output.data)
+	if (output.data && !large)
 		TEE_Free(output.data);
-	if (obj_h != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(obj_h);
-	if (key_material)
-		TEE_Free(key_material);
 	if (res != KM_ERROR_OK)
 		TA_abort_operation(operation_handle);
-	TA_free_params(&params_t);
 	TA_free_params(&in_params);
 	TA_free_params(&out_params);
 	return res;
 }
 
+/*
+ * Processes the remaining input of an operation. Output data is allocated
+ * here and freed by the caller, unless output already points to a region of
+ * output->data_length bytes.
+ */
+static keymaster_error_t TA_finish_operation(keymaster_operation_t *operation,
+				keymaster_key_param_set_t *in_params,
+				keymaster_blob_t *input,
+				keymaster_blob_t *signature,
+				keymaster_blob_t *output,
+				bool *is_input_ext)
+{
+	uint32_t key_size = 0;
+	uint32_t type = 0;
+	uint32_t keyblob_out_size = 0;
+	uint32_t tag_len = 0;
+	keymaster_error_t res = KM_ERROR_OK;
+
+	key_size = operation->key->key_size;
+	type = operation->key->type;
+	if (operation->do_auth) {
+		res = TA_do_auth(*in_params, operation->key->params,
+				 &operation->auth);
+		if (res != KM_ERROR_OK) {
+			EMSG("Authentication failed");
+			return res;
+		}
+	}
+	if (type == TEE_TYPE_AES && operation->mode == KM_MODE_GCM)
+		tag_len = operation->mac_length / 8; /* from bits to bytes */
+
+	keyblob_out_size = TA_possibe_size(type, key_size, *input, tag_len);
+	if (output->data) {
+		if (output->data_length <
+		    keyblob_out_size + KM_LARGE_OUT_SLACK) {
+			EMSG("Output region is too small");
+			return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+		}
+		keyblob_out_size = output->data_length;
+		output->data_length = 0;
+	} else {
+		output->data = TEE_Malloc(keyblob_out_size,
+					  TEE_MALLOC_FILL_ZERO);
+		if (!output->data) {
+			EMSG("Failed to allocate memory for output");
+			return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+		}
+	}
+	switch (type) {
+	case TEE_TYPE_AES:
+		res = TA_aes_finish(operation, input, output,
+				    &keyblob_out_size, tag_len, is_input_ext,
+				    in_params);
+		break;
+	case TEE_TYPE_RSA_KEYPAIR:
+		res = TA_rsa_finish(operation, input, output,
+				    &keyblob_out_size, key_size,
+				    *signature, operation->key->obj,
+				    is_input_ext);
+		break;
+	case TEE_TYPE_ECDSA_KEYPAIR:
+		res = TA_ec_finish(operation, input, output, signature,
+				   &keyblob_out_size, key_size, is_input_ext);
+		break;
+	default: /* HMAC */
+		if (operation->purpose == KM_PURPOSE_SIGN) {
+			TEE_MACComputeFinal(*operation->operation, input->data,
+					    input->data_length, output->data,
+					    &keyblob_out_size);
+			/* Trim out size to KM_TAG_MAC_LENGTH */
+			if (operation->mac_length != UNDEFINED) {
+				if (keyblob_out_size >
+				    operation->mac_length / 8) {
+					DMSG("Trim HMAC out size to %d",
+					     operation->mac_length);
+					keyblob_out_size =
+						operation->mac_length / 8;
+				}
+			}
+		} else { /* KM_PURPOSE_VERIFY */
+			res = TEE_MACCompareFinal(*operation->operation,
+						  input->data,
+						  input->data_length,
+						  signature->data,
+						  signature->data_length);
+			keyblob_out_size = 0;
+			/* Convert error code to Android style */
+			if (res == (int) TEE_ERROR_MAC_INVALID)
+				res = KM_ERROR_VERIFICATION_FAILED;
+		}
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Finish operation failed with error code %x", res);
+		return res;
+	}
+	output->data_length = keyblob_out_size;
+	return res;
+}
+
 /*
  * Finishes an ongoing operation started with begin, processing all of the
- * as-yet-unprocessed data provided by update(s)
+ * as-yet-unprocessed data provided by update(s). large works as for
+ * TA_update.
  */
-static keymaster_error_t TA_finish(TEE_Param params[TEE_NUM_PARAMS])
+static keymaster_error_t TA_finish(TEE_Param params[TEE_NUM_PARAMS],
+				   const bool large)
 {
 	uint8_t *in = NULL;
 	uint8_t *in_end = NULL;
@@ -1737,15 +2147,8 @@ static keymaster_error_t TA_finish(TEE_Param params[TEE_NUM_PARAMS])
 	keymaster_blob_t signature = EMPTY_BLOB; /* IN */
 	keymaster_key_param_set_t out_params = EMPTY_PARAM_SET; /* OUT */
 	keymaster_blob_t output = EMPTY_BLOB; /* OUT */
-	uint8_t *key_material = NULL;
-	uint32_t key_size = 0;
-	uint32_t type = 0;
-	uint32_t keyblob_out_size = 0;
-	uint32_t tag_len = 0;
 	keymaster_error_t res = KM_ERROR_OK;
-	keymaster_key_param_set_t params_t = EMPTY_PARAM_SET;
-	keymaster_operation_t operation = EMPTY_OPERATION;
-	TEE_ObjectHandle obj_h = TEE_HANDLE_NULL;
+	keymaster_operation_t *operation = NULL;
 	bool is_input_ext = false;
 	bool oob = false; /* out of bounds flag */
 
@@ -1780,82 +2183,25 @@ static keymaster_error_t TA_finish(TEE_Param params[TEE_NUM_PARAMS])
 	in += TA_deserialize_blob_akms(in, in_end, &input, false, &res, true);
 	if (res != KM_ERROR_OK)
 		goto out;
-
-	res = TA_get_operation(operation_handle, &operation);
-	if (res != KM_ERROR_OK)
-		goto out;
-	key_material = TEE_Malloc(operation.key->key_material_size,
-				  TEE_MALLOC_FILL_ZERO);
-	res = TA_restore_key(key_material, operation.key, &key_size, &type,
-			     &obj_h, &params_t);
-	if (res != KM_ERROR_OK)
-		goto out;
-	if (operation.do_auth) {
-		res = TA_do_auth(in_params, params_t);
-		if (res != KM_ERROR_OK) {
-			EMSG("Authentication failed");
+	if (large) {
+		res = TA_large_regions(params, &input, &output);
+		if (res != KM_ERROR_OK)
 			goto out;
-		}
 	}
-	if (type == TEE_TYPE_AES && operation.mode == KM_MODE_GCM)
-		tag_len = operation.mac_length / 8; /* from bits to bytes */
 
-	keyblob_out_size = TA_possibe_size(type, key_size, input, tag_len);
-	output.data = TEE_Malloc(keyblob_out_size, TEE_MALLOC_FILL_ZERO);
-	if (!output.data) {
-		EMSG("Failed to allocate memory for output");
-		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto out;
-	}
-	switch (type) {
-	case TEE_TYPE_AES:
-		res = TA_aes_finish(&operation, &input, &output,
-				    &keyblob_out_size, tag_len, &is_input_ext,
-				    &in_params);
-		break;
-	case TEE_TYPE_RSA_KEYPAIR:
-		res = TA_rsa_finish(&operation, &input, &output,
-				    &keyblob_out_size, key_size,
-				    signature, obj_h, &is_input_ext);
-		break;
-	case TEE_TYPE_ECDSA_KEYPAIR:
-		res = TA_ec_finish(&operation, &input, &output, &signature,
-				   &keyblob_out_size, key_size, &is_input_ext);
-		break;
-	default: /* HMAC */
-		if (operation.purpose == KM_PURPOSE_SIGN) {
-			TEE_MACComputeFinal(*operation.operation, input.data,
-					    input.data_length, output.data,
-					    &keyblob_out_size);
-			/* Trim out size to KM_TAG_MAC_LENGTH */
-			if (operation.mac_length != UNDEFINED) {
-				if (keyblob_out_size >
-				    operation.mac_length / 8) {
-					DMSG("Trim HMAC out size to %d",
-					     operation.mac_length);
-					keyblob_out_size =
-						operation.mac_length / 8;
-				}
-			}
-		} else { /* KM_PURPOSE_VERIFY */
-			res = TEE_MACCompareFinal(*operation.operation,
-						  input.data,
-						  input.data_length,
-						  signature.data,
-						  signature.data_length);
-			keyblob_out_size = 0;
-			/* Convert error code to Android style */
-			if (res == (int) TEE_ERROR_MAC_INVALID)
-				res = KM_ERROR_VERIFICATION_FAILED;
-		}
-	}
-	if (res != TEE_SUCCESS) {
-		EMSG("Finish operation failed with error code %x", res);
+	res = TA_get_operation(operation_handle, &operation);
+	if (res != KM_ERROR_OK)
 		goto out;
-	}
-	output.data_length = keyblob_out_size;
+	res = TA_finish_operation(operation, &in_params, &input, &signature,
+				  &output, &is_input_ext);
 
 out:
+	if (large) {
+		/* the response only carries the size of the produced data */
+		params[3].memref.size = res == KM_ERROR_OK ?
+					output.data_length : 0;
+		output.data_length = 0;
+	}
 	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
 	if (oob) {
 		EMSG("Out of output buffer space");
@@ -1882,15 +2228,10 @@ exit:
 	TA_abort_operation(operation_handle);
 	if (input.data && is_input_ext)
 		TEE_Free(input.data);
-	if (output.data)
+	if (output.data && !large)
 		TEE_Free(output.data);
 	if (signature.data)
 		TEE_Free(signature.data);
-	if (obj_h != TEE_HANDLE_NULL)
-		TEE_FreeTransientObject(obj_h);
-	if (key_material)
-		TEE_Free(key_material);
-	TA_free_params(&params_t);
 	TA_free_params(&in_params);
 	TA_free_params(&out_params);
 	return res;
@@ -1941,20 +2282,166 @@ out:
 	return res;
 }
 
-TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx __unused,
-				      uint32_t cmd_id, uint32_t param_types,
-				      TEE_Param params[TEE_NUM_PARAMS])
+/*
+ * Restores a key blob once and keeps it resident in the session, returning
+ * a handle which KM_BEGIN_LOADED takes instead of the blob
+ */
+static keymaster_error_t TA_loadKey(TEE_Param params[TEE_NUM_PARAMS],
+				    keymaster_session_t *session)
 {
-	uint32_t exp_param_types = TEE_PARAM_TYPES(
-			TEE_PARAM_TYPE_MEMREF_INPUT,
-			TEE_PARAM_TYPE_MEMREF_OUTPUT,
-			TEE_PARAM_TYPE_NONE,
-			TEE_PARAM_TYPE_NONE);
-	if (param_types != exp_param_types) {
-		EMSG("Keystore TA wrong parameters");
-		return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+	uint8_t *in = NULL;
+	uint8_t *in_end = NULL;
+	uint8_t *out = NULL;
+	uint8_t *out_end = NULL;
+	size_t out_size = 0;
+	keymaster_key_blob_t key = EMPTY_KEY_BLOB; /* IN */
+	uint64_t key_handle = 0; /* OUT */
+	keymaster_error_t res = KM_ERROR_OK;
+	bool oob = false; /* out of bounds flag */
+
+	DMSG("%s %d", __func__, __LINE__);
+
+	in = (uint8_t *)params[0].memref.buffer;
+	in_end = in + params[0].memref.size;
+	out = (uint8_t *)params[1].memref.buffer;
+	out_size = (size_t)params[1].memref.size; /* limited to 8192 */
+	out_end = out + out_size;
+
+	if (!in || !out) {
+		EMSG("Unexpected null pointer");
+		return KM_ERROR_UNEXPECTED_NULL_POINTER;
+	}
+
+	if (out_size < KM_RECV_BUF_SIZE) {
+		EMSG("Insufficient output buffer space!");
+		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+
+	in += TA_deserialize_key_blob_akms(in, in_end, &key, &res);
+	if (res != KM_ERROR_OK)
+		goto out;
+	res = TA_load_key(session, &key, &key_handle);
+
+out:
+	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
+	if (oob) {
+		EMSG("Out of output buffer space");
+		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+	if (res == KM_ERROR_OK) {
+		TEE_MemMove(out, &key_handle, sizeof(key_handle));
+		out += sizeof(key_handle);
+	}
+	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
+
+	if (res != KM_ERROR_OK && key_handle != 0)
+		TA_unload_key(session, key_handle);
+	if (key.key_material)
+		TA_arena_free(key.key_material);
+	return res;
+}
+
+/* Releases a key loaded with KM_LOAD_KEY */
+static keymaster_error_t TA_unloadKey(TEE_Param params[TEE_NUM_PARAMS],
+				      keymaster_session_t *session)
+{
+	uint8_t *in = NULL;
+	uint8_t *in_end = NULL;
+	uint8_t *out = NULL;
+	uint8_t *out_end = NULL;
+	size_t out_size = 0;
+	uint64_t key_handle = 0; /* IN */
+	keymaster_error_t res = KM_ERROR_OK;
+	bool oob = false; /* out of bounds flag */
+
+	DMSG("%s %d", __func__, __LINE__);
+
+	in = (uint8_t *)params[0].memref.buffer;
+	in_end = in + params[0].memref.size;
+	out = (uint8_t *)params[1].memref.buffer;
+	out_size = (size_t)params[1].memref.size; /* limited to 8192 */
+	out_end = out + out_size;
+
+	if (!in || !out) {
+		EMSG("Unexpected null pointer");
+		return KM_ERROR_UNEXPECTED_NULL_POINTER;
+	}
+
+	if (out_size < KM_RECV_BUF_SIZE) {
+		EMSG("Insufficient output buffer space!");
+		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 	}
 
+	in += TA_deserialize_op_handle(in, in_end, &key_handle, &res);
+	if (res != KM_ERROR_OK)
+		goto out;
+	res = TA_unload_key(session, key_handle);
+
+out:
+	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
+	if (oob) {
+		EMSG("Out of output buffer space");
+		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
+	return res;
+}
+
+/*
+ * Agrees on the size of the data regions of KM_UPDATE_LARGE and
+ * KM_FINISH_LARGE. The request is the size the caller wants, the response
+ * the size granted, which is never above CFG_KM_LARGE_BUFFER_SIZE.
+ */
+static keymaster_error_t TA_negotiate_buffers(TEE_Param params[TEE_NUM_PARAMS])
+{
+	uint8_t *in = NULL;
+	uint8_t *in_end = NULL;
+	uint8_t *out = NULL;
+	uint8_t *out_end = NULL;
+	size_t out_size = 0;
+	uint32_t wanted = 0;
+	uint32_t granted = 0;
+	keymaster_error_t res = KM_ERROR_OK;
+	bool oob = false; /* out of bounds flag */
+
+	DMSG("%s %d", __func__, __LINE__);
+
+	in = (uint8_t *)params[0].memref.buffer;
+	in_end = in + params[0].memref.size;
+	out = (uint8_t *)params[1].memref.buffer;
+	out_size = (size_t)params[1].memref.size;
+	out_end = out + out_size;
+	if (!in || !out) {
+		EMSG("Unexpected null pointer");
+		return KM_ERROR_UNEXPECTED_NULL_POINTER;
+	}
+	if (out_size < KM_RECV_BUF_SIZE) {
+		EMSG("Insufficient output buffer space!");
+		return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+	}
+	if (TA_is_out_of_bounds(in, in_end, sizeof(wanted))) {
+		EMSG("Out of input array bounds on deserialization");
+		res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+		goto out;
+	}
+	TEE_MemMove(&wanted, in, sizeof(wanted));
+	granted = wanted < CFG_KM_LARGE_BUFFER_SIZE ? wanted :
+						   CFG_KM_LARGE_BUFFER_SIZE;
+
+out:
+	out += TA_serialize_rsp_err(out, out_end, &res, &oob);
+	if (res == KM_ERROR_OK) {
+		TEE_MemMove(out, &granted, sizeof(granted));
+		out += sizeof(granted);
+	}
+	params[1].memref.size = out - (uint8_t *)params[1].memref.buffer;
+	return res;
+}
+
+static TEE_Result TA_dispatch_command(keymaster_session_t *session,
+				      uint32_t cmd_id,
+				      TEE_Param params[TEE_NUM_PARAMS])
+{
 	switch(cmd_id) {
 	/* Keymaster commands */
 	case KM_CONFIGURE:
@@ -1995,16 +2482,37 @@ TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx __unused,
 		return TA_destroyAttestationIds(params);
 	case KM_BEGIN:
 		DMSG("KM_BEGIN");
-		return TA_begin(params);
+		return TA_begin(params, session, false);
 	case KM_UPDATE:
 		DMSG("KM_UPDATE");
-		return TA_update(params);
+		return TA_update(params, false);
 	case KM_FINISH:
 		DMSG("KM_FINISH");
-		return TA_finish(params);
+		return TA_finish(params, false);
 	case KM_ABORT:
 		DMSG("KM_ABORT");
 		return TA_abort(params);
+	case KM_NEGOTIATE_BUFFERS:
+		DMSG("KM_NEGOTIATE_BUFFERS");
+		return TA_negotiate_buffers(params);
+	case KM_UPDATE_LARGE:
+		DMSG("KM_UPDATE_LARGE");
+		return TA_update(params, true);
+	case KM_FINISH_LARGE:
+		DMSG("KM_FINISH_LARGE");
+		return TA_finish(params, true);
+	case KM_GET_CAPABILITIES:
+		DMSG("KM_GET_CAPABILITIES");
+		return TA_getCapabilities(params);
+	case KM_LOAD_KEY:
+		DMSG("KM_LOAD_KEY");
+		return TA_loadKey(params, session);
+	case KM_UNLOAD_KEY:
+		DMSG("KM_UNLOAD_KEY");
+		return TA_unloadKey(params, session);
+	case KM_BEGIN_LOADED:
+		DMSG("KM_BEGIN_LOADED");
+		return TA_begin(params, session, true);
 #ifdef CFG_ATTESTATION_PROVISIONING
 	/* Provisioning commands */
 	case KM_SET_ATTESTATION_KEY:
@@ -2024,3 +2532,33 @@ TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx __unused,
 		return KM_ERROR_UNIMPLEMENTED;
 	}
 }
+
+TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx,
+				      uint32_t cmd_id, uint32_t param_types,
+				      TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res = TEE_SUCCESS;
+	uint32_t exp_param_types = TEE_PARAM_TYPES(
+			TEE_PARAM_TYPE_MEMREF_INPUT,
+			TEE_PARAM_TYPE_MEMREF_OUTPUT,
+			TEE_PARAM_TYPE_NONE,
+			TEE_PARAM_TYPE_NONE);
+
+	/* large commands carry the operation data in two extra regions */
+	if (cmd_id == KM_UPDATE_LARGE || cmd_id == KM_FINISH_LARGE)
+		exp_param_types = TEE_PARAM_TYPES(
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT);
+	if (param_types != exp_param_types) {
+		EMSG("Keystore TA wrong parameters");
+		return KM_ERROR_SECURE_HW_COMMUNICATION_FAILED;
+	}
+
+	/* parsed params and buffers live until the command returns */
+	TA_arena_begin();
+	res = TA_dispatch_command(sess_ctx, cmd_id, params);
+	TA_arena_end();
+	return res;
+}
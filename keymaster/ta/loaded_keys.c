@@ -0,0 +1,121 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loaded_keys.h"
+
+#if CFG_KM_MAX_LOADED_KEYS < 1
+#error "CFG_KM_MAX_LOADED_KEYS must be at least 1"
+#endif
+
+keymaster_session_t *TA_create_session(void)
+{
+	return TEE_Malloc(sizeof(keymaster_session_t), TEE_MALLOC_FILL_ZERO);
+}
+
+void TA_destroy_session(keymaster_session_t *session)
+{
+	keymaster_loaded_key_t *loaded = NULL;
+
+	if (!session)
+		return;
+	while (session->loaded) {
+		loaded = session->loaded;
+		session->loaded = loaded->next;
+		TA_put_key(loaded->key);
+		TEE_Free(loaded);
+	}
+	TEE_Free(session);
+}
+
+static keymaster_loaded_key_t **TA_find_loaded_key(
+					keymaster_session_t *session,
+					const uint64_t handle)
+{
+	keymaster_loaded_key_t **loaded = &session->loaded;
+
+	while (*loaded && (*loaded)->handle != handle)
+		loaded = &(*loaded)->next;
+	return loaded;
+}
+
+keymaster_error_t TA_load_key(keymaster_session_t *session,
+			      const keymaster_key_blob_t *key_blob,
+			      uint64_t *handle)
+{
+	keymaster_loaded_key_t *loaded = NULL;
+	keymaster_error_t res = KM_ERROR_OK;
+
+	if (session->loaded_count >= CFG_KM_MAX_LOADED_KEYS) {
+		EMSG("Session has too many loaded keys");
+		return KM_ERROR_TOO_MANY_OPERATIONS;
+	}
+	loaded = TEE_Malloc(sizeof(keymaster_loaded_key_t),
+			    TEE_MALLOC_FILL_ZERO);
+	if (!loaded) {
+		EMSG("Failed to allocate memory for loaded key");
+		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+	}
+	res = TA_get_key(key_blob, &loaded->key);
+	if (res != KM_ERROR_OK) {
+		TEE_Free(loaded);
+		return res;
+	}
+	/* 0 is never handed out, it is what a zeroed request carries */
+	do {
+		TEE_GenerateRandom(&loaded->handle, sizeof(loaded->handle));
+	} while (loaded->handle == 0 ||
+		 *TA_find_loaded_key(session, loaded->handle));
+
+	loaded->next = session->loaded;
+	session->loaded = loaded;
+	session->loaded_count++;
+	*handle = loaded->handle;
+	return KM_ERROR_OK;
+}
+
+keymaster_error_t TA_unload_key(keymaster_session_t *session,
+				const uint64_t handle)
+{
+	keymaster_loaded_key_t **link = TA_find_loaded_key(session, handle);
+	keymaster_loaded_key_t *loaded = *link;
+
+	if (!loaded) {
+		EMSG("Key handle is not loaded in this session");
+		return KM_ERROR_INVALID_KEY_BLOB;
+	}
+	*link = loaded->next;
+	session->loaded_count--;
+	TA_put_key(loaded->key);
+	TEE_Free(loaded);
+	return KM_ERROR_OK;
+}
+
+keymaster_error_t TA_get_loaded_key(keymaster_session_t *session,
+				    const uint64_t handle,
+				    keymaster_cached_key_t **key)
+{
+	keymaster_loaded_key_t *loaded = *TA_find_loaded_key(session, handle);
+
+	*key = NULL;
+	if (!loaded) {
+		EMSG("Key handle is not loaded in this session");
+		return KM_ERROR_INVALID_KEY_BLOB;
+	}
+	TA_hold_key(loaded->key);
+	*key = loaded->key;
+	return KM_ERROR_OK;
+}
@@ -145,84 +145,108 @@ error:
 	return res;
 }
 
-TEE_Result TA_execute(uint8_t *data, const size_t size, const uint32_t mode)
+/*
+ * Blob encryption and decryption operations, set up with the master key on
+ * first use and reset before every blob instead of being allocated again.
+ */
+static TEE_OperationHandle master_enc_op = TEE_HANDLE_NULL;
+static TEE_OperationHandle master_dec_op = TEE_HANDLE_NULL;
+
+static TEE_Result TA_get_master_op(const uint32_t mode, TEE_OperationHandle *op)
 {
-	uint8_t *outbuf = NULL;
-	uint32_t outbuf_size = size;
-	TEE_OperationHandle op = TEE_HANDLE_NULL;
+	TEE_OperationHandle *master_op = (mode == TEE_MODE_ENCRYPT) ?
+					&master_enc_op : &master_dec_op;
+	TEE_ObjectHandle secretKey = TEE_HANDLE_NULL;
 	TEE_ObjectInfo info;
 	TEE_Result res;
-	TEE_ObjectHandle secretKey = TEE_HANDLE_NULL;
-	uint8_t tag[TAG_LENGTH];
-	uint32_t tagLen = TAG_LENGTH;
 
-	DMSG("%s %d size = %zu", __func__, __LINE__, size);
+	if (*master_op != TEE_HANDLE_NULL) {
+		TEE_ResetOperation(*master_op);
+		*op = *master_op;
+		return TEE_SUCCESS;
+	}
+
 	res = TA_open_secret_key(&secretKey);
-	if (res != KM_ERROR_OK) {
+	if (res != TEE_SUCCESS) {
 		EMSG("Failed to read secret key");
-		goto exit;
-	}
-	outbuf = TEE_Malloc(size, TEE_MALLOC_FILL_ZERO);
-	if (!outbuf) {
-		EMSG("failed to allocate memory for out buffer");
-		res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto exit;
+		return res;
 	}
 	TEE_GetObjectInfo1(secretKey, &info);
 
-	res = TEE_AllocateOperation(&op, TEE_ALG_AES_GCM, mode, info.maxKeySize);
+	res = TEE_AllocateOperation(master_op, TEE_ALG_AES_GCM, mode,
+				    info.maxKeySize);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to allocate AES operation, res=%x", res);
-		goto exit;
+		*master_op = TEE_HANDLE_NULL;
+		return res;
 	}
 
 	//Use persistent key objects
-	res = TEE_SetOperationKey(op, secretKey);
+	res = TEE_SetOperationKey(*master_op, secretKey);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to set secret key, res=%x", res);
-		goto free_op;
+		TEE_FreeOperation(*master_op);
+		*master_op = TEE_HANDLE_NULL;
+		return res;
 	}
-	TEE_AEInit(op, iv, sizeof(iv), TAG_LENGTH * BITS_IN_BYTE, 0, 0);
-	if (res == TEE_SUCCESS && size > 0) {
-		if (mode == TEE_MODE_ENCRYPT) {
-			DMSG("tagLen = %u", tagLen);
-			res = TEE_AEEncryptFinal(op, data, size - TAG_LENGTH,
-					outbuf, &outbuf_size,
-					(void *)&tag, &tagLen);
-			DMSG("tagLen = %u", tagLen);
-		}
-		else {
-			res = TEE_AEDecryptFinal(op, data, size - TAG_LENGTH,
-					outbuf, &outbuf_size,
-					(void *)(data + size - TAG_LENGTH), TAG_LENGTH);
-		}
+	*op = *master_op;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Encrypts or decrypts a key blob of size bytes, the last TAG_LENGTH of them
+ * being the GCM tag. in and out may be the same buffer.
+ */
+TEE_Result TA_execute(const uint8_t *in, uint8_t *out, const size_t size,
+		      const uint32_t mode)
+{
+	uint32_t out_size = size - TAG_LENGTH;
+	uint32_t tagLen = TAG_LENGTH;
+	TEE_OperationHandle op = TEE_HANDLE_NULL;
+	TEE_Result res;
+
+	DMSG("%s %d size = %zu", __func__, __LINE__, size);
+	if (size < TAG_LENGTH) {
+		EMSG("Blob is shorter than its tag");
+		return TEE_ERROR_BAD_PARAMETERS;
 	}
+	res = TA_get_master_op(mode, &op);
 	if (res != TEE_SUCCESS)
-		EMSG("Error TEE_AEFinal res=%x", res);
+		return res;
+
+	TEE_AEInit(op, iv, sizeof(iv), TAG_LENGTH * BITS_IN_BYTE, 0, 0);
+	if (mode == TEE_MODE_ENCRYPT) {
+		res = TEE_AEEncryptFinal(op, in, size - TAG_LENGTH,
+				out, &out_size,
+				out + size - TAG_LENGTH, &tagLen);
+		DMSG("tagLen = %u", tagLen);
+	}
 	else {
-		TEE_MemMove(data, outbuf, size - TAG_LENGTH);
-		if (mode == TEE_MODE_ENCRYPT)
-			TEE_MemMove(data + size - TAG_LENGTH, tag, TAG_LENGTH);
+		res = TEE_AEDecryptFinal(op, in, size - TAG_LENGTH,
+				out, &out_size,
+				(void *)(in + size - TAG_LENGTH), TAG_LENGTH);
 	}
-free_op:
-	if (op != TEE_HANDLE_NULL)
-		TEE_FreeOperation(op);
-exit:
-	if (outbuf != NULL)
-		TEE_Free(outbuf);
+	if (res != TEE_SUCCESS)
+		EMSG("Error TEE_AEFinal res=%x", res);
 	return res;
 }
 
 TEE_Result TA_encrypt(uint8_t *data, const size_t size)
 {
 	DMSG("%s %d", __func__, __LINE__);
-	return TA_execute(data, size, TEE_MODE_ENCRYPT);
+	return TA_execute(data, data, size, TEE_MODE_ENCRYPT);
 }
 
 TEE_Result TA_decrypt(uint8_t *data, const size_t size)
 {
 	DMSG("%s %d", __func__, __LINE__);
-	return TA_execute(data, size, TEE_MODE_DECRYPT);
+	return TA_execute(data, data, size, TEE_MODE_DECRYPT);
+}
+
+TEE_Result TA_decrypt_to(uint8_t *out, const uint8_t *in, const size_t size)
+{
+	DMSG("%s %d", __func__, __LINE__);
+	return TA_execute(in, out, size, TEE_MODE_DECRYPT);
 }
 
 void TA_free_master_key(void)
@@ -230,6 +254,14 @@ void TA_free_master_key(void)
 	TEE_ObjectHandle secretKey = TEE_HANDLE_NULL;
 
 	DMSG("%s %d", __func__, __LINE__);
+	if (master_enc_op != TEE_HANDLE_NULL) {
+		TEE_FreeOperation(master_enc_op);
+		master_enc_op = TEE_HANDLE_NULL;
+	}
+	if (master_dec_op != TEE_HANDLE_NULL) {
+		TEE_FreeOperation(master_dec_op);
+		master_dec_op = TEE_HANDLE_NULL;
+	}
 	if (TA_open_secret_key(&secretKey) == TEE_SUCCESS) {
 		TEE_FreeTransientObject(secretKey);
 	}
@@ -17,137 +17,295 @@
 
 #include "operations.h"
 #include "parameters.h"
+#include "user_ta_header_defines.h"
+
+/*
+ * Heap an active operation uses besides its nonce, buffered input and key:
+ * last block, tag buffer and handle allocations. What all active
+ * operations hold, their keys included, is kept within KM_OPERATION_HEAP
+ * when they are started. A key is charged once however many operations
+ * use it, also after it is evicted from the key cache.
+ */
+#define KM_OPERATION_OVERHEAD 512
+#define KM_OPERATION_HEAP (TA_DATA_SIZE / 2)
+
+/* First allocation for buffered sign/verify data, doubled as it grows */
+#define KM_SF_MIN_CAPACITY 64U
+
+#if KM_MAX_OPERATION < 1 || KM_MAX_OPERATION > 512
+#error "CFG_KM_MAX_OPERATION must be in range 1..512"
+#endif
+#if KM_MAX_OPERATION * KM_OPERATION_OVERHEAD > KM_OPERATION_HEAP
+#error "CFG_KM_MAX_OPERATION is too big for TA_DATA_SIZE"
+#endif
 
 static keymaster_operation_t operations[KM_MAX_OPERATION];
+/*
+ * Open-addressed (linear probing) index from operation handle to slot
+ * number in operations[], UNDEFINED marks an empty position. Free slots
+ * are chained through op_next_free starting from op_free_head.
+ */
+static uint32_t op_index[KM_OP_INDEX_SIZE];
+static uint32_t op_next_free[KM_MAX_OPERATION];
+static uint32_t op_free_head = UNDEFINED;
+/* Active slots ordered by last access, least recently used first */
+static uint32_t op_lru_head = UNDEFINED;
+static uint32_t op_lru_tail = UNDEFINED;
+/* Sum of footprint of active slots */
+static uint32_t op_heap_used;
+
+static void TA_op_lru_unlink(const uint32_t slot)
+{
+	keymaster_operation_t *op = &operations[slot];
+
+	if (op->lru_prev != UNDEFINED)
+		operations[op->lru_prev].lru_next = op->lru_next;
+	else
+		op_lru_head = op->lru_next;
+	if (op->lru_next != UNDEFINED)
+		operations[op->lru_next].lru_prev = op->lru_prev;
+	else
+		op_lru_tail = op->lru_prev;
+	op->lru_prev = UNDEFINED;
+	op->lru_next = UNDEFINED;
+}
+
+/* Marks slot as the most recently used one */
+static void TA_op_lru_touch(const uint32_t slot)
+{
+	keymaster_operation_t *op = &operations[slot];
+
+	TEE_GetSystemTime(&op->last_access);
+	if (op_lru_tail == slot)
+		return;
+	if (op->lru_prev != UNDEFINED || op_lru_head == slot)
+		TA_op_lru_unlink(slot);
+	op->lru_prev = op_lru_tail;
+	op->lru_next = UNDEFINED;
+	if (op_lru_tail != UNDEFINED)
+		operations[op_lru_tail].lru_next = slot;
+	else
+		op_lru_head = slot;
+	op_lru_tail = slot;
+}
+
+static uint32_t TA_op_hash(const keymaster_operation_handle_t op_handle)
+{
+	/* handles are random, folding both halves is enough */
+	return (uint32_t)(op_handle ^ (op_handle >> 32)) &
+						(KM_OP_INDEX_SIZE - 1);
+}
 
-void TA_free_blob_list(keymaster_blob_list_item_t *item)
+/* Returns position of op_handle in op_index or UNDEFINED */
+static uint32_t TA_op_index_find(const keymaster_operation_handle_t op_handle)
 {
-	keymaster_blob_list_item_t *prev;
-
-	while (item != NULL) {
-		if (item->data.data)
-			TEE_Free(item->data.data);
-		prev = item;
-		item = item->next;
-		TEE_Free(prev);
+	uint32_t pos = TA_op_hash(op_handle);
+
+	for (uint32_t n = 0; n < KM_OP_INDEX_SIZE; n++) {
+		if (op_index[pos] == UNDEFINED)
+			break;
+		if (operations[op_index[pos]].op_handle == op_handle)
+			return pos;
+		pos = (pos + 1) & (KM_OP_INDEX_SIZE - 1);
 	}
+	return UNDEFINED;
 }
 
-keymaster_error_t TA_abort_operation(
-	const keymaster_operation_handle_t op_handle)
+static void TA_op_index_insert(const keymaster_operation_handle_t op_handle,
+			       const uint32_t slot)
 {
-	keymaster_error_t res = KM_ERROR_INVALID_OPERATION_HANDLE;
+	uint32_t pos = TA_op_hash(op_handle);
 
-	for (uint32_t i = 0; i < KM_MAX_OPERATION; i++) {
-		if (op_handle == operations[i].op_handle) {
-			res = KM_ERROR_OK;
-			if (operations[i].min_sec != UNDEFINED) {
-				TA_trigger_timer(operations[i].key_id);
-			}
-			operations[i].op_handle = UNDEFINED;
-			if (operations[i].key != NULL) {
-				if (operations[i].key->key_material)
-					TEE_Free(operations[i].key->
-							key_material);
-				TEE_Free(operations[i].key);
-			}
-			operations[i].key = NULL;
-			operations[i].last_access = NULL;
-			operations[i].min_sec = UNDEFINED;
-			if (*operations[i].operation != TEE_HANDLE_NULL)
-				TEE_FreeOperation(*operations[i].operation);
-			TEE_Free(operations[i].operation);
-			operations[i].operation = TEE_HANDLE_NULL;
-			operations[i].purpose = UNDEFINED;
-			operations[i].do_auth = false;
-			if (*operations[i].digest_op != TEE_HANDLE_NULL)
-				TEE_FreeOperation(*operations[i].digest_op);
-			TEE_Free(operations[i].digest_op);
-			operations[i].padding = UNDEFINED;
-			operations[i].mode = UNDEFINED;
-			operations[i].got_input = false;
-			if (operations[i].sf_item)
-				TA_free_blob_list(operations[i].sf_item);
-			operations[i].sf_item = NULL;
-			operations[i].mac_length = UNDEFINED;
-			operations[i].digestLength = UNDEFINED;
-			if (operations[i].a_data)
-				TEE_Free(operations[i].a_data);
-			operations[i].a_data = NULL;
-			operations[i].a_data_length = 0;
-			operations[i].buffering = false;
-			operations[i].prev_in_size = UNDEFINED;
-			if (operations[i].nonce.data)
-				TEE_Free(operations[i].nonce.data);
-			operations[i].nonce.data = NULL;
-			operations[i].nonce.data_length = 0;
-			operations[i].padded = false;
-			operations[i].first = true;
-			if (operations[i].last_block.data)
-				TEE_Free(operations[i].last_block.data);
-			operations[i].last_block.data = NULL;
-			operations[i].last_block.data_length = 0;
-			TEE_MemFill(operations[i].key_id, 0,
-				    sizeof(operations[i].key_id));
+	/* index is larger than operations[], so a free position exists */
+	while (op_index[pos] != UNDEFINED)
+		pos = (pos + 1) & (KM_OP_INDEX_SIZE - 1);
+	op_index[pos] = slot;
+}
+
+static void TA_op_index_remove(uint32_t pos)
+{
+	uint32_t next = pos;
+	uint32_t home;
+
+	/* backward shift deletion keeps probe chains intact without tombstones */
+	op_index[pos] = UNDEFINED;
+	for (;;) {
+		next = (next + 1) & (KM_OP_INDEX_SIZE - 1);
+		if (op_index[next] == UNDEFINED)
 			break;
+		home = TA_op_hash(operations[op_index[next]].op_handle);
+		if (((next - home) & (KM_OP_INDEX_SIZE - 1)) >=
+				((next - pos) & (KM_OP_INDEX_SIZE - 1))) {
+			op_index[pos] = op_index[next];
+			op_index[next] = UNDEFINED;
+			pos = next;
 		}
 	}
-	return res;
+}
+
+void TA_clear_operation(keymaster_operation_t *op)
+{
+	op->op_handle = UNDEFINED;
+	op->key = NULL;
+	op->last_access.seconds = 0;
+	op->last_access.millis = 0;
+	op->lru_prev = UNDEFINED;
+	op->lru_next = UNDEFINED;
+	op->footprint = 0;
+	op->min_sec = UNDEFINED;
+	op->operation = TEE_HANDLE_NULL;
+	op->purpose = UNDEFINED;
+	op->do_auth = false;
+	TEE_MemFill(&op->auth, 0, sizeof(op->auth));
+	op->digest_op = TEE_HANDLE_NULL;
+	op->padding = UNDEFINED;
+	op->mode = UNDEFINED;
+	op->got_input = false;
+	op->sf_data.data = NULL;
+	op->sf_data.data_length = 0;
+	op->sf_capacity = 0;
+	op->sf_limit = 0;
+	op->mac_length = UNDEFINED;
+	op->digestLength = UNDEFINED;
+	op->a_data = NULL;
+	op->a_data_length = 0;
+	op->buffering = false;
+	op->prev_in_size = UNDEFINED;
+	op->nonce.data = NULL;
+	op->nonce.data_length = 0;
+	op->last_block.data = NULL;
+	op->last_block.data_length = 0;
+	op->first = true;
+	op->padded = false;
+	TEE_MemFill(op->key_id, 0, sizeof(op->key_id));
+}
+
+void TA_release_operation(keymaster_operation_t *op)
+{
+	TA_put_key(op->key);
+	if (op->operation) {
+		if (*op->operation != TEE_HANDLE_NULL)
+			TEE_FreeOperation(*op->operation);
+		TEE_Free(op->operation);
+	}
+	if (op->digest_op) {
+		if (*op->digest_op != TEE_HANDLE_NULL)
+			TEE_FreeOperation(*op->digest_op);
+		TEE_Free(op->digest_op);
+	}
+	if (op->sf_data.data)
+		TEE_Free(op->sf_data.data);
+	if (op->a_data)
+		TEE_Free(op->a_data);
+	if (op->nonce.data)
+		TEE_Free(op->nonce.data);
+	if (op->last_block.data)
+		TEE_Free(op->last_block.data);
+	TA_clear_operation(op);
+}
+
+keymaster_error_t TA_abort_operation(
+	const keymaster_operation_handle_t op_handle)
+{
+	keymaster_operation_t *op;
+	uint32_t pos = TA_op_index_find(op_handle);
+	uint32_t slot;
+
+	if (pos == UNDEFINED)
+		return KM_ERROR_INVALID_OPERATION_HANDLE;
+	slot = op_index[pos];
+	TA_op_index_remove(pos);
+	TA_op_lru_unlink(slot);
+	op = &operations[slot];
+	op_heap_used -= op->footprint;
+	if (--op->key->ops == 0)
+		op_heap_used -= op->key->cost;
+	if (op->min_sec != UNDEFINED) {
+		TA_trigger_timer(op->key_id);
+	}
+	TA_release_operation(op);
+	op_next_free[slot] = op_free_head;
+	op_free_head = slot;
+	return KM_ERROR_OK;
 }
 
 void TA_reset_operations_table(void)
 {
 	for (uint32_t i = 0; i < KM_MAX_OPERATION; i++) {
-		operations[i].op_handle = UNDEFINED;
-		operations[i].key = NULL;
-		operations[i].last_access = NULL;
-		operations[i].min_sec = UNDEFINED;
-		operations[i].operation = TEE_HANDLE_NULL;
-		operations[i].purpose = UNDEFINED;
-		operations[i].do_auth = false;
-		operations[i].digest_op = TEE_HANDLE_NULL;
-		operations[i].padding = UNDEFINED;
-		operations[i].mode = UNDEFINED;
-		operations[i].got_input = false;
-		operations[i].sf_item = NULL;
-		operations[i].mac_length = UNDEFINED;
-		operations[i].digestLength = UNDEFINED;
-		operations[i].a_data = NULL;
-		operations[i].a_data_length = 0;
-		operations[i].buffering = false;
-		operations[i].prev_in_size = UNDEFINED;
-		operations[i].nonce.data = NULL;
-		operations[i].nonce.data_length = 0;
-		operations[i].last_block.data = NULL;
-		operations[i].last_block.data_length = 0;
-		operations[i].first = true;
-		operations[i].padded = false;
-		TEE_MemFill(operations[i].key_id, 0,
-			    sizeof(operations[i].key_id));
+		TA_clear_operation(&operations[i]);
+		op_next_free[i] = i + 1 < KM_MAX_OPERATION ? i + 1 : UNDEFINED;
 	}
+	for (uint32_t i = 0; i < KM_OP_INDEX_SIZE; i++)
+		op_index[i] = UNDEFINED;
+	op_free_head = 0;
+	op_lru_head = UNDEFINED;
+	op_lru_tail = UNDEFINED;
+	op_heap_used = 0;
 }
 
 keymaster_error_t TA_kill_old_operation(void)
 {
-	keymaster_operation_t oldest;
-
-	oldest = operations[0];
-	for (uint32_t i = 1; i < KM_MAX_OPERATION; i++) {
-		if (oldest.last_access->seconds >
-				operations[i].last_access->seconds ||
-				(oldest.last_access->seconds ==
-				operations[i].last_access->seconds &&
-				oldest.last_access->millis >
-				operations[i].last_access->millis)) {
-			oldest = operations[i];
-		}
+	if (op_lru_head == UNDEFINED)
+		return KM_ERROR_TOO_MANY_OPERATIONS;
+	DMSG("Evict operation last used at %u.%03u",
+	     operations[op_lru_head].last_access.seconds,
+	     operations[op_lru_head].last_access.millis);
+	return TA_abort_operation(operations[op_lru_head].op_handle);
+}
+
+keymaster_error_t TA_fill_operation(keymaster_operation_t *op,
+				keymaster_cached_key_t *key,
+				const uint32_t min_sec,
+				TEE_OperationHandle *operation,
+				const keymaster_purpose_t purpose,
+				TEE_OperationHandle *digest_op,
+				const bool do_auth,
+				const keymaster_padding_t padding,
+				const keymaster_block_mode_t mode,
+				const uint32_t mac_length,
+				const keymaster_digest_t digest,
+				const keymaster_blob_t nonce,
+				uint8_t *key_id)
+{
+	TA_clear_operation(op);
+	op->nonce.data = TEE_Malloc(nonce.data_length, TEE_MALLOC_FILL_ZERO);
+	if (!op->nonce.data) {
+		EMSG("Failed to allocate memory for nonce");
+		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 	}
-	return TA_abort_operation(oldest.op_handle);
+	TEE_MemMove(op->nonce.data, nonce.data, nonce.data_length);
+	op->nonce.data_length = nonce.data_length;
+	op->min_sec = min_sec;
+	op->operation = operation;
+	op->purpose = purpose;
+	op->do_auth = do_auth;
+	op->digest_op = digest_op;
+	op->mac_length = mac_length;
+	op->padding = padding;
+	op->mode = mode;
+	op->digestLength = get_digest_size(&digest) / 8; /*in bytes*/
+	/*
+	 * Reference to the restored key is owned by the operation from now
+	 * on and put in TA_release_operation, so update and finish don't
+	 * need to decrypt the key blob again.
+	 */
+	op->key = key;
+	op->sf_limit = (key->key_size + 7) / 8;
+	memcpy(op->key_id, key_id, sizeof(op->key_id));
+	return KM_ERROR_OK;
+}
+
+/* Heap an operation on key holds, the key itself aside */
+static uint64_t TA_operation_footprint(const keymaster_cached_key_t *key,
+				       const keymaster_blob_t *nonce)
+{
+	return (uint64_t)KM_OPERATION_OVERHEAD + nonce->data_length +
+	       (key->key_size + 7) / 8;
 }
 
 keymaster_error_t TA_try_start_operation(
 				const keymaster_operation_handle_t op_handle,
-				const keymaster_key_blob_t key,
+				keymaster_cached_key_t *key,
 				const uint32_t min_sec,
 				TEE_OperationHandle *operation,
 				const keymaster_purpose_t purpose,
@@ -160,67 +318,36 @@ keymaster_error_t TA_try_start_operation(
 				const keymaster_blob_t nonce,
 				uint8_t *key_id)
 {
-	TEE_Time cur_t;
+	keymaster_error_t res;
+	uint32_t slot = op_free_head;
+	uint64_t footprint = TA_operation_footprint(key, &nonce);
+	/* only the first operation on the key pays for it */
+	uint64_t charge = key->ops ? 0 : key->cost;
 
-	for (uint32_t i = 0; i < KM_MAX_OPERATION; i++) {
-		if (operations[i].op_handle == UNDEFINED) {
-			TEE_GetSystemTime(&cur_t);
-			/* freed when operation aborted (TA_abort_operation) */
-			operations[i].key = TEE_Malloc(
-					sizeof(keymaster_key_blob_t),
-					TEE_MALLOC_FILL_ZERO);
-			if (!operations[i].key) {
-				EMSG("Failed to allocate memory for operation key struct");
-				return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-			}
-			operations[i].key->key_material_size =
-							key.key_material_size;
-			/* freed when operation aborted (TA_abort_operation) */
-			operations[i].key->key_material = TEE_Malloc(
-						key.key_material_size,
-						TEE_MALLOC_FILL_ZERO);
-			if (!operations[i].key->key_material) {
-				EMSG("Failed to allocate memory for operation key data");
-				TEE_Free(operations[i].key);
-				return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-			}
-			TEE_MemMove(operations[i].key->key_material,
-						key.key_material,
-						key.key_material_size);
-			operations[i].last_access = &cur_t;
-			operations[i].min_sec = min_sec;
-			operations[i].operation = operation;
-			operations[i].purpose = purpose;
-			operations[i].do_auth = do_auth;
-			operations[i].digest_op = digest_op;
-			operations[i].mac_length = mac_length;
-			operations[i].padding = padding;
-			operations[i].mode = mode;
-			operations[i].digestLength = get_digest_size(&digest) / 8; /*in bytes*/
-			operations[i].nonce.data = TEE_Malloc(
-						nonce.data_length,
-						TEE_MALLOC_FILL_ZERO);
-			if (!operations[i].nonce.data) {
-				EMSG("Failed to allocate memory for nonce");
-				TEE_Free(operations[i].key->key_material);
-				TEE_Free(operations[i].key);
-				return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-			}
-			TEE_MemMove(operations[i].nonce.data,
-					nonce.data, nonce.data_length);
-			operations[i].nonce.data_length = nonce.data_length;
-			operations[i].op_handle = op_handle;
-			memcpy(operations[i].key_id, key_id,
-					sizeof(operations[i].key_id));
-			return KM_ERROR_OK;
-		}
-	}
-	return KM_ERROR_TOO_MANY_OPERATIONS;
+	if (slot == UNDEFINED ||
+	    footprint + charge > KM_OPERATION_HEAP - op_heap_used)
+		return KM_ERROR_TOO_MANY_OPERATIONS;
+	res = TA_fill_operation(&operations[slot], key, min_sec, operation,
+				purpose, digest_op, do_auth, padding, mode,
+				mac_length, digest, nonce, key_id);
+	if (res != KM_ERROR_OK)
+		return res;
+	operations[slot].op_handle = op_handle;
+	operations[slot].footprint = (uint32_t)footprint;
+	op_heap_used += (uint32_t)(footprint + charge);
+	key->ops++;
+
+	op_free_head = op_next_free[slot];
+	op_next_free[slot] = UNDEFINED;
+	TA_op_index_insert(op_handle, slot);
+	TA_op_lru_touch(slot);
+	return KM_ERROR_OK;
 }
 
 keymaster_error_t TA_start_operation(
 				const keymaster_operation_handle_t op_handle,
-				const keymaster_key_blob_t key, uint32_t min_sec,
+				keymaster_cached_key_t *key,
+				const uint32_t min_sec,
 				TEE_OperationHandle *operation,
 				const keymaster_purpose_t purpose,
 				TEE_OperationHandle *digest_op,
@@ -232,105 +359,96 @@ keymaster_error_t TA_start_operation(
 				const keymaster_blob_t nonce,
 				uint8_t *key_id)
 {
-	keymaster_error_t res = TA_try_start_operation(op_handle, key, min_sec,
-						       operation, purpose,
-						       digest_op, do_auth,
-						       padding, mode,
-						       mac_length, digest,
-						       nonce, key_id);
-	if (res != KM_ERROR_OK) {
-		res = TA_kill_old_operation();
-		if (res == KM_ERROR_OK) {
-			res = TA_try_start_operation(op_handle, key, min_sec,
-						     operation, purpose,
-						     digest_op, do_auth,
-						     padding, mode,
-						     mac_length, digest,
-						     nonce, key_id);
-		}
+	bool retried = false;
+	keymaster_error_t res;
+
+	/* no use evicting anything for what can't fit on its own */
+	if (TA_operation_footprint(key, &nonce) + key->cost >
+	    KM_OPERATION_HEAP) {
+		EMSG("Operation is too big for the operation heap");
+		return KM_ERROR_TOO_MANY_OPERATIONS;
 	}
-	return res;
-}
 
-keymaster_error_t TA_get_operation(const keymaster_operation_handle_t op_handle,
-					keymaster_operation_t *operation)
-{
-	keymaster_error_t res = KM_ERROR_INVALID_OPERATION_HANDLE;
-	TEE_Time cur_t;
+	res = TA_try_start_operation(op_handle, key, min_sec, operation,
+				     purpose, digest_op, do_auth, padding,
+				     mode, mac_length, digest, nonce, key_id);
 
-	for (uint32_t i = 0; i < KM_MAX_OPERATION; i++) {
-		if (op_handle == operations[i].op_handle) {
-			TEE_GetSystemTime(&cur_t);
-			operations[i].last_access = &cur_t;
-			res = KM_ERROR_OK;
-			*operation = operations[i];
+	/* a big operation may need several old ones to make room */
+	while (res != KM_ERROR_OK &&
+	       (res == KM_ERROR_TOO_MANY_OPERATIONS || !retried)) {
+		retried = true;
+		res = TA_kill_old_operation();
+		if (res != KM_ERROR_OK)
 			break;
-		}
+		res = TA_try_start_operation(op_handle, key, min_sec,
+					     operation, purpose, digest_op,
+					     do_auth, padding, mode,
+					     mac_length, digest, nonce,
+					     key_id);
 	}
 	return res;
 }
 
-keymaster_error_t TA_update_operation(keymaster_operation_handle_t op_handle,
-					keymaster_operation_t *operation)
+keymaster_error_t TA_get_operation(const keymaster_operation_handle_t op_handle,
+					keymaster_operation_t **operation)
 {
-	keymaster_error_t res = KM_ERROR_INVALID_OPERATION_HANDLE;
+	uint32_t pos = TA_op_index_find(op_handle);
 
-	for (uint32_t i = 0; i < KM_MAX_OPERATION; i++) {
-		if (op_handle == operations[i].op_handle) {
-			operations[i] = *operation;
-			break;
-		}
-	}
-	return res;
+	if (pos == UNDEFINED)
+		return KM_ERROR_INVALID_OPERATION_HANDLE;
+	TA_op_lru_touch(op_index[pos]);
+	*operation = &operations[op_index[pos]];
+	return KM_ERROR_OK;
 }
 
 keymaster_error_t TA_store_sf_data(const keymaster_blob_t *input,
 					keymaster_operation_t *operation)
 {
-	keymaster_blob_list_item_t *new;
-	keymaster_blob_list_item_t *current = operation->sf_item;
-	/* freed when operation is aborted (TA_abort_operation) */
-	new = TEE_Malloc(sizeof(keymaster_blob_list_item_t),
-					TEE_MALLOC_FILL_ZERO);
-	if (!new) {
-		EMSG("Failed to allocate memory for buffered sign/veify data struct");
-		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-	}
-	new->next = NULL;
-	new->data.data_length = input->data_length;
-	/* freed when operation is aborted (TA_abort_operation) */
-	new->data.data = TEE_Malloc(new->data.data_length,
-						TEE_MALLOC_FILL_ZERO);
-	if (!new->data.data) {
-		EMSG("Failed to allocate memory for buffered sign/veify data");
-		TEE_Free(new);
-		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+	uint32_t len = input->data_length;
+	uint32_t room = operation->sf_limit - operation->sf_data.data_length;
+	uint32_t capacity = operation->sf_capacity;
+	uint8_t *buf;
+
+	if (len > room) {
+		if (operation->key->type != TEE_TYPE_ECDSA_KEYPAIR) {
+			EMSG("Buffered sign/verify data exceeds key size");
+			return KM_ERROR_INVALID_INPUT_LENGTH;
+		}
+		/* EC data longer than the key is truncated on finish anyway */
+		len = room;
 	}
-	TEE_MemMove(new->data.data, input->data, input->data_length);
-	if (current == NULL) {
-		operation->sf_item = new;
-	} else {
-		while (current != NULL) {
-			if (current->next == NULL) {
-				current->next = new;
-				break;
-			}
-			current = current->next;
+	if (len == 0)
+		return KM_ERROR_OK;
+	if (operation->sf_data.data_length + len > capacity) {
+		if (capacity == 0)
+			capacity = KM_SF_MIN_CAPACITY;
+		while (capacity < operation->sf_data.data_length + len)
+			capacity *= 2;
+		if (capacity > operation->sf_limit)
+			capacity = operation->sf_limit;
+		/* freed when operation is aborted (TA_abort_operation) */
+		buf = TEE_Realloc(operation->sf_data.data, capacity);
+		if (!buf) {
+			EMSG("Failed to allocate memory for buffered sign/veify data");
+			return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 		}
+		operation->sf_data.data = buf;
+		operation->sf_capacity = capacity;
 	}
+	TEE_MemMove(operation->sf_data.data + operation->sf_data.data_length,
+		    input->data, len);
+	operation->sf_data.data_length += len;
 	return KM_ERROR_OK;
 }
 
 keymaster_error_t TA_append_sf_data(keymaster_blob_t *input,
-				const keymaster_operation_t *operation,
+				keymaster_operation_t *operation,
 				bool *is_input_ext)
 {
-	uint32_t size = 0;
-	uint32_t padding = 0;
+	keymaster_error_t res;
 	uint8_t *ptr = NULL;
-	keymaster_blob_list_item_t *current = operation->sf_item;
 
-	if (operation->sf_item == NULL) {
+	if (operation->sf_data.data_length == 0) {
 		if (!(*is_input_ext)) {
 			/*
 			 * In this case input is stack variable and we need to
@@ -348,30 +466,21 @@ keymaster_error_t TA_append_sf_data(keymaster_blob_t *input,
 		return KM_ERROR_OK;
 	}
 
-	while (current != NULL) {
-		size += current->data.data_length;
-		current = current->next;
-	}
-	/* Freed before input blob is destroyed */
-	ptr = TEE_Malloc(size + input->data_length, TEE_MALLOC_FILL_ZERO);
-	if (!ptr) {
-		EMSG("Failed to allocate memory on saved blocks append");
-		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-	}
-
-	current = operation->sf_item;
-	while (current != NULL) {
-		TEE_MemMove(ptr + padding, current->data.data,
-						current->data.data_length);
-		padding += current->data.data_length;
-		current = current->next;
-	}
-	TEE_MemMove(ptr + padding, input->data, input->data_length);
+	res = TA_store_sf_data(input, operation);
+	if (res != KM_ERROR_OK)
+		return res;
+	/*
+	 * Hand the buffer over to the input blob, so finish works on the
+	 * stored data in place. It's freed together with the input.
+	 */
 	if (*is_input_ext)
 		TEE_Free(input->data);
-	input->data = ptr;
-	input->data_length = size + input->data_length;
+	input->data = operation->sf_data.data;
+	input->data_length = operation->sf_data.data_length;
 	*is_input_ext = true;
+	operation->sf_data.data = NULL;
+	operation->sf_data.data_length = 0;
+	operation->sf_capacity = 0;
 	return KM_ERROR_OK;
 }
 
@@ -17,44 +17,56 @@
 
 #include "paddings.h"
 
-bool TA_check_pkcs7_pad(keymaster_blob_t *output)
+/*
+ * Output may be a region shared with the normal world, so the pad value is
+ * read once by the caller and only that copy is checked and used
+ */
+static bool TA_pkcs7_pad_valid(const keymaster_blob_t *output,
+			       const uint8_t pad)
 {
 	uint32_t last_i;
-	uint8_t pad;
 
-	if (output->data == NULL || output->data_length == 0 ||
-			output->data_length < BLOCK_SIZE ||
-			output->data_length % BLOCK_SIZE != 0)
+	if (pad == 0 || pad > BLOCK_SIZE)
 		return false;
 	last_i = output->data_length - 1;
-	pad = output->data[last_i];
-	if (pad > BLOCK_SIZE || pad > output->data_length)
-		return false;
-	for (uint32_t i = 0; i < pad; i++) {
+	for (uint32_t i = 1; i < pad; i++) {
 		if (output->data[last_i - i] != pad)
 			return false;
 	}
 	return true;
 }
 
+bool TA_check_pkcs7_pad(keymaster_blob_t *output)
+{
+	if (output->data == NULL || output->data_length == 0 ||
+			output->data_length < BLOCK_SIZE ||
+			output->data_length % BLOCK_SIZE != 0)
+		return false;
+	return TA_pkcs7_pad_valid(output,
+				  output->data[output->data_length - 1]);
+}
+
 keymaster_error_t TA_check_out_size(const uint32_t input_l,
 					keymaster_blob_t *output,
 					uint32_t *out_size,
 					uint32_t tag_len)
 {
 	uint8_t *ptr = NULL;
-
-	/* Recalculate output size */
-	if (*out_size != (((input_l + BLOCK_SIZE - 1) / BLOCK_SIZE + 1)
-						* BLOCK_SIZE + tag_len)) {
-		*out_size = ((input_l + BLOCK_SIZE - 1) / BLOCK_SIZE + 1)
+	uint32_t needed = ((input_l + BLOCK_SIZE - 1) / BLOCK_SIZE + 1)
 							* BLOCK_SIZE + tag_len;
-		ptr = TEE_Realloc(output->data, *out_size);
+
+	/*
+	 * Only grow, output may be a caller provided region which is
+	 * already large enough and must not be moved
+	 */
+	if (*out_size < needed) {
+		ptr = TEE_Realloc(output->data, needed);
 		if (!ptr) {
 			EMSG("Failed reallocate memory for output");
 			return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 		}
 		output->data = ptr;
+		*out_size = needed;
 	}
 	return KM_ERROR_OK;
 }
@@ -98,8 +110,7 @@ keymaster_error_t TA_add_pkcs7_pad(keymaster_blob_t *input,
 keymaster_error_t TA_remove_pkcs7_pad(keymaster_blob_t *output,
 					uint32_t *out_size)
 {
-	uint32_t pad = 0;
-	uint8_t *data;
+	uint8_t pad = 0;
 
 	if (output == NULL) {
 		EMSG("Output is NULL");
@@ -107,19 +118,18 @@ keymaster_error_t TA_remove_pkcs7_pad(keymaster_blob_t *output,
 	}
 	if (output->data_length == 0)
 		return KM_ERROR_OK;
+	if (output->data == NULL || output->data_length < BLOCK_SIZE ||
+			output->data_length % BLOCK_SIZE != 0) {
+		EMSG("Failed to read PKCS7 padding");
+		return KM_ERROR_INVALID_ARGUMENT;
+	}
 	pad = output->data[output->data_length - 1];
 	DMSG("PKCS7 REMOVE pad = %x", pad);
-	if (!TA_check_pkcs7_pad(output)) {
+	if (!TA_pkcs7_pad_valid(output, pad)) {
 		EMSG("Failed to read PKCS7 padding");
 		return KM_ERROR_INVALID_ARGUMENT;
 	}
-	/* Freed before output blob is destroyed by caller */
-	data = TEE_Realloc(output->data, output->data_length - pad);
-	if (!data) {
-		EMSG("Failed to reallocate memory for unpudded out");
-		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-	}
-	output->data = data;
+	/* Buffer is kept as is, only the length shrinks */
 	output->data_length = output->data_length - pad;
 	*out_size = output->data_length;
 	return KM_ERROR_OK;
@@ -29,10 +29,10 @@ void TA_free_params(keymaster_key_param_set_t *params)
 		if (keymaster_tag_get_type(params->params[i].tag) == KM_BIGNUM
 				|| keymaster_tag_get_type(params->
 				params[i].tag) == KM_BYTES) {
-			TEE_Free(params->params[i].key_param.blob.data);
+			TA_arena_free(params->params[i].key_param.blob.data);
 		}
 	}
-	TEE_Free(params->params);
+	TA_arena_free(params->params);
 }
 
 void TA_free_cert_chain(keymaster_cert_chain_t *cert_chain)
@@ -280,21 +280,17 @@ keymaster_error_t TA_fill_characteristics(
 			uint32_t *size)
 {
 	DMSG("%s %d", __func__, __LINE__);
-	/* Freed before characteristics is destoyed by caller */
-	characteristics->hw_enforced.params = TEE_Malloc(
+	characteristics->hw_enforced.params = TA_arena_alloc(
 						MAX_ENFORCED_PARAMS_COUNT *
-						sizeof(keymaster_key_param_t),
-						TEE_MALLOC_FILL_ZERO);
+						sizeof(keymaster_key_param_t));
 	if (!characteristics->hw_enforced.params) {
 		EMSG("Failed to allocate memory for hw_enforced.params");
 		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 	}
 	characteristics->hw_enforced.length = 0;
-	/* Freed before characteristics is destoyed by caller */
-	characteristics->sw_enforced.params = TEE_Malloc(
+	characteristics->sw_enforced.params = TA_arena_alloc(
 						MAX_ENFORCED_PARAMS_COUNT *
-						sizeof(keymaster_key_param_t),
-						TEE_MALLOC_FILL_ZERO);
+						sizeof(keymaster_key_param_t));
 	if (!characteristics->sw_enforced.params) {
 		EMSG("Failed to allocate memory for sw_enforced.params");
 		return KM_ERROR_MEMORY_ALLOCATION_FAILED;
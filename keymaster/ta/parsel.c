@@ -189,9 +189,12 @@ static bool param_deserialize(keymaster_key_param_t *param, uint8_t **buf_ptr,
 		}
 		if ((indirect_base != NULL) &&
 		    (param->key_param.blob.data_length != 0)) {
-			/* Freed when caller destroys deserialized blob */
-			data = TEE_Malloc(param->key_param.blob.data_length,
-					  TEE_MALLOC_FILL_ZERO);
+			/*
+			 * Copied out of shared memory, the value is checked
+			 * and may be serialized into a key blob. Released
+			 * with the command arena.
+			 */
+			data = TA_arena_alloc(param->key_param.blob.data_length);
 			if (!data) {
 				EMSG("Failed to allocate memory for blob");
 				return false;
@@ -249,20 +252,14 @@ int TA_deserialize_auth_set(uint8_t *in, uint8_t *end,
 	in += SIZE_LENGTH_AKMS;
 
 	DMSG("indirect_data_size:%d", indirect_data_size);
-	/* Freed when deserialized blob is destroyed by caller */
-	indirect_base = TEE_Malloc(indirect_data_size, TEE_MALLOC_FILL_ZERO);
-	if (!indirect_base) {
-		EMSG("Failed to allocate memory for blob");
-		*res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-		goto out;
-	}
-	DMSG("indirect_base:%p", indirect_base);
 	if (TA_is_out_of_bounds(in, end, indirect_data_size)) {
 		EMSG("Out of input array bounds on deserialization");
 		*res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 		goto out;
 	}
-	TEE_MemMove(indirect_base, in, indirect_data_size);
+	/* blobs are copied out of the input memref by param_deserialize */
+	indirect_base = in;
+	DMSG("indirect_base:%p", indirect_base);
 	indirect_end = indirect_base + indirect_data_size;
 
 	in += indirect_data_size;
@@ -304,8 +301,8 @@ int TA_deserialize_auth_set(uint8_t *in, uint8_t *end,
 		*res = KM_ERROR_INVALID_INPUT_LENGTH;
 		goto out;
 	}
-	param_set->params = TEE_Malloc(num_params, TEE_MALLOC_FILL_ZERO);
-	/* Freed when deserialized params set is destroyed by caller */
+	param_set->params = TA_arena_alloc(num_params);
+	/* Released with the command arena */
 	if (!param_set->params) {
 		EMSG("Failed to allocate memory for params");
 		*res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -316,10 +313,6 @@ int TA_deserialize_auth_set(uint8_t *in, uint8_t *end,
 	}
 
 out:
-	/* free indirect_base, data malloc and copy in param_deserialize */
-	if (indirect_base)
-		TEE_Free(indirect_base);
-
 	return in - start;
 }
 
@@ -421,9 +414,8 @@ int TA_deserialize_key_blob_akms(uint8_t *in, uint8_t *end,
 		*res = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
 		return SIZE_LENGTH_AKMS;
 	}
-	/* Freed when deserialized key blob is destroyed by caller */
-	key_material = TEE_Malloc(key_blob->key_material_size,
-				  TEE_MALLOC_FILL_ZERO);
+	/* Released with the command arena */
+	key_material = TA_arena_alloc(key_blob->key_material_size);
 	if (!key_material) {
 		EMSG("Failed to allocate memory for key_material");
 		*res = KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -1,6 +1,9 @@
 global-incdirs-y += include
 srcs-y += keystore_ta.c
 srcs-y += operations.c
+srcs-y += key_cache.c
+srcs-y += loaded_keys.c
+srcs-y += arena.c
 srcs-y += tables.c
 srcs-y += parsel.c
 srcs-y += master_crypto.c
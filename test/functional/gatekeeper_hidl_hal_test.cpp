@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <android/hardware/gatekeeper/1.0/IGatekeeper.h>
+#include <gtest/gtest.h>
+#include <hidl/GtestPrinter.h>
+#include <hidl/ServiceManagement.h>
+
+/* Failure records the TA keeps in memory, CFG_GK_MAX_FAILURE_RECORDS */
+#define GK_MAX_FAILURE_RECORDS 32U
+/* Failures counted without a timeout, the next one is throttled */
+#define GK_FREE_FAILURES 4U
+#define GK_FAILURE_TIMEOUT_S 30U
+
+using ::android::sp;
+using ::android::hardware::hidl_vec;
+using ::std::string;
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace test {
+
+class GatekeeperTest : public ::testing::TestWithParam<std::string> {
+  public:
+
+    void SetUp() override {
+        gatekeeper_ = IGatekeeper::getService(GetParam());
+        ASSERT_NE(gatekeeper_, nullptr);
+    }
+
+    static hidl_vec<uint8_t> Password(const string& password) {
+        return std::vector<uint8_t>(password.begin(), password.end());
+    }
+
+    GatekeeperStatusCode Enroll(const string& password, hidl_vec<uint8_t>* handle) {
+        GatekeeperStatusCode code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+        EXPECT_TRUE(gatekeeper_
+                        ->enroll(kUid, hidl_vec<uint8_t>(), hidl_vec<uint8_t>(),
+                                 Password(password),
+                                 [&](const GatekeeperResponse& rsp) {
+                                     code = rsp.code;
+                                     *handle = rsp.data;
+                                 })
+                        .isOk());
+        return code;
+    }
+
+    GatekeeperStatusCode Verify(const hidl_vec<uint8_t>& handle, const string& password,
+                                uint32_t* timeout = nullptr) {
+        GatekeeperStatusCode code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+        EXPECT_TRUE(gatekeeper_
+                        ->verify(kUid, 0, handle, Password(password),
+                                 [&](const GatekeeperResponse& rsp) {
+                                     code = rsp.code;
+                                     if (timeout) *timeout = rsp.timeout;
+                                 })
+                        .isOk());
+        return code;
+    }
+
+    /* Counts failures without reaching a timeout */
+    void FailFreely(const hidl_vec<uint8_t>& handle) {
+        for (unsigned int i = 0; i < GK_FREE_FAILURES; i++)
+            ASSERT_EQ(GatekeeperStatusCode::ERROR_GENERAL_FAILURE, Verify(handle, "wrong"))
+                << "Failure #" << i + 1 << " should not be throttled";
+    }
+
+  private:
+    static const uint32_t kUid = 0;
+
+    sp<IGatekeeper> gatekeeper_;
+};
+
+TEST_P(GatekeeperTest, SuccessClearsFailures) {
+    hidl_vec<uint8_t> handle;
+
+    ASSERT_EQ(GatekeeperStatusCode::STATUS_OK, Enroll("password", &handle));
+
+    FailFreely(handle);
+    ASSERT_EQ(GatekeeperStatusCode::STATUS_OK, Verify(handle, "password"));
+    /* Counted again from zero, none of these is throttled */
+    FailFreely(handle);
+    ASSERT_EQ(GatekeeperStatusCode::STATUS_OK, Verify(handle, "password"));
+}
+
+/**
+ * Counts failures for more users than the TA keeps in memory, which pushes
+ * the first users out of its table and compacts the failure journal. Their
+ * failures have to be found again in the journal.
+ */
+TEST_P(GatekeeperTest, FailuresSurviveEviction) {
+    std::vector<hidl_vec<uint8_t>> handles(GK_MAX_FAILURE_RECORDS + 8);
+    uint32_t timeout = 0;
+
+    for (auto& handle : handles)
+        ASSERT_EQ(GatekeeperStatusCode::STATUS_OK, Enroll("password", &handle));
+    for (const auto& handle : handles)
+        FailFreely(handle);
+
+    /* The first user is long out of the table, this failure sets a timeout */
+    ASSERT_EQ(GatekeeperStatusCode::ERROR_GENERAL_FAILURE, Verify(handles[0], "wrong"));
+    ASSERT_EQ(GatekeeperStatusCode::ERROR_RETRY_TIMEOUT,
+              Verify(handles[0], "password", &timeout));
+    EXPECT_GT(timeout, 0U);
+    EXPECT_LE(timeout, GK_FAILURE_TIMEOUT_S * 1000);
+
+    /* Clear the others, the last ones from the table first */
+    for (size_t i = handles.size() - 1; i > 0; i--)
+        EXPECT_EQ(GatekeeperStatusCode::STATUS_OK, Verify(handles[i], "password"));
+
+    std::cout << "Sleeping for " << GK_FAILURE_TIMEOUT_S << " seconds\n";
+    sleep(GK_FAILURE_TIMEOUT_S + 1);
+    EXPECT_EQ(GatekeeperStatusCode::STATUS_OK, Verify(handles[0], "password"));
+}
+
+static const auto kGatekeeperDeviceChoices =
+        testing::ValuesIn(android::hardware::getAllHalInstanceNames(IGatekeeper::descriptor));
+
+GTEST_ALLOW_UNINSTANTIATED_PARAMETERIZED_TEST(GatekeeperTest);
+INSTANTIATE_TEST_SUITE_P(PerInstance, GatekeeperTest, kGatekeeperDeviceChoices,
+                         android::hardware::PrintInstanceNameToString);
+
+}  // namespace test
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
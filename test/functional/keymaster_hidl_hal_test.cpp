@@ -606,6 +606,227 @@ TEST_P(KeymasterTagTest, tag_MAX_USES_PER_BOOT) {
     ASSERT_EQ(ErrorCode::TOO_MANY_OPERATIONS, DefaultEcdsaSigningOperation(key_blobs[KM_MAX_USE_COUNTERS]));
 }
 
+class KeymasterOperationTest : public KeymasterTest {
+public:
+
+    /* Runs a whole operation, feeding the message to update in chunks of
+       chunk_size bytes, or only to finish if chunk_size is 0.*/
+    ErrorCode ProcessMessage(KeyPurpose purpose, const HidlBuf& key_blob,
+                             const AuthorizationSet& in_params, const string& message,
+                             size_t chunk_size, const string& signature, string* output) {
+        AuthorizationSet out_params;
+        OperationHandle op_handle;
+        size_t consumed = 0;
+
+        ErrorCode ret = Begin(purpose, key_blob, in_params, &out_params, &op_handle);
+        if (ret != ErrorCode::OK) return ret;
+
+        while (chunk_size && message.size() - consumed > chunk_size) {
+            AuthorizationSet update_params;
+            size_t input_consumed;
+
+            ret = Update(op_handle, AuthorizationSet(), message.substr(consumed, chunk_size),
+                         &update_params, output, &input_consumed);
+            if (ret != ErrorCode::OK) return ret;
+            if (input_consumed == 0) {
+                Abort(op_handle);
+                return ErrorCode::UNKNOWN_ERROR;
+            }
+            consumed += input_consumed;
+        }
+
+        return Finish(op_handle, AuthorizationSet(), message.substr(consumed), signature,
+                      &out_params, output);
+    }
+
+    /* Encrypts with PKCS7 padding disabled, so the last block is used as is.*/
+    string EncryptRaw(const HidlBuf& key_blob, const string& message) {
+        string ciphertext;
+
+        EXPECT_EQ(ErrorCode::OK,
+                  ProcessMessage(KeyPurpose::ENCRYPT, key_blob,
+                                 AuthorizationSetBuilder()
+                                     .BlockMode(BlockMode::ECB)
+                                     .Padding(PaddingMode::NONE),
+                                 message, 0, "", &ciphertext));
+        return ciphertext;
+    }
+};
+
+TEST_P(KeymasterOperationTest, AesPkcs7RoundTrip) {
+    HidlBuf key_blob;
+    KeyCharacteristics key_characteristics;
+    AuthorizationSet params =
+        AuthorizationSetBuilder().BlockMode(BlockMode::ECB).Padding(PaddingMode::PKCS7);
+
+    ASSERT_EQ(ErrorCode::OK,
+              GenerateKey(AuthorizationSetBuilder()
+                              .AesEncryptionKey(128)
+                              .EcbMode()
+                              .Padding(PaddingMode::PKCS7)
+                              .Authorization(TAG_NO_AUTH_REQUIRED),
+                          &key_blob, &key_characteristics));
+
+    for (size_t i = 0; i <= 48; i++) {
+        string message(i, 'a');
+        string ciphertext;
+        string plaintext;
+
+        ASSERT_EQ(ErrorCode::OK, ProcessMessage(KeyPurpose::ENCRYPT, key_blob, params,
+                                                message, 0, "", &ciphertext));
+        EXPECT_EQ(i + 16 - i % 16, ciphertext.size()) << "Message of " << i << " bytes";
+        ASSERT_EQ(ErrorCode::OK, ProcessMessage(KeyPurpose::DECRYPT, key_blob, params,
+                                                ciphertext, 0, "", &plaintext));
+        EXPECT_EQ(message, plaintext);
+    }
+}
+
+TEST_P(KeymasterOperationTest, AesPkcs7BadPadding) {
+    HidlBuf key_blob;
+    KeyCharacteristics key_characteristics;
+    AuthorizationSet params =
+        AuthorizationSetBuilder().BlockMode(BlockMode::ECB).Padding(PaddingMode::PKCS7);
+
+    ASSERT_EQ(ErrorCode::OK,
+              GenerateKey(AuthorizationSetBuilder()
+                              .AesEncryptionKey(128)
+                              .EcbMode()
+                              .Padding(PaddingMode::NONE, PaddingMode::PKCS7)
+                              .Authorization(TAG_NO_AUTH_REQUIRED),
+                          &key_blob, &key_characteristics));
+
+    /* Last blocks whose pad value is out of range or not repeated */
+    const string bad_blocks[] = {
+        string(15, 'a') + '\x00',
+        string(16, '\x11'),
+        string(16, '\xff'),
+        string(13, 'a') + "\x02\x03\x03",
+        string(1, '\x01') + string(15, '\x10'),
+    };
+
+    for (const string& block : bad_blocks) {
+        string ciphertext = EncryptRaw(key_blob, string(16, 'b') + block);
+        string plaintext;
+
+        ASSERT_EQ(32U, ciphertext.size());
+        EXPECT_EQ(ErrorCode::INVALID_ARGUMENT,
+                  ProcessMessage(KeyPurpose::DECRYPT, key_blob, params, ciphertext, 0, "",
+                                 &plaintext));
+        ciphertext = EncryptRaw(key_blob, block);
+        EXPECT_EQ(ErrorCode::INVALID_ARGUMENT,
+                  ProcessMessage(KeyPurpose::DECRYPT, key_blob, params, ciphertext, 0, "",
+                                 &plaintext));
+    }
+
+    /* A full block of padding is valid */
+    string plaintext;
+    ASSERT_EQ(ErrorCode::OK,
+              ProcessMessage(KeyPurpose::DECRYPT, key_blob, params,
+                             EncryptRaw(key_blob, string(16, 'b') + string(16, '\x10')), 0,
+                             "", &plaintext));
+    EXPECT_EQ(string(16, 'b'), plaintext);
+}
+
+/* Small sign and verify updates are held back by the HAL and sent together,
+   the MAC has to come out as if they went one by one.*/
+TEST_P(KeymasterOperationTest, HmacSmallUpdates) {
+    HidlBuf key_blob;
+    KeyCharacteristics key_characteristics;
+    AuthorizationSet sign_params = AuthorizationSetBuilder()
+                                       .Digest(Digest::SHA_2_256)
+                                       .Authorization(TAG_MAC_LENGTH, 256);
+    AuthorizationSet verify_params = AuthorizationSetBuilder().Digest(Digest::SHA_2_256);
+    /* Long enough for held back input to be flushed by updates */
+    string message(64 * 1024 + 7, 'a');
+
+    for (size_t i = 0; i < message.size(); i++)
+        message[i] = static_cast<char>(i * 31);
+
+    ASSERT_EQ(ErrorCode::OK,
+              GenerateKey(AuthorizationSetBuilder()
+                              .HmacKey(128)
+                              .Digest(Digest::SHA_2_256)
+                              .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                              .Authorization(TAG_NO_AUTH_REQUIRED),
+                          &key_blob, &key_characteristics));
+
+    string mac;
+    ASSERT_EQ(ErrorCode::OK,
+              ProcessMessage(KeyPurpose::SIGN, key_blob, sign_params, message, 0, "", &mac));
+    ASSERT_EQ(32U, mac.size());
+
+    const size_t chunk_sizes[] = {1, 13, 1000, 4096, 20000};
+    for (size_t chunk_size : chunk_sizes) {
+        string chunked_mac;
+        string output;
+
+        ASSERT_EQ(ErrorCode::OK,
+                  ProcessMessage(KeyPurpose::SIGN, key_blob, sign_params, message, chunk_size,
+                                 "", &chunked_mac));
+        EXPECT_EQ(mac, chunked_mac) << "Chunks of " << chunk_size << " bytes";
+        EXPECT_EQ(ErrorCode::OK,
+                  ProcessMessage(KeyPurpose::VERIFY, key_blob, verify_params, message,
+                                 chunk_size, mac, &output))
+            << "Chunks of " << chunk_size << " bytes";
+    }
+
+    /* All updates of a short message are held back and go out with finish */
+    string short_mac;
+    string chunked_mac;
+    ASSERT_EQ(ErrorCode::OK, ProcessMessage(KeyPurpose::SIGN, key_blob, sign_params,
+                                            message.substr(0, 1000), 0, "", &short_mac));
+    ASSERT_EQ(ErrorCode::OK, ProcessMessage(KeyPurpose::SIGN, key_blob, sign_params,
+                                            message.substr(0, 1000), 10, "", &chunked_mac));
+    EXPECT_EQ(short_mac, chunked_mac);
+
+    /* A wrong MAC is still caught with held back input */
+    string output;
+    string bad_mac = mac;
+    bad_mac[0] ^= 1;
+    EXPECT_EQ(ErrorCode::VERIFICATION_FAILED,
+              ProcessMessage(KeyPurpose::VERIFY, key_blob, verify_params, message, 13, bad_mac,
+                             &output));
+}
+
+/* Aborting drops the held back input and the operation with it */
+TEST_P(KeymasterOperationTest, HmacAbortSmallUpdates) {
+    HidlBuf key_blob;
+    KeyCharacteristics key_characteristics;
+    AuthorizationSet out_params;
+    OperationHandle op_handle;
+    size_t input_consumed;
+    string output;
+
+    ASSERT_EQ(ErrorCode::OK,
+              GenerateKey(AuthorizationSetBuilder()
+                              .HmacKey(128)
+                              .Digest(Digest::SHA_2_256)
+                              .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                              .Authorization(TAG_NO_AUTH_REQUIRED),
+                          &key_blob, &key_characteristics));
+
+    ASSERT_EQ(ErrorCode::OK,
+              Begin(KeyPurpose::SIGN, key_blob,
+                    AuthorizationSetBuilder()
+                        .Digest(Digest::SHA_2_256)
+                        .Authorization(TAG_MAC_LENGTH, 256),
+                    &out_params, &op_handle));
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQ(ErrorCode::OK, Update(op_handle, AuthorizationSet(), string(100, 'a'),
+                                        &out_params, &output, &input_consumed));
+        EXPECT_EQ(100U, input_consumed);
+    }
+    EXPECT_TRUE(output.empty());
+
+    EXPECT_EQ(ErrorCode::OK, Abort(op_handle));
+    EXPECT_EQ(ErrorCode::INVALID_OPERATION_HANDLE,
+              Update(op_handle, AuthorizationSet(), string(100, 'a'), &out_params, &output,
+                     &input_consumed));
+    EXPECT_EQ(ErrorCode::INVALID_OPERATION_HANDLE,
+              Finish(op_handle, AuthorizationSet(), "", "", &out_params, &output));
+    EXPECT_EQ(ErrorCode::INVALID_OPERATION_HANDLE, Abort(op_handle));
+}
+
 static const auto kKeymasterDeviceChoices =
         testing::ValuesIn(android::hardware::getAllHalInstanceNames(IKeymasterDevice::descriptor));
 
@@ -613,6 +834,10 @@ GTEST_ALLOW_UNINSTANTIATED_PARAMETERIZED_TEST(KeymasterTagTest);
 INSTANTIATE_TEST_SUITE_P(PerInstance, KeymasterTagTest, kKeymasterDeviceChoices,
                          android::hardware::PrintInstanceNameToString);
 
+GTEST_ALLOW_UNINSTANTIATED_PARAMETERIZED_TEST(KeymasterOperationTest);
+INSTANTIATE_TEST_SUITE_P(PerInstance, KeymasterOperationTest, kKeymasterDeviceChoices,
+                         android::hardware::PrintInstanceNameToString);
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     for (int i = 1; i < argc; ++i) {